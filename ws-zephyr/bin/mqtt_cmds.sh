@@ -9,10 +9,14 @@ if [ "$1" == "ON" ]; then
     msg="ON"
 fi
 
-t1="homeassistant/sump/sensor"
-t2="homeassistant/sump/pump"
-t3="homeassistant/sump/batt"
-t4="homeassistant/sump/availability"
+# Devices publish under <prefix>/<client_id>, the client id is the cert prefix
+id=$(basename "$crt" | cut -d- -f1)
+base="homeassistant/sump/$id"
+
+t1="$base/sensor"
+t2="$base/pump"
+t3="$base/batt"
+t4="$base/availability"
 
 mosquitto_pub --cafile $cafile --cert $crt --key $key -h $host -p 8883  -t $t1 -m "$msg"
 mosquitto_pub --cafile $cafile --cert $crt --key $key -h $host -p 8883  -t $t2 -m "$msg"
@@ -17,6 +17,7 @@
 #include <zephyr/logging/log.h>
 
 #include "battery.h"
+#include "pss_config.h"
 
 LOG_MODULE_REGISTER(battery, CONFIG_BATTERY_LOG_LEVEL);
 
@@ -200,19 +201,23 @@ uint8_t battery_level_pptt(uint32_t batt_mV)
 {
     uint32_t mV_max, mV_min, upper, lower, numerator, denominator, val = 100;
     const uint32_t multiplier = 100;
+    pss_config_t cfg;
     uint8_t ret;
 
-    if (batt_mV > CONFIG_BATTERY_LIB_LOW_VOLTAGE) {
-        mV_max = CONFIG_BATTERY_LIB_MAX_VOLTAGE;
-        mV_min = CONFIG_BATTERY_LIB_LOW_VOLTAGE;
+    // The discharge curve can be tuned at runtime
+    pss_config_get(&cfg);
+
+    if (batt_mV > cfg.batt_low_mv) {
+        mV_max = cfg.batt_max_mv;
+        mV_min = cfg.batt_low_mv;
         upper = 100;
-        lower = CONFIG_BATTERY_LIB_LOW_VOLTAGE_PERCENT;
-    } else if (batt_mV <= CONFIG_BATTERY_LIB_MIN_OPERATING_VOLTAGE) {
+        lower = cfg.batt_low_percent;
+    } else if (batt_mV <= cfg.batt_min_mv) {
         val = 0;
     } else {
-        mV_max = CONFIG_BATTERY_LIB_LOW_VOLTAGE;
-        mV_min = CONFIG_BATTERY_LIB_MIN_OPERATING_VOLTAGE;
-        upper = CONFIG_BATTERY_LIB_LOW_VOLTAGE_PERCENT;
+        mV_max = cfg.batt_low_mv;
+        mV_min = cfg.batt_min_mv;
+        upper = cfg.batt_low_percent;
         lower = 0;
     }
 
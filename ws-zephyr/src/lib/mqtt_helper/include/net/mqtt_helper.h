@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2023 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef MQTT_HELPER__
+#define MQTT_HELPER__
+
+#include <stdio.h>
+#include <zephyr/net/mqtt.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup mqtt_helper MQTT helper library
+ * @{
+ * @brief Convenience library that simplifies Zephyr MQTT API and socket handling.
+ *
+ * Local copy of the nRF Connect SDK library. It takes precedence over the
+ * SDK header and adds the last will, session and statistics extensions
+ * used by this application.
+ */
+
+/** @brief MQTT connection states. */
+enum mqtt_state {
+	MQTT_STATE_UNINIT,
+	MQTT_STATE_DISCONNECTED,
+	MQTT_STATE_TRANSPORT_CONNECTING,
+	MQTT_STATE_CONNECTING,
+	MQTT_STATE_TRANSPORT_CONNECTED,
+	MQTT_STATE_CONNECTED,
+	MQTT_STATE_DISCONNECTING,
+
+	MQTT_STATE_COUNT,
+};
+
+/** @brief MQTT helper error types. */
+enum mqtt_helper_error {
+	/** The received payload is larger than the payload buffer. */
+	MQTT_HELPER_ERROR_MSG_SIZE,
+};
+
+/** @brief Release assistance hints, see mqtt_helper_rai_set(). */
+enum mqtt_helper_rai {
+	/** No more data, release the radio now. */
+	MQTT_HELPER_RAI_NO_DATA,
+	/** The next send is the last one for a while. */
+	MQTT_HELPER_RAI_LAST,
+	/** The next send is followed by one response, then nothing. */
+	MQTT_HELPER_RAI_ONE_RESP,
+	/** More data follows, keep the radio up. */
+	MQTT_HELPER_RAI_ONGOING,
+};
+
+/** @brief Structure holding a buffer pointer and its size. */
+struct mqtt_helper_buf {
+	char *ptr;
+	size_t size;
+};
+
+/** @brief Parameters of a connection attempt. */
+struct mqtt_helper_conn_params {
+	/* The hostname must be null-terminated. */
+	struct mqtt_helper_buf hostname;
+	struct mqtt_helper_buf device_id;
+	struct mqtt_helper_buf user_name;
+	/** Last will topic, NULL for no last will. */
+	struct mqtt_topic *will_topic;
+	/** Last will message. */
+	struct mqtt_utf8 *will_message;
+	/** Retain flag of the last will. */
+	uint8_t will_retain;
+	/** Broker port, 0 for CONFIG_MY_MQTT_HELPER_PORT. */
+	uint16_t port;
+	/** Security tag, 0 for CONFIG_MY_MQTT_HELPER_SEC_TAG and its secondary
+	 *  tag, MQTT_HELPER_SEC_TAG_NONE for plain TCP.
+	 */
+	int sec_tag;
+};
+
+/** @brief Security tag of a plain TCP connection, see mqtt_helper_conn_params. */
+#define MQTT_HELPER_SEC_TAG_NONE -1
+
+typedef void (*mqtt_helper_handler_t)(enum mqtt_helper_error error);
+typedef void (*mqtt_helper_on_connack_t)(enum mqtt_conn_return_code return_code);
+typedef void (*mqtt_helper_on_disconnect_t)(int result);
+typedef void (*mqtt_helper_on_publish_t)(struct mqtt_helper_buf topic_buf,
+					 struct mqtt_helper_buf payload_buf);
+/** Part of an incoming payload, chunks arrive in order. The topic stays
+ *  valid until the last chunk. Return 0 to continue, a negative value to
+ *  drop the rest of the message. It is acknowledged either way, a
+ *  redelivery would be dropped again.
+ */
+typedef int (*mqtt_helper_on_publish_chunk_t)(struct mqtt_helper_buf topic_buf,
+					      size_t offset,
+					      struct mqtt_helper_buf chunk_buf,
+					      size_t total_len);
+typedef void (*mqtt_helper_on_puback_t)(uint16_t message_id, int result);
+typedef void (*mqtt_helper_on_suback_t)(uint16_t message_id, int result);
+typedef void (*mqtt_helper_on_pingresp_t)(void);
+typedef void (*mqtt_helper_on_error_t)(enum mqtt_helper_error error);
+/** Application work run in the service thread while a connection is open.
+ *  Returns the milliseconds until it wants to run again, or SYS_FOREVER_MS
+ *  to wait for mqtt_helper_wake().
+ */
+typedef int32_t (*mqtt_helper_on_service_t)(void);
+
+/** @brief Library configuration. */
+struct mqtt_helper_cfg {
+	struct {
+		mqtt_helper_on_connack_t on_connack;
+		mqtt_helper_on_disconnect_t on_disconnect;
+		mqtt_helper_on_publish_t on_publish;
+		/* Replaces on_publish, payloads are not limited by the payload buffer. */
+		mqtt_helper_on_publish_chunk_t on_publish_chunk;
+		mqtt_helper_on_puback_t on_puback;
+		mqtt_helper_on_suback_t on_suback;
+		mqtt_helper_on_pingresp_t on_pingresp;
+		mqtt_helper_on_error_t on_error;
+		mqtt_helper_on_service_t on_service;
+	} cb;
+};
+
+/** @brief Connection statistics, see mqtt_helper_stats_get(). */
+struct mqtt_helper_stats {
+	/** Transport connects attempted, TCP + TLS handshake + CONNECT. */
+	uint32_t connects;
+	/** Transport connects that failed. */
+	uint32_t connect_failures;
+	/** Connects made with no cached TLS session to resume. */
+	uint32_t full_handshakes;
+	/** Connects that offered a cached TLS session for resumption. */
+	uint32_t resume_attempts;
+	/** Duration of the last transport connect in ms. */
+	uint32_t last_connect_ms;
+	/** Total transport connect time of full handshakes in ms. */
+	uint32_t full_connect_ms;
+	/** Total transport connect time of resumption attempts in ms. */
+	uint32_t resume_connect_ms;
+	/** Hostname resolutions sent to DNS. */
+	uint32_t dns_lookups;
+	/** Hostname resolutions that failed. */
+	uint32_t dns_failures;
+	/** Connects that used a cached broker address within its TTL. */
+	uint32_t dns_cache_hits;
+	/** Connects that fell back to the last known address after a failed resolution. */
+	uint32_t dns_fallbacks;
+	/** Duration of the last resolution in ms. */
+	uint32_t last_dns_ms;
+	/** Release assistance hints given to the modem. */
+	uint32_t rai_hints;
+	/** Incoming publishes delivered. */
+	uint32_t rx_publishes;
+	/** Payload bytes of the delivered publishes. */
+	uint32_t rx_payload_bytes;
+	/** Time spent reading and delivering those payloads in ms. */
+	uint32_t rx_payload_ms;
+	/** Largest delivered payload. */
+	uint32_t rx_payload_max;
+	/** Keepalive pings sent. */
+	uint32_t pings;
+	/** Pings not answered within the PINGRESP timeout. */
+	uint32_t ping_timeouts;
+	/** Round trip of the last answered ping in ms. */
+	uint32_t last_ping_rtt_ms;
+	/** Idle interval after which the next ping is sent, in seconds. */
+	uint32_t keepalive_sec;
+	/** Longest idle interval known to survive the NAT, in seconds. */
+	uint32_t keepalive_lo_sec;
+	/** Shortest idle interval known to lose the connection, in seconds. */
+	uint32_t keepalive_hi_sec;
+};
+
+/** @brief Initialize the MQTT helper.
+ *
+ *  @param cfg Pointer to the configuration of the library.
+ *
+ *  @retval 0 if successful.
+ *  @retval -EOPNOTSUPP if the library is in the wrong state.
+ */
+int mqtt_helper_init(struct mqtt_helper_cfg *cfg);
+
+/** @brief Connect to an MQTT broker.
+ *
+ *  @param conn_params Pointer to the connection parameters.
+ *
+ *  @retval 0 if the connection request was sent.
+ *  @retval -EOPNOTSUPP if the library is in the wrong state.
+ *  @return Otherwise a negative error code.
+ */
+int mqtt_helper_connect(struct mqtt_helper_conn_params *conn_params);
+
+/** @brief Disconnect from the MQTT broker.
+ *
+ *  @retval 0 if the disconnection request was sent.
+ *  @retval -EOPNOTSUPP if the library is in the wrong state.
+ */
+int mqtt_helper_disconnect(void);
+
+/** @brief Subscribe to MQTT topics.
+ *
+ *  @param sub_list Pointer to the list of topics.
+ *
+ *  @retval 0 if the subscription request was sent.
+ *  @retval -EOPNOTSUPP if the library is in the wrong state.
+ */
+int mqtt_helper_subscribe(struct mqtt_subscription_list *sub_list);
+
+/** @brief Publish an MQTT message.
+ *
+ *  @param param Pointer to the publish parameters.
+ *
+ *  @retval 0 if the message was sent.
+ *  @retval -EOPNOTSUPP if the library is in the wrong state.
+ */
+int mqtt_helper_publish(const struct mqtt_publish_param *param);
+
+/** @brief Deinitialize the library.
+ *
+ *  @retval 0 if successful.
+ *  @retval -EOPNOTSUPP if the library is in the wrong state.
+ */
+int mqtt_helper_deinit(void);
+
+/** @brief Drop the cached TLS session, the next connect does a full handshake.
+ *  Call after the credentials of the security tag change.
+ */
+void mqtt_helper_tls_session_invalidate(void);
+
+/** @brief Give the modem a release assistance hint for the MQTT socket.
+ *
+ *  @param rai The hint.
+ *
+ *  @retval 0 if the hint was set.
+ *  @retval -ENOTSUP if release assistance is not enabled or not supported.
+ *  @retval -ENOTCONN if there is no socket.
+ */
+int mqtt_helper_rai_set(enum mqtt_helper_rai rai);
+
+/** @brief Run the on_service callback in the service thread.
+ *  Can be called from any thread or ISR, also before a connection is open.
+ */
+void mqtt_helper_wake(void);
+
+/** @brief Read the connection statistics.
+ *
+ *  @param stats Destination.
+ */
+void mqtt_helper_stats_get(struct mqtt_helper_stats *stats);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MQTT_HELPER__ */
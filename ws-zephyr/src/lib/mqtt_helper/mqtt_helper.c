@@ -16,7 +16,14 @@
 #endif /* CONFIG_POSIX_API */
 
 #include <net/mqtt_helper.h>
+#include <zephyr/kernel.h>
 #include <zephyr/net/mqtt.h>
+#include <zephyr/sys/atomic.h>
+#if defined(CONFIG_MY_MQTT_HELPER_DNS_CACHE_PERSIST) || \
+	defined(CONFIG_MY_MQTT_HELPER_KEEPALIVE_PERSIST)
+#include <zephyr/settings/settings.h>
+#define MQTT_HELPER_SETTINGS 1
+#endif
 
 #if defined(CONFIG_MY_MQTT_HELPER_PROVISION_CERTIFICATES)
 #include CONFIG_MY_MQTT_HELPER_CERTIFICATES_FILE
@@ -38,12 +45,59 @@ BUILD_ASSERT((CONFIG_MY_MQTT_HELPER_SEC_TAG != -1), "Security tag must be config
 
 MQTT_HELPER_STATIC struct mqtt_client mqtt_client;
 static struct sockaddr_storage broker;
+/* Port of the current connection, in host order. */
+static uint16_t broker_port = CONFIG_MY_MQTT_HELPER_PORT;
 static char rx_buffer[CONFIG_MY_MQTT_HELPER_RX_TX_BUFFER_SIZE];
 static char tx_buffer[CONFIG_MY_MQTT_HELPER_RX_TX_BUFFER_SIZE];
 MQTT_HELPER_STATIC char payload_buf[CONFIG_MY_MQTT_HELPER_PAYLOAD_BUFFER_LEN];
 MQTT_HELPER_STATIC K_SEM_DEFINE(connection_poll_sem, 0, 1);
 static struct mqtt_helper_cfg current_cfg;
 MQTT_HELPER_STATIC enum mqtt_state mqtt_state = MQTT_STATE_UNINIT;
+static struct mqtt_helper_stats stats;
+
+#if defined(CONFIG_MY_MQTT_HELPER_TLS_CIPHERS_RSA)
+#define CIPHER_PROFILE "rsa"
+static int cipher_list[] = {
+	0xC02F, /* TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256 */
+	0xC027, /* TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256 */
+};
+#elif defined(CONFIG_MY_MQTT_HELPER_TLS_CIPHERS_ECDSA)
+#define CIPHER_PROFILE "ecdsa"
+static int cipher_list[] = {
+	0xC02B, /* TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256 */
+	0xC023, /* TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256 */
+};
+#else
+#define CIPHER_PROFILE "default"
+#endif
+/* A session from an earlier connect is cached and may be resumed. */
+static bool session_cached;
+/* Credentials changed, the cached session must not be offered again. */
+static atomic_t session_purge = ATOMIC_INIT(0);
+#if defined(CONFIG_MY_MQTT_HELPER_SERVICE)
+/* Given by mqtt_helper_wake(). The offloaded poll() only takes modem sockets,
+ * so on_service runs in its own thread, which sleeps on this semaphore.
+ */
+static K_SEM_DEFINE(service_sem, 0, 1);
+/* Held while the poll loop handles socket events and while on_service runs,
+ * so the callbacks and the application's writes never run at once.
+ */
+static K_MUTEX_DEFINE(socket_lock);
+#endif /* CONFIG_MY_MQTT_HELPER_SERVICE */
+
+static void socket_lock_take(void)
+{
+#if defined(CONFIG_MY_MQTT_HELPER_SERVICE)
+	k_mutex_lock(&socket_lock, K_FOREVER);
+#endif /* CONFIG_MY_MQTT_HELPER_SERVICE */
+}
+
+static void socket_lock_give(void)
+{
+#if defined(CONFIG_MY_MQTT_HELPER_SERVICE)
+	k_mutex_unlock(&socket_lock);
+#endif /* CONFIG_MY_MQTT_HELPER_SERVICE */
+}
 
 static const char *state_name_get(enum mqtt_state state)
 {
@@ -143,6 +197,19 @@ static bool mqtt_state_verify(enum mqtt_state state)
 	return (mqtt_state_get() == state);
 }
 
+static int mqtt_socket_get(void)
+{
+#if defined(CONFIG_MQTT_LIB_TLS)
+	if (mqtt_client.transport.type == MQTT_TRANSPORT_NON_SECURE) {
+		return mqtt_client.transport.tcp.sock;
+	}
+
+	return mqtt_client.transport.tls.sock;
+#else
+	return mqtt_client.transport.tcp.sock;
+#endif /* CONFIG_MQTT_LIB_TLS */
+}
+
 #if defined(CONFIG_MY_MQTT_HELPER_PROVISION_CERTIFICATES)
 static int certificates_provision(void)
 {
@@ -231,11 +298,63 @@ static int certificates_provision(void)
 }
 #endif /* CONFIG_MY_MQTT_HELPER_PROVISION_CERTIFICATES */
 
-static int publish_get_payload(struct mqtt_client *const mqtt_client, size_t length)
+/* Read the payload through payload_buf in chunks, handing each to the
+ * callback. After a rejected chunk the rest is read and dropped, the
+ * stream has to stay in sync. Returns a socket read error, the callback
+ * result goes to result.
+ */
+static int publish_stream_payload(struct mqtt_client *const mqtt_client,
+				  struct mqtt_helper_buf topic, size_t length, int *result)
+{
+	int ret;
+	size_t offset = 0;
+	struct mqtt_helper_buf chunk = {
+		.ptr = payload_buf,
+	};
+
+	*result = 0;
+
+	if ((length == 0) && current_cfg.cb.on_publish_chunk) {
+		/* An empty payload, e.g. a cleared retained message. */
+		*result = current_cfg.cb.on_publish_chunk(topic, 0, chunk, 0);
+		return 0;
+	}
+
+	while (offset < length) {
+		ret = mqtt_read_publish_payload_blocking(mqtt_client, payload_buf,
+							 MIN(length - offset, sizeof(payload_buf)));
+		if (ret < 0) {
+			return ret;
+		} else if (ret == 0) {
+			return -EIO;
+		}
+
+		if ((*result == 0) && current_cfg.cb.on_publish_chunk) {
+			chunk.size = ret;
+			*result = current_cfg.cb.on_publish_chunk(topic, offset, chunk, length);
+		}
+
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static int publish_get_payload(struct mqtt_client *const mqtt_client, size_t length,
+			       int *result)
 {
+	int err;
+	struct mqtt_helper_buf none = {0};
+
+	*result = 0;
+
 	if (length > sizeof(payload_buf)) {
 		LOG_ERR("Incoming MQTT message too large for payload buffer");
-		return -EMSGSIZE;
+
+		err = publish_stream_payload(mqtt_client, none, length, result);
+		*result = -EMSGSIZE;
+
+		return err;
 	}
 
 	return mqtt_readall_publish_payload(mqtt_client, payload_buf, length);
@@ -260,6 +379,7 @@ static void send_ack(struct mqtt_client *const mqtt_client, uint16_t message_id)
 MQTT_HELPER_STATIC void on_publish(const struct mqtt_evt *mqtt_evt)
 {
 	int err;
+	int result;
 	const struct mqtt_publish_param *p = &mqtt_evt->param.publish;
 	struct mqtt_helper_buf topic = {
 		.ptr = (char *)p->message.topic.topic.utf8,
@@ -268,29 +388,52 @@ MQTT_HELPER_STATIC void on_publish(const struct mqtt_evt *mqtt_evt)
 	struct mqtt_helper_buf payload = {
 		.ptr = payload_buf,
 	};
+	int64_t start = k_uptime_get();
+
+	if (current_cfg.cb.on_publish_chunk) {
+		err = publish_stream_payload(&mqtt_client, topic, p->message.payload.len, &result);
+	} else {
+		err = publish_get_payload(&mqtt_client, p->message.payload.len, &result);
+	}
 
-	err = publish_get_payload(&mqtt_client, p->message.payload.len);
 	if (err) {
-		LOG_ERR("publish_get_payload, error: %d", err);
+		/* The stream is out of sync, the broker redelivers without an ACK. */
+		LOG_ERR("Reading the publish payload, error: %d", err);
+		return;
+	}
+
+	/* The message was read in full. A rejected one is acknowledged too,
+	 * a redelivery would be rejected again.
+	 */
+	if (p->message.topic.qos == MQTT_QOS_1_AT_LEAST_ONCE) {
+		send_ack(&mqtt_client, p->message_id);
+	}
 
-		if (current_cfg.cb.on_error) {
+	if (result) {
+		LOG_ERR("Publish rejected, error: %d", result);
+
+		if ((result == -EMSGSIZE) && current_cfg.cb.on_error) {
 			current_cfg.cb.on_error(MQTT_HELPER_ERROR_MSG_SIZE);
 		}
 
 		return;
 	}
 
-	if (p->message.topic.qos == MQTT_QOS_1_AT_LEAST_ONCE) {
-		send_ack(&mqtt_client, p->message_id);
-	}
+	stats.rx_publishes++;
+	stats.rx_payload_bytes += p->message.payload.len;
+	stats.rx_payload_ms += (uint32_t)k_uptime_delta(&start);
+	stats.rx_payload_max = MAX(stats.rx_payload_max, p->message.payload.len);
 
 	payload.size = p->message.payload.len;
 
-	if (current_cfg.cb.on_publish) {
+	if (current_cfg.cb.on_publish && !current_cfg.cb.on_publish_chunk) {
 		current_cfg.cb.on_publish(topic, payload);
 	}
 }
 
+/* Defined with the keepalive handling below. */
+static void pingresp_received(void);
+
 MQTT_HELPER_STATIC void mqtt_evt_handler(struct mqtt_client *const mqtt_client,
 			     const struct mqtt_evt *mqtt_evt)
 {
@@ -300,6 +443,9 @@ MQTT_HELPER_STATIC void mqtt_evt_handler(struct mqtt_client *const mqtt_client,
 
 		if (mqtt_evt->param.connack.return_code == MQTT_CONNECTION_ACCEPTED) {
 			mqtt_state_set(MQTT_STATE_CONNECTED);
+			session_cached = IS_ENABLED(CONFIG_MY_MQTT_HELPER_TLS_SESSION_CACHE);
+			/* Wakes given before the connection found nothing to do. */
+			mqtt_helper_wake();
 		} else {
 			mqtt_state_set(MQTT_STATE_DISCONNECTED);
 		}
@@ -346,6 +492,8 @@ MQTT_HELPER_STATIC void mqtt_evt_handler(struct mqtt_client *const mqtt_client,
 	case MQTT_EVT_PINGRESP:
 		LOG_DBG("MQTT_EVT_PINGRESP");
 
+		pingresp_received();
+
 		if (current_cfg.cb.on_pingresp) {
 			current_cfg.cb.on_pingresp();
 		}
@@ -355,16 +503,267 @@ MQTT_HELPER_STATIC void mqtt_evt_handler(struct mqtt_client *const mqtt_client,
 	}
 }
 
-static int broker_init(struct sockaddr_storage *broker,
-		       struct mqtt_helper_conn_params *conn_params)
+static void broker_port_set(struct sockaddr_storage *broker)
+{
+	if (broker->ss_family == AF_INET6) {
+		((struct sockaddr_in6 *)broker)->sin6_port = htons(broker_port);
+	} else {
+		((struct sockaddr_in *)broker)->sin_port = htons(broker_port);
+	}
+}
+
+static void broker_log(const struct sockaddr_storage *broker, const char *source)
+{
+	char addr_str[NET_IPV6_ADDR_LEN];
+	const void *addr = (broker->ss_family == AF_INET6) ?
+		(const void *)&((const struct sockaddr_in6 *)broker)->sin6_addr :
+		(const void *)&((const struct sockaddr_in *)broker)->sin_addr;
+
+	inet_ntop(broker->ss_family, addr, addr_str, sizeof(addr_str));
+	LOG_DBG("Broker address %s (%s), %s", addr_str, net_family2str(broker->ss_family), source);
+}
+
+/* Resolve the hostname into the list of broker addresses.
+ * Returns the number of addresses found or a negative error.
+ */
+static int broker_resolve(const char *hostname, struct sockaddr_storage *addrs, size_t max)
 {
 	int err;
+	size_t count = 0;
 	struct addrinfo *result;
 	struct addrinfo *addr;
 	struct addrinfo hints = {
 		.ai_socktype = SOCK_STREAM
 	};
-	char addr_str[NET_IPV6_ADDR_LEN];
+
+	int64_t start = k_uptime_get();
+
+	stats.dns_lookups++;
+
+	err = getaddrinfo(hostname, NULL, &hints, &result);
+	stats.last_dns_ms = (uint32_t)k_uptime_delta(&start);
+	if (err) {
+		stats.dns_failures++;
+		LOG_ERR("getaddrinfo() failed, error %d", err);
+		return -err;
+	}
+
+	for (addr = result; (addr != NULL) && (count < max); addr = addr->ai_next) {
+		memset(&addrs[count], 0, sizeof(addrs[count]));
+
+		if (addr->ai_family == AF_INET6) {
+			memcpy(&addrs[count], addr->ai_addr, sizeof(struct sockaddr_in6));
+		} else if (addr->ai_family == AF_INET) {
+			memcpy(&addrs[count], addr->ai_addr, sizeof(struct sockaddr_in));
+		} else {
+			LOG_DBG("Unknown address family %d", (unsigned int)addr->ai_family);
+			continue;
+		}
+
+		addrs[count].ss_family = addr->ai_family;
+		broker_port_set(&addrs[count]);
+		count++;
+	}
+
+	freeaddrinfo(result);
+
+	return (count > 0) ? (int)count : -EHOSTUNREACH;
+}
+
+#if defined(CONFIG_MY_MQTT_HELPER_DNS_CACHE)
+/* Resolved broker addresses of one hostname, reused until the TTL runs out
+ * and kept as the last known good set when resolution fails.
+ */
+struct dns_cache {
+	char hostname[CONFIG_MY_MQTT_HELPER_DNS_CACHE_HOSTNAME_LEN];
+	uint8_t count;
+	struct sockaddr_storage addrs[CONFIG_MY_MQTT_HELPER_DNS_CACHE_ADDRS];
+};
+
+/* One entry per hostname, a failover list switches between them. */
+struct dns_entry {
+	struct dns_cache cache;
+	/* Address used by the next connect, rotated when it fails. */
+	uint8_t next;
+	bool fresh;
+	int64_t resolved_ms;
+	int64_t used_ms;
+};
+
+static struct dns_entry dns_entries[CONFIG_MY_MQTT_HELPER_DNS_CACHE_HOSTS];
+/* Entry of the current connect. */
+static struct dns_entry *dns_current;
+
+#if defined(CONFIG_MY_MQTT_HELPER_DNS_CACHE_PERSIST)
+static int dns_settings_set(const char *key, size_t len, settings_read_cb read_cb,
+			    void *cb_arg)
+{
+	unsigned long index = strtoul(key, NULL, 10);
+	struct dns_cache *cache;
+
+	if (index >= ARRAY_SIZE(dns_entries)) {
+		return 0;
+	}
+
+	cache = &dns_entries[index].cache;
+	if (len != sizeof(*cache) || read_cb(cb_arg, cache, len) != (ssize_t)len) {
+		memset(cache, 0, sizeof(*cache));
+		return 0;
+	}
+
+	/* The age is unknown after a reboot, only use it as a fallback. */
+	dns_entries[index].fresh = false;
+	cache->count = MIN(cache->count, ARRAY_SIZE(cache->addrs));
+
+	return 0;
+}
+
+static void dns_cache_save(const struct dns_entry *entry)
+{
+	char key[sizeof("mqtt_helper/dns/") + 3];
+	int err;
+
+	snprintk(key, sizeof(key), "mqtt_helper/dns/%u", (unsigned int)(entry - dns_entries));
+
+	err = settings_save_one(key, &entry->cache, sizeof(entry->cache));
+	if (err) {
+		LOG_WRN("Failed to save broker addresses, error: %d", err);
+	}
+}
+#endif /* CONFIG_MY_MQTT_HELPER_DNS_CACHE_PERSIST */
+
+static struct dns_entry *dns_cache_find(const char *hostname)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(dns_entries); i++) {
+		if ((dns_entries[i].cache.count > 0) &&
+		    (strcmp(dns_entries[i].cache.hostname, hostname) == 0)) {
+			return &dns_entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* An empty entry, or the one used least recently. */
+static struct dns_entry *dns_cache_claim(const char *hostname)
+{
+	struct dns_entry *entry = &dns_entries[0];
+
+	for (size_t i = 0; i < ARRAY_SIZE(dns_entries); i++) {
+		if (dns_entries[i].cache.count == 0) {
+			entry = &dns_entries[i];
+			break;
+		}
+
+		if (dns_entries[i].used_ms < entry->used_ms) {
+			entry = &dns_entries[i];
+		}
+	}
+
+	memset(entry, 0, sizeof(*entry));
+	strncpy(entry->cache.hostname, hostname, sizeof(entry->cache.hostname) - 1);
+
+	return entry;
+}
+
+/* Round-robin DNS reorders its answers, only the set of addresses counts. */
+static bool dns_cache_same_set(const struct dns_cache *cache,
+			       const struct sockaddr_storage *addrs, int count)
+{
+	if (cache->count != count) {
+		return false;
+	}
+
+	for (int i = 0; i < count; i++) {
+		bool found = false;
+
+		for (int j = 0; (j < count) && !found; j++) {
+			found = (memcmp(&cache->addrs[j], &addrs[i], sizeof(addrs[i])) == 0);
+		}
+
+		if (!found) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static int dns_cache_lookup(struct sockaddr_storage *broker, const char *hostname)
+{
+	int count;
+	struct sockaddr_storage addrs[CONFIG_MY_MQTT_HELPER_DNS_CACHE_ADDRS];
+	struct dns_entry *entry = dns_cache_find(hostname);
+	int64_t now = k_uptime_get();
+
+	if ((entry != NULL) && entry->fresh &&
+	    (now - entry->resolved_ms) < (CONFIG_MY_MQTT_HELPER_DNS_CACHE_TTL_SEC * MSEC_PER_SEC)) {
+		stats.dns_cache_hits++;
+		entry->used_ms = now;
+		dns_current = entry;
+		*broker = entry->cache.addrs[entry->next % entry->cache.count];
+		broker_log(broker, "cached");
+		return 0;
+	}
+
+	count = broker_resolve(hostname, addrs, ARRAY_SIZE(addrs));
+	if (count < 0) {
+		if (entry == NULL) {
+			return count;
+		}
+
+		stats.dns_fallbacks++;
+		LOG_WRN("Resolution failed, using last known address");
+		entry->used_ms = now;
+		dns_current = entry;
+		*broker = entry->cache.addrs[entry->next % entry->cache.count];
+		broker_log(broker, "last known good");
+		return 0;
+	}
+
+	if (entry == NULL) {
+		entry = dns_cache_claim(hostname);
+	}
+
+	if (!dns_cache_same_set(&entry->cache, addrs, count)) {
+		/* A new set, start over at its first address. */
+		memset(entry->cache.addrs, 0, sizeof(entry->cache.addrs));
+		memcpy(entry->cache.addrs, addrs, count * sizeof(addrs[0]));
+		entry->cache.count = count;
+		entry->next = 0;
+
+#if defined(CONFIG_MY_MQTT_HELPER_DNS_CACHE_PERSIST)
+		dns_cache_save(entry);
+#endif /* CONFIG_MY_MQTT_HELPER_DNS_CACHE_PERSIST */
+	}
+
+	entry->fresh = true;
+	entry->resolved_ms = now;
+	entry->used_ms = now;
+	dns_current = entry;
+
+	*broker = entry->cache.addrs[entry->next % entry->cache.count];
+	broker_log(broker, "resolved");
+
+	return 0;
+}
+
+/* The connect to the current address failed, try the next one next time. */
+static void dns_cache_rotate(void)
+{
+	struct dns_entry *entry = dns_current;
+
+	if ((entry != NULL) && (entry->cache.count > 1)) {
+		entry->next = (entry->next + 1) % entry->cache.count;
+		LOG_DBG("Rotating to broker address %d of %d", entry->next + 1, entry->cache.count);
+	}
+}
+#endif /* CONFIG_MY_MQTT_HELPER_DNS_CACHE */
+
+static int broker_init(struct sockaddr_storage *broker,
+		       struct mqtt_helper_conn_params *conn_params)
+{
+	int count;
 
 	if (sizeof(CONFIG_MY_MQTT_HELPER_STATIC_IP_ADDRESS) > 1) {
 		conn_params->hostname.ptr = CONFIG_MY_MQTT_HELPER_STATIC_IP_ADDRESS;
@@ -372,64 +771,307 @@ static int broker_init(struct sockaddr_storage *broker,
 		LOG_DBG("Using static IP address: %s", CONFIG_MY_MQTT_HELPER_STATIC_IP_ADDRESS);
 	} else {
 		LOG_DBG("Resolving IP address for %s", conn_params->hostname.ptr);
+
+#if defined(CONFIG_MY_MQTT_HELPER_DNS_CACHE)
+		int err = dns_cache_lookup(broker, conn_params->hostname.ptr);
+
+		/* The cache may hold the addresses with the port of another broker entry. */
+		broker_port_set(broker);
+		return err;
+#endif /* CONFIG_MY_MQTT_HELPER_DNS_CACHE */
+	}
+
+	count = broker_resolve(conn_params->hostname.ptr, broker, 1);
+	if (count < 0) {
+		return count;
+	}
+
+	broker_log(broker, "resolved");
+
+	return 0;
+}
+
+#if defined(CONFIG_MY_MQTT_HELPER_TLS_SESSION_CACHE)
+/* Drop the cached session if the credentials changed.
+ * Returns false if a stale session could still be offered.
+ */
+static bool tls_session_purge(sec_tag_t *sec_tag_list, size_t sec_tag_count)
+{
+	int err;
+	int sock;
+	int dummy = 0;
+
+	if (!atomic_cas(&session_purge, 1, 0)) {
+		return true;
+	}
+
+	session_cached = false;
+
+	/* The cache is owned by the TLS stack, purge it through a throwaway socket
+	 * carrying the same security tags.
+	 */
+	sock = socket(broker.ss_family, SOCK_STREAM, IPPROTO_TLS_1_2);
+	if (sock < 0) {
+		err = -1;
+	} else {
+		err = setsockopt(sock, SOL_TLS, TLS_SEC_TAG_LIST, sec_tag_list,
+				 sec_tag_count * sizeof(sec_tag_t));
+		if (err == 0) {
+			err = setsockopt(sock, SOL_TLS, TLS_SESSION_CACHE_PURGE,
+					 &dummy, sizeof(dummy));
+		}
+
+		(void)close(sock);
 	}
 
-	err = getaddrinfo(conn_params->hostname.ptr, NULL, &hints, &result);
 	if (err) {
-		LOG_ERR("getaddrinfo() failed, error %d", err);
-		return -err;
+		LOG_WRN("Failed to purge TLS session cache, errno: %d", errno);
+		/* Try again on the next connect. */
+		(void)atomic_set(&session_purge, 1);
+		return false;
 	}
 
-	addr = result;
+	LOG_DBG("TLS session cache purged");
 
-	while (addr != NULL) {
-		if (addr->ai_family == AF_INET6) {
-			struct sockaddr_in6 *broker6 = ((struct sockaddr_in6 *)broker);
+	return true;
+}
+#endif /* CONFIG_MY_MQTT_HELPER_TLS_SESSION_CACHE */
 
-			net_ipaddr_copy(&broker6->sin6_addr,
-					&((struct sockaddr_in6 *)addr->ai_addr)->sin6_addr);
-			broker6->sin6_family = addr->ai_family;
-			broker6->sin6_port = htons(CONFIG_MY_MQTT_HELPER_PORT);
+/* A PINGREQ is outstanding since this uptime, -1 if none. */
+static int64_t ping_sent_ms = -1;
+/* Idle time of the link before the outstanding PINGREQ. */
+static uint32_t ping_idle_ms;
+/* Uptime of the last received data, downlink refreshes the NAT binding too. */
+static uint32_t last_rx_ms;
 
-			inet_ntop(addr->ai_family, &broker6->sin6_addr, addr_str,
-				sizeof(addr_str));
-			LOG_DBG("IPv6 Address found %s (%s)", addr_str,
-				net_family2str(addr->ai_family));
-			break;
-		} else if (addr->ai_family == AF_INET) {
-			struct sockaddr_in *broker4 = ((struct sockaddr_in *)broker);
+static uint32_t link_idle_ms(void)
+{
+	return k_uptime_get_32() - MAX(mqtt_client.internal.last_activity, last_rx_ms);
+}
 
-			net_ipaddr_copy(&broker4->sin_addr,
-					&((struct sockaddr_in *)addr->ai_addr)->sin_addr);
-			broker4->sin_family = addr->ai_family;
-			broker4->sin_port = htons(CONFIG_MY_MQTT_HELPER_PORT);
+#if defined(CONFIG_MY_MQTT_HELPER_KEEPALIVE_ADAPTIVE)
+BUILD_ASSERT(CONFIG_MY_MQTT_HELPER_KEEPALIVE_MIN_SEC < CONFIG_MQTT_KEEPALIVE,
+	     "Keepalive search needs room below MQTT_KEEPALIVE");
+BUILD_ASSERT(CONFIG_MY_MQTT_HELPER_PINGRESP_TIMEOUT_SEC < CONFIG_MY_MQTT_HELPER_KEEPALIVE_MIN_SEC,
+	     "PINGRESP timeout must be shorter than the shortest keepalive");
 
-			inet_ntop(addr->ai_family, &broker4->sin_addr, addr_str,
-				sizeof(addr_str));
-			LOG_DBG("IPv4 Address found %s (%s)", addr_str,
-				net_family2str(addr->ai_family));
-			break;
-		} else {
-			LOG_DBG("Unknown address family %d", (unsigned int)addr->ai_family);
+/* Binary search for the NAT idle timeout. An idle period of lo seconds was
+ * answered by a PINGRESP, one of hi seconds was not, or hi is the keepalive
+ * announced in CONNECT which the broker enforces.
+ */
+struct keepalive_search {
+	uint32_t lo_sec;
+	uint32_t hi_sec;
+};
+
+static struct keepalive_search ka_search = {
+	.lo_sec = CONFIG_MY_MQTT_HELPER_KEEPALIVE_MIN_SEC,
+	.hi_sec = CONFIG_MQTT_KEEPALIVE,
+};
+
+#if defined(CONFIG_MY_MQTT_HELPER_KEEPALIVE_PERSIST)
+static int keepalive_settings_set(size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+	struct keepalive_search saved;
+
+	if (len != sizeof(saved) || read_cb(cb_arg, &saved, len) != (ssize_t)len) {
+		return 0;
+	}
+
+	/* The bounds may have been reconfigured since it was saved. */
+	saved.lo_sec = MAX(saved.lo_sec, CONFIG_MY_MQTT_HELPER_KEEPALIVE_MIN_SEC);
+	saved.hi_sec = MIN(saved.hi_sec, CONFIG_MQTT_KEEPALIVE);
+	if (saved.lo_sec <= saved.hi_sec) {
+		ka_search = saved;
+	}
+
+	return 0;
+}
+#endif /* CONFIG_MY_MQTT_HELPER_KEEPALIVE_PERSIST */
+
+static bool keepalive_converged(void)
+{
+	return (ka_search.hi_sec - ka_search.lo_sec) <= CONFIG_MY_MQTT_HELPER_KEEPALIVE_RESOLUTION_SEC;
+}
+
+/* Idle interval after which the next PINGREQ is sent. */
+static uint32_t keepalive_interval_sec(void)
+{
+	if (keepalive_converged()) {
+		return MAX(ka_search.lo_sec * CONFIG_MY_MQTT_HELPER_KEEPALIVE_MARGIN_PERCENT / 100,
+			   CONFIG_MY_MQTT_HELPER_KEEPALIVE_MIN_SEC);
+	}
+
+	return ka_search.lo_sec + (ka_search.hi_sec - ka_search.lo_sec) / 2;
+}
+
+static void keepalive_result(uint32_t idle_sec, bool survived)
+{
+	/* Lost pings at intervals known to be good, the link had an outage
+	 * or the NAT changed.
+	 */
+	static uint8_t losses;
+	struct keepalive_search prev = ka_search;
+
+	if (survived) {
+		losses = 0;
+		if (idle_sec > ka_search.lo_sec) {
+			ka_search.lo_sec = MIN(idle_sec, ka_search.hi_sec);
 		}
+	} else if (idle_sec > ka_search.lo_sec) {
+		ka_search.hi_sec = MIN(idle_sec, ka_search.hi_sec);
+	} else if (++losses >= 2) {
+		/* Not a one-off, search again below the failing interval. */
+		losses = 0;
+		ka_search.lo_sec = CONFIG_MY_MQTT_HELPER_KEEPALIVE_MIN_SEC;
+		ka_search.hi_sec = MAX(idle_sec, CONFIG_MY_MQTT_HELPER_KEEPALIVE_MIN_SEC);
+	}
 
-		addr = addr->ai_next;
+	if (memcmp(&prev, &ka_search, sizeof(prev)) == 0) {
+		return;
 	}
 
-	freeaddrinfo(result);
+	LOG_INF("Keepalive search %d..%d s, %s interval %d s", (int)ka_search.lo_sec,
+		(int)ka_search.hi_sec, keepalive_converged() ? "converged," : "probing",
+		(int)keepalive_interval_sec());
+
+#if defined(CONFIG_MY_MQTT_HELPER_KEEPALIVE_PERSIST)
+	int err = settings_save_one("mqtt_helper/keepalive", &ka_search, sizeof(ka_search));
+
+	if (err) {
+		LOG_WRN("Failed to save keepalive search, error: %d", err);
+	}
+#endif /* CONFIG_MY_MQTT_HELPER_KEEPALIVE_PERSIST */
+}
+#endif /* CONFIG_MY_MQTT_HELPER_KEEPALIVE_ADAPTIVE */
+
+#if defined(MQTT_HELPER_SETTINGS)
+static int helper_settings_set(const char *name, size_t len, settings_read_cb read_cb,
+			       void *cb_arg)
+{
+#if defined(CONFIG_MY_MQTT_HELPER_DNS_CACHE_PERSIST)
+	const char *next;
+
+	/* One key per cached hostname, "dns/<entry>". */
+	if (settings_name_steq(name, "dns", &next) && (next != NULL)) {
+		return dns_settings_set(next, len, read_cb, cb_arg);
+	}
+#endif /* CONFIG_MY_MQTT_HELPER_DNS_CACHE_PERSIST */
+#if defined(CONFIG_MY_MQTT_HELPER_KEEPALIVE_PERSIST)
+	if (strcmp(name, "keepalive") == 0) {
+		return keepalive_settings_set(len, read_cb, cb_arg);
+	}
+#endif /* CONFIG_MY_MQTT_HELPER_KEEPALIVE_PERSIST */
+
+	return -ENOENT;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(mqtt_helper, "mqtt_helper", NULL, helper_settings_set, NULL, NULL);
+#endif /* MQTT_HELPER_SETTINGS */
+
+/* Poll timeout, until the next ping is due or the PINGRESP is late. */
+static int keepalive_time_left(void)
+{
+	int left = mqtt_keepalive_time_left(&mqtt_client);
+
+	if (ping_sent_ms >= 0) {
+		int64_t wait = ping_sent_ms +
+			       CONFIG_MY_MQTT_HELPER_PINGRESP_TIMEOUT_SEC * MSEC_PER_SEC -
+			       k_uptime_get();
+
+		return MIN(left, (int)MAX(wait, 0));
+	}
+
+#if defined(CONFIG_MY_MQTT_HELPER_KEEPALIVE_ADAPTIVE)
+	int64_t next = (int64_t)keepalive_interval_sec() * MSEC_PER_SEC - link_idle_ms();
+
+	left = MIN(left, (int)MAX(next, 0));
+#endif /* CONFIG_MY_MQTT_HELPER_KEEPALIVE_ADAPTIVE */
+
+	return left;
+}
+
+static int keepalive_ping(void)
+{
+	int err;
+	uint32_t idle = link_idle_ms();
+	bool due = (mqtt_keepalive_time_left(&mqtt_client) == 0);
+
+#if defined(CONFIG_MY_MQTT_HELPER_KEEPALIVE_ADAPTIVE)
+	due = due || (idle >= keepalive_interval_sec() * MSEC_PER_SEC);
+#endif /* CONFIG_MY_MQTT_HELPER_KEEPALIVE_ADAPTIVE */
+
+	if (!due || (ping_sent_ms >= 0)) {
+		return -EAGAIN;
+	}
+
+	if (IS_ENABLED(CONFIG_MY_MQTT_HELPER_RAI)) {
+		/* PINGREQ is answered by PINGRESP and nothing else. */
+		(void)mqtt_helper_rai_set(MQTT_HELPER_RAI_ONE_RESP);
+	}
+
+	err = mqtt_ping(&mqtt_client);
+	if (err == 0) {
+		stats.pings++;
+		ping_idle_ms = idle;
+		ping_sent_ms = k_uptime_get();
+	}
 
 	return err;
 }
 
+static void pingresp_received(void)
+{
+	if (ping_sent_ms < 0) {
+		return;
+	}
+
+	stats.last_ping_rtt_ms = (uint32_t)(k_uptime_get() - ping_sent_ms);
+	ping_sent_ms = -1;
+
+	LOG_DBG("PINGRESP after %d ms, link was idle %d s", (int)stats.last_ping_rtt_ms,
+		(int)(ping_idle_ms / MSEC_PER_SEC));
+
+#if defined(CONFIG_MY_MQTT_HELPER_KEEPALIVE_ADAPTIVE)
+	keepalive_result(ping_idle_ms / MSEC_PER_SEC, true);
+#endif /* CONFIG_MY_MQTT_HELPER_KEEPALIVE_ADAPTIVE */
+}
+
+/* An expired NAT binding drops the PINGREQ silently, the socket stays open. */
+static bool pingresp_timed_out(void)
+{
+	if ((ping_sent_ms < 0) ||
+	    ((k_uptime_get() - ping_sent_ms) < CONFIG_MY_MQTT_HELPER_PINGRESP_TIMEOUT_SEC * MSEC_PER_SEC)) {
+		return false;
+	}
+
+	stats.ping_timeouts++;
+	ping_sent_ms = -1;
+
+	LOG_ERR("No PINGRESP in %d s, link was idle %d s, connection is dead",
+		CONFIG_MY_MQTT_HELPER_PINGRESP_TIMEOUT_SEC, (int)(ping_idle_ms / MSEC_PER_SEC));
+
+#if defined(CONFIG_MY_MQTT_HELPER_KEEPALIVE_ADAPTIVE)
+	keepalive_result(ping_idle_ms / MSEC_PER_SEC, false);
+#endif /* CONFIG_MY_MQTT_HELPER_KEEPALIVE_ADAPTIVE */
+
+	return true;
+}
+
 static int client_connect(struct mqtt_helper_conn_params *conn_params)
 {
 	int err;
+	bool resume = false;
+	uint32_t connect_ms;
+	int64_t connect_start;
 	struct mqtt_utf8 user_name = {
 		.utf8 = conn_params->user_name.ptr,
 		.size = conn_params->user_name.size,
 	};
 
 	mqtt_client_init(&mqtt_client);
+	ping_sent_ms = -1;
+	broker_port = (conn_params->port != 0) ? conn_params->port : CONFIG_MY_MQTT_HELPER_PORT;
 
 	err = broker_init(&broker, conn_params);
 	if (err) {
@@ -450,7 +1092,8 @@ static int client_connect(struct mqtt_helper_conn_params *conn_params)
 	mqtt_client.tx_buf	        = tx_buffer;
 	mqtt_client.tx_buf_size	        = sizeof(tx_buffer);
 #if defined(CONFIG_MQTT_LIB_TLS)
-	mqtt_client.transport.type      = MQTT_TRANSPORT_SECURE;
+	mqtt_client.transport.type      = (conn_params->sec_tag == MQTT_HELPER_SEC_TAG_NONE) ?
+					  MQTT_TRANSPORT_NON_SECURE : MQTT_TRANSPORT_SECURE;
 #else
 	mqtt_client.transport.type	= MQTT_TRANSPORT_NON_SECURE;
 #endif /* CONFIG_MQTT_LIB_TLS */
@@ -465,13 +1108,35 @@ static int client_connect(struct mqtt_helper_conn_params *conn_params)
 		CONFIG_MY_MQTT_HELPER_SECONDARY_SEC_TAG,
 #endif
 	};
+	size_t sec_tag_count = ARRAY_SIZE(sec_tag_list);
+
+	if (conn_params->sec_tag > 0) {
+		/* A broker with its own credentials. */
+		sec_tag_list[0] = conn_params->sec_tag;
+		sec_tag_count = 1;
+	}
 
 	tls_cfg->peer_verify	        = TLS_PEER_VERIFY_REQUIRED;
+#if defined(CONFIG_MY_MQTT_HELPER_TLS_CIPHERS_DEFAULT)
 	tls_cfg->cipher_count	        = 0;
 	tls_cfg->cipher_list	        = NULL; /* Use default */
-	tls_cfg->sec_tag_count	        = ARRAY_SIZE(sec_tag_list);
+#else
+	tls_cfg->cipher_count	        = ARRAY_SIZE(cipher_list);
+	tls_cfg->cipher_list	        = cipher_list;
+#endif /* CONFIG_MY_MQTT_HELPER_TLS_CIPHERS_DEFAULT */
+	tls_cfg->sec_tag_count	        = sec_tag_count;
 	tls_cfg->sec_tag_list	        = sec_tag_list;
+#if defined(CONFIG_MY_MQTT_HELPER_TLS_SESSION_CACHE)
+	if (tls_session_purge(sec_tag_list, sec_tag_count)) {
+		resume = session_cached && (mqtt_client.transport.type == MQTT_TRANSPORT_SECURE);
+		tls_cfg->session_cache  = TLS_SESSION_CACHE_ENABLED;
+	} else {
+		/* Full handshake without touching the stale session. */
+		tls_cfg->session_cache  = TLS_SESSION_CACHE_DISABLED;
+	}
+#else
 	tls_cfg->session_cache	        = TLS_SESSION_CACHE_DISABLED;
+#endif /* CONFIG_MY_MQTT_HELPER_TLS_SESSION_CACHE */
 	tls_cfg->hostname	        = conn_params->hostname.ptr;
 	tls_cfg->set_native_tls		= IS_ENABLED(CONFIG_MY_MQTT_HELPER_NATIVE_TLS);
 
@@ -486,12 +1151,34 @@ static int client_connect(struct mqtt_helper_conn_params *conn_params)
 
 	mqtt_state_set(MQTT_STATE_TRANSPORT_CONNECTING);
 
+	/* Blocks for the TCP and TLS handshakes and sends CONNECT. */
+	connect_start = k_uptime_get();
 	err = mqtt_connect(&mqtt_client);
+	connect_ms = (uint32_t)k_uptime_delta(&connect_start);
+
+	stats.connects++;
+	stats.last_connect_ms = connect_ms;
+
 	if (err) {
+		stats.connect_failures++;
 		LOG_ERR("mqtt_connect, error: %d", err);
+#if defined(CONFIG_MY_MQTT_HELPER_DNS_CACHE)
+		dns_cache_rotate();
+#endif /* CONFIG_MY_MQTT_HELPER_DNS_CACHE */
 		return err;
 	}
 
+	if (resume) {
+		stats.resume_attempts++;
+		stats.resume_connect_ms += connect_ms;
+	} else {
+		stats.full_handshakes++;
+		stats.full_connect_ms += connect_ms;
+	}
+
+	LOG_INF("Transport connected in %d ms, %s, %s ciphers", (int)connect_ms,
+		resume ? "session resumption offered" : "full handshake", CIPHER_PROFILE);
+
 	mqtt_state_set(MQTT_STATE_TRANSPORT_CONNECTED);
 
 	mqtt_state_set(MQTT_STATE_CONNECTING);
@@ -501,13 +1188,7 @@ static int client_connect(struct mqtt_helper_conn_params *conn_params)
 			.tv_sec = CONFIG_MY_MQTT_HELPER_SEND_TIMEOUT_SEC
 		};
 
-#if defined(CONFIG_MQTT_LIB_TLS)
-		int sock  = mqtt_client.transport.tls.sock;
-#else
-		int sock = mqtt_client.transport.tcp.sock;
-#endif /* CONFIG_MQTT_LIB_TLS */
-
-		err = setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		err = setsockopt(mqtt_socket_get(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 		if (err == -1) {
 			LOG_WRN("Failed to set timeout, errno: %d", errno);
 
@@ -538,6 +1219,12 @@ int mqtt_helper_init(struct mqtt_helper_cfg *cfg)
 
 	current_cfg = *cfg;
 
+#if defined(MQTT_HELPER_SETTINGS)
+	if (settings_subsys_init() || settings_load_subtree("mqtt_helper")) {
+		LOG_WRN("Failed to load saved settings");
+	}
+#endif /* MQTT_HELPER_SETTINGS */
+
 	mqtt_state_set(MQTT_STATE_DISCONNECTED);
 
 	return 0;
@@ -582,6 +1269,7 @@ int mqtt_helper_disconnect(void)
 		return -EOPNOTSUPP;
 	}
 
+	socket_lock_take();
 	mqtt_state_set(MQTT_STATE_DISCONNECTING);
 
 	err = mqtt_disconnect(&mqtt_client);
@@ -594,6 +1282,7 @@ int mqtt_helper_disconnect(void)
 			current_cfg.cb.on_disconnect(err);
 		}
 	}
+	socket_lock_give();
 
 	return err;
 }
@@ -616,7 +1305,9 @@ int mqtt_helper_subscribe(struct mqtt_subscription_list *sub_list)
 		LOG_DBG("Subscribing to: %s", (char *)sub_list->list[i].topic.utf8);
 	}
 
+	socket_lock_take();
 	err = mqtt_subscribe(&mqtt_client, sub_list);
+	socket_lock_give();
 	if (err) {
 		return err;
 	}
@@ -626,6 +1317,8 @@ int mqtt_helper_subscribe(struct mqtt_subscription_list *sub_list)
 
 int mqtt_helper_publish(const struct mqtt_publish_param *param)
 {
+	int err;
+
 	LOG_DBG("Publishing to topic: %.*s",
 		param->message.topic.topic.size,
 		(char *)param->message.topic.topic.utf8);
@@ -638,7 +1331,11 @@ int mqtt_helper_publish(const struct mqtt_publish_param *param)
 		return -EOPNOTSUPP;
 	}
 
-	return mqtt_publish(&mqtt_client, param);
+	socket_lock_take();
+	err = mqtt_publish(&mqtt_client, param);
+	socket_lock_give();
+
+	return err;
 }
 
 int mqtt_helper_deinit(void)
@@ -659,9 +1356,157 @@ int mqtt_helper_deinit(void)
 	return 0;
 }
 
+int mqtt_helper_rai_set(enum mqtt_helper_rai rai)
+{
+#if defined(CONFIG_MY_MQTT_HELPER_RAI) && defined(SO_RAI)
+	int err;
+	int value;
+
+	if (!mqtt_state_verify(MQTT_STATE_CONNECTING) && !mqtt_state_verify(MQTT_STATE_CONNECTED)) {
+		return -ENOTCONN;
+	}
+
+	switch (rai) {
+	case MQTT_HELPER_RAI_NO_DATA: value = RAI_NO_DATA; break;
+	case MQTT_HELPER_RAI_LAST: value = RAI_LAST; break;
+	case MQTT_HELPER_RAI_ONE_RESP: value = RAI_ONE_RESP; break;
+	case MQTT_HELPER_RAI_ONGOING: value = RAI_ONGOING; break;
+	default: return -EINVAL;
+	}
+
+	err = setsockopt(mqtt_socket_get(), SOL_SOCKET, SO_RAI, &value, sizeof(value));
+	if (err) {
+		LOG_WRN("Failed to set RAI %d, errno: %d", rai, errno);
+		return -errno;
+	}
+
+	stats.rai_hints++;
+
+	return 0;
+#else
+	ARG_UNUSED(rai);
+	return -ENOTSUP;
+#endif /* CONFIG_MY_MQTT_HELPER_RAI && SO_RAI */
+}
+
+void mqtt_helper_tls_session_invalidate(void)
+{
+	(void)atomic_set(&session_purge, 1);
+}
+
+void mqtt_helper_wake(void)
+{
+#if defined(CONFIG_MY_MQTT_HELPER_SERVICE)
+	k_sem_give(&service_sem);
+#endif /* CONFIG_MY_MQTT_HELPER_SERVICE */
+}
+
+void mqtt_helper_stats_get(struct mqtt_helper_stats *out)
+{
+	__ASSERT_NO_MSG(out != NULL);
+
+	*out = stats;
+
+#if defined(CONFIG_MY_MQTT_HELPER_KEEPALIVE_ADAPTIVE)
+	out->keepalive_sec = keepalive_interval_sec();
+	out->keepalive_lo_sec = ka_search.lo_sec;
+	out->keepalive_hi_sec = ka_search.hi_sec;
+#else
+	out->keepalive_sec = mqtt_client.keepalive;
+	out->keepalive_lo_sec = mqtt_client.keepalive;
+	out->keepalive_hi_sec = mqtt_client.keepalive;
+#endif /* CONFIG_MY_MQTT_HELPER_KEEPALIVE_ADAPTIVE */
+}
+
+/* Handle what poll() returned, false to end the poll loop. */
+static bool poll_events_handle(struct pollfd *fd, int ret)
+{
+#if defined(CONFIG_MY_MQTT_HELPER_SERVICE)
+	if (!mqtt_state_verify(MQTT_STATE_CONNECTING) &&
+	    !mqtt_state_verify(MQTT_STATE_CONNECTED)) {
+		/* on_service closed the connection while the loop polled. */
+		return true;
+	}
+
+#endif /* CONFIG_MY_MQTT_HELPER_SERVICE */
+	/* If poll returns 0, the timeout has expired. */
+	if (ret == 0) {
+		if (pingresp_timed_out()) {
+			(void)mqtt_abort(&mqtt_client);
+			return false;
+		}
+
+		ret = keepalive_ping();
+		/* -EAGAIN indicates it is not time to ping; try later;
+		 * otherwise, connection was closed due to NAT timeout.
+		 */
+		if (ret && (ret != -EAGAIN)) {
+			LOG_ERR("Cloud MQTT keepalive ping failed: %d", ret);
+			return false;
+		}
+		return true;
+	}
+
+	if ((fd->revents & POLLIN) == POLLIN) {
+		last_rx_ms = k_uptime_get_32();
+		ret = mqtt_input(&mqtt_client);
+		if (ret) {
+			LOG_ERR("Cloud MQTT input error: %d", ret);
+			(void)mqtt_abort(&mqtt_client);
+			return false;
+		}
+
+		/* If connection state is set to STATE_DISCONNECTED at
+		 * this point we know that the socket has
+		 * been closed and we can break out of poll.
+		 */
+		if (mqtt_state_verify(MQTT_STATE_DISCONNECTED) ||
+		    mqtt_state_verify(MQTT_STATE_UNINIT)) {
+			LOG_DBG("The socket is already closed");
+			return false;
+		}
+	}
+
+	if ((fd->revents & POLLNVAL) == POLLNVAL) {
+		if (mqtt_state_verify(MQTT_STATE_DISCONNECTING)) {
+			/* POLLNVAL is to be expected while
+			 * disconnecting, as the socket will be closed
+			 * by the MQTT library and become invalid.
+			 */
+			LOG_DBG("POLLNVAL while disconnecting");
+		} else if (mqtt_state_verify(MQTT_STATE_DISCONNECTED)) {
+			LOG_DBG("POLLNVAL, no active connection");
+		} else {
+			LOG_ERR("Socket error: POLLNVAL");
+			LOG_ERR("The socket was unexpectedly closed");
+		}
+
+		(void)mqtt_abort(&mqtt_client);
+
+		return false;
+	}
+
+	if ((fd->revents & POLLHUP) == POLLHUP) {
+		LOG_ERR("Socket error: POLLHUP");
+		LOG_ERR("Connection was unexpectedly closed");
+		(void)mqtt_abort(&mqtt_client);
+		return false;
+	}
+
+	if ((fd->revents & POLLERR) == POLLERR) {
+		LOG_ERR("Socket error: POLLERR");
+		LOG_ERR("Connection was unexpectedly closed");
+		(void)mqtt_abort(&mqtt_client);
+		return false;
+	}
+
+	return true;
+}
+
 MQTT_HELPER_STATIC void mqtt_helper_poll_loop(void)
 {
 	int ret;
+	bool keep_polling;
 	struct pollfd fds[1] = {0};
 
 	LOG_DBG("Waiting for connection_poll_sem");
@@ -669,11 +1514,7 @@ MQTT_HELPER_STATIC void mqtt_helper_poll_loop(void)
 	LOG_DBG("Took connection_poll_sem");
 
 	fds[0].events = POLLIN;
-#if defined(CONFIG_MQTT_LIB_TLS)
-	fds[0].fd  = mqtt_client.transport.tls.sock;
-#else
-	fds[0].fd = mqtt_client.transport.tcp.sock;
-#endif /* CONFIG_MQTT_LIB_TLS */
+	fds[0].fd = mqtt_socket_get();
 
 	LOG_DBG("Starting to poll on socket, fd: %d", fds[0].fd);
 
@@ -686,74 +1527,17 @@ MQTT_HELPER_STATIC void mqtt_helper_poll_loop(void)
 			LOG_DBG("Polling on socket fd: %d", fds[0].fd);
 		}
 
-		ret = poll(fds, ARRAY_SIZE(fds), mqtt_keepalive_time_left(&mqtt_client));
+		ret = poll(fds, ARRAY_SIZE(fds), keepalive_time_left());
 		if (ret < 0) {
 			LOG_ERR("poll() returned an error (%d), errno: %d", ret, -errno);
 			break;
 		}
 
-		/* If poll returns 0, the timeout has expired. */
-		if (ret == 0) {
-			ret = mqtt_live(&mqtt_client);
-			/* -EAGAIN indicates it is not time to ping; try later;
-			 * otherwise, connection was closed due to NAT timeout.
-			 */
-			if (ret && (ret != -EAGAIN)) {
-				LOG_ERR("Cloud MQTT keepalive ping failed: %d", ret);
-				break;
-			}
-			continue;
-		}
-
-		if ((fds[0].revents & POLLIN) == POLLIN) {
-			ret = mqtt_input(&mqtt_client);
-			if (ret) {
-				LOG_ERR("Cloud MQTT input error: %d", ret);
-				(void)mqtt_abort(&mqtt_client);
-				break;
-			}
-
-			/* If connection state is set to STATE_DISCONNECTED at
-			 * this point we know that the socket has
-			 * been closed and we can break out of poll.
-			 */
-			if (mqtt_state_verify(MQTT_STATE_DISCONNECTED) ||
-			    mqtt_state_verify(MQTT_STATE_UNINIT)) {
-				LOG_DBG("The socket is already closed");
-				break;
-			}
-		}
-
-		if ((fds[0].revents & POLLNVAL) == POLLNVAL) {
-			if (mqtt_state_verify(MQTT_STATE_DISCONNECTING)) {
-				/* POLLNVAL is to be expected while
-				 * disconnecting, as the socket will be closed
-				 * by the MQTT library and become invalid.
-				 */
-				LOG_DBG("POLLNVAL while disconnecting");
-			} else if (mqtt_state_verify(MQTT_STATE_DISCONNECTED)) {
-				LOG_DBG("POLLNVAL, no active connection");
-			} else {
-				LOG_ERR("Socket error: POLLNVAL");
-				LOG_ERR("The socket was unexpectedly closed");
-			}
-
-			(void)mqtt_abort(&mqtt_client);
-
-			break;
-		}
-
-		if ((fds[0].revents & POLLHUP) == POLLHUP) {
-			LOG_ERR("Socket error: POLLHUP");
-			LOG_ERR("Connection was unexpectedly closed");
-			(void)mqtt_abort(&mqtt_client);
-			break;
-		}
+		socket_lock_take();
+		keep_polling = poll_events_handle(&fds[0], ret);
+		socket_lock_give();
 
-		if ((fds[0].revents & POLLERR) == POLLERR) {
-			LOG_ERR("Socket error: POLLERR");
-			LOG_ERR("Connection was unexpectedly closed");
-			(void)mqtt_abort(&mqtt_client);
+		if (!keep_polling) {
 			break;
 		}
 	}
@@ -769,3 +1553,34 @@ static void mqtt_helper_run(void)
 K_THREAD_DEFINE(mqtt_helper_thread, CONFIG_MY_MQTT_HELPER_STACK_SIZE,
 		mqtt_helper_run, false, NULL, NULL,
 		K_LOWEST_APPLICATION_THREAD_PRIO, 0, 0);
+
+#if defined(CONFIG_MY_MQTT_HELPER_SERVICE)
+static void mqtt_helper_service_run(void)
+{
+	k_timeout_t timeout = K_FOREVER;
+	int32_t next;
+
+	while (true) {
+		(void)k_sem_take(&service_sem, timeout);
+		timeout = K_FOREVER;
+
+		if (!current_cfg.cb.on_service) {
+			continue;
+		}
+
+		socket_lock_take();
+		/* Checked under the lock, the poll loop may have just lost the connection. */
+		next = mqtt_state_verify(MQTT_STATE_CONNECTED) ? current_cfg.cb.on_service() :
+								 SYS_FOREVER_MS;
+		socket_lock_give();
+
+		if (next >= 0) {
+			timeout = K_MSEC(next);
+		}
+	}
+}
+
+K_THREAD_DEFINE(mqtt_helper_service_thread, CONFIG_MY_MQTT_HELPER_SERVICE_STACK_SIZE,
+		mqtt_helper_service_run, NULL, NULL, NULL,
+		CONFIG_MY_MQTT_HELPER_SERVICE_PRIORITY, 0, 0);
+#endif /* CONFIG_MY_MQTT_HELPER_SERVICE */
@@ -0,0 +1,226 @@
+/**
+ * @brief Runtime configuration. The active set is cached in RAM, documents
+ * pushed over MQTT are validated, persisted with settings and swapped in.
+ */
+
+#include "pss_config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/data/json.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+
+LOG_MODULE_REGISTER(pss_config, CONFIG_PSS_CONFIG_LOG_LEVEL);
+
+#define HEARTBEAT_MIN_S (600)
+#define HEARTBEAT_MAX_S CONFIG_PSS_CONFIG_HEARTBEAT_MAX_S
+#define BATT_MAX_MV     (5000)
+
+/**
+ * @brief Wire format, short keys keep the retained document small
+ */
+struct config_doc {
+    int32_t v;
+    int32_t hb;
+    int32_t bmax;
+    int32_t blow;
+    int32_t bmin;
+    int32_t blp;
+};
+
+// Bit of each key in the json_obj_parse() result, in descriptor order
+enum {
+    DOC_V,
+    DOC_HB,
+    DOC_BMAX,
+    DOC_BLOW,
+    DOC_BMIN,
+    DOC_BLP,
+};
+
+static const struct json_obj_descr doc_descr[] = {
+    JSON_OBJ_DESCR_PRIM(struct config_doc, v, JSON_TOK_NUMBER),
+    JSON_OBJ_DESCR_PRIM(struct config_doc, hb, JSON_TOK_NUMBER),
+    JSON_OBJ_DESCR_PRIM(struct config_doc, bmax, JSON_TOK_NUMBER),
+    JSON_OBJ_DESCR_PRIM(struct config_doc, blow, JSON_TOK_NUMBER),
+    JSON_OBJ_DESCR_PRIM(struct config_doc, bmin, JSON_TOK_NUMBER),
+    JSON_OBJ_DESCR_PRIM(struct config_doc, blp, JSON_TOK_NUMBER),
+};
+
+static const pss_config_t defaults = {
+    .version = 0,
+    .heartbeat_s = CONFIG_PSS_CONFIG_HEARTBEAT_S,
+    .batt_max_mv = CONFIG_BATTERY_LIB_MAX_VOLTAGE,
+    .batt_low_mv = CONFIG_BATTERY_LIB_LOW_VOLTAGE,
+    .batt_min_mv = CONFIG_BATTERY_LIB_MIN_OPERATING_VOLTAGE,
+    .batt_low_percent = CONFIG_BATTERY_LIB_LOW_VOLTAGE_PERCENT,
+};
+
+static pss_config_t active = defaults;
+static struct k_spinlock lock;
+
+/**
+ * @brief Bounds of every field, and the battery curve must be ordered
+ */
+static int32_t config_validate(const pss_config_t* cfg)
+{
+    if ((cfg->heartbeat_s < HEARTBEAT_MIN_S) || (cfg->heartbeat_s > HEARTBEAT_MAX_S)) {
+        LOG_ERR("Heartbeat %u s out of bounds", (unsigned int)cfg->heartbeat_s);
+        return -EINVAL;
+    }
+
+    if ((cfg->batt_max_mv > BATT_MAX_MV) || (cfg->batt_low_mv >= cfg->batt_max_mv)
+        || (cfg->batt_min_mv >= cfg->batt_low_mv)
+        || (cfg->batt_min_mv < CONFIG_BATTERY_LIB_PLAUS_LOW_VOLTAGE)) {
+        LOG_ERR("Battery curve %u/%u/%u mV out of order",
+                cfg->batt_max_mv, cfg->batt_low_mv, cfg->batt_min_mv);
+        return -EINVAL;
+    }
+
+    if ((cfg->batt_low_percent == 0) || (cfg->batt_low_percent >= 100)) {
+        LOG_ERR("Battery knee %u%% out of bounds", cfg->batt_low_percent);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int config_settings_set(const char* name, size_t len, settings_read_cb read_cb, void* cb_arg)
+{
+    pss_config_t stored;
+
+    if (strcmp(name, "active") != 0) {
+        return -ENOENT;
+    }
+
+    if ((len != sizeof(stored)) || (read_cb(cb_arg, &stored, len) != (ssize_t)len)) {
+        // Written by a different firmware, keep the defaults until the next document
+        return 0;
+    }
+
+    if (config_validate(&stored) == 0) {
+        active = stored;
+    }
+
+    return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(pss_config, "pss_config", NULL, config_settings_set, NULL, NULL);
+
+/**
+ * @brief Take a field from the document if it was present and fits the type
+ */
+static bool doc_field(int64_t fields, int bit, int32_t value, int32_t max, uint32_t* out)
+{
+    if (!(fields & BIT64(bit))) {
+        return true;
+    }
+
+    if ((value < 0) || (value > max)) {
+        return false;
+    }
+
+    *out = (uint32_t)value;
+
+    return true;
+}
+
+int32_t pss_config_init(void)
+{
+    int32_t err;
+
+    err = settings_subsys_init();
+    if (err == 0) {
+        err = settings_load_subtree("pss_config");
+    }
+
+    if (err) {
+        LOG_WRN("Could not load the configuration, err: %d", err);
+    }
+
+    LOG_INF("Configuration version %u, heartbeat %u s",
+            (unsigned int)active.version,
+            (unsigned int)active.heartbeat_s);
+
+    return err;
+}
+
+void pss_config_get(pss_config_t* cfg)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    *cfg = active;
+    k_spin_unlock(&lock, key);
+}
+
+int32_t pss_config_apply(char* doc, size_t len, uint32_t* version)
+{
+    struct config_doc parsed = {0};
+    pss_config_t next = defaults;
+    uint32_t val[DOC_BLP + 1] = {0};
+    int64_t fields;
+    int32_t err;
+    k_spinlock_key_t key;
+
+    *version = 0;
+
+    fields = json_obj_parse(doc, len, doc_descr, ARRAY_SIZE(doc_descr), &parsed);
+    if ((fields < 0) || !(fields & BIT64(DOC_V)) || (parsed.v <= 0)) {
+        LOG_ERR("Configuration document has no version, err: %d", (int)fields);
+        return -EINVAL;
+    }
+
+    *version = (uint32_t)parsed.v;
+    if (*version == active.version) {
+        return -EALREADY;
+    }
+
+    if (*version < active.version) {
+        LOG_WRN("Configuration %u is older than %u", (unsigned int)*version, (unsigned int)active.version);
+        return -ESTALE;
+    }
+
+    val[DOC_HB] = next.heartbeat_s;
+    val[DOC_BMAX] = next.batt_max_mv;
+    val[DOC_BLOW] = next.batt_low_mv;
+    val[DOC_BMIN] = next.batt_min_mv;
+    val[DOC_BLP] = next.batt_low_percent;
+
+    if (!doc_field(fields, DOC_HB, parsed.hb, INT32_MAX, &val[DOC_HB])
+        || !doc_field(fields, DOC_BMAX, parsed.bmax, UINT16_MAX, &val[DOC_BMAX])
+        || !doc_field(fields, DOC_BLOW, parsed.blow, UINT16_MAX, &val[DOC_BLOW])
+        || !doc_field(fields, DOC_BMIN, parsed.bmin, UINT16_MAX, &val[DOC_BMIN])
+        || !doc_field(fields, DOC_BLP, parsed.blp, UINT8_MAX, &val[DOC_BLP])) {
+        LOG_ERR("Configuration %u has a value out of range", (unsigned int)*version);
+        return -EINVAL;
+    }
+
+    next.version = *version;
+    next.heartbeat_s = val[DOC_HB];
+    next.batt_max_mv = (uint16_t)val[DOC_BMAX];
+    next.batt_low_mv = (uint16_t)val[DOC_BLOW];
+    next.batt_min_mv = (uint16_t)val[DOC_BMIN];
+    next.batt_low_percent = (uint8_t)val[DOC_BLP];
+
+    err = config_validate(&next);
+    if (err) {
+        return err;
+    }
+
+    // Persisted first, what runs is always what boots
+    err = settings_save_one("pss_config/active", &next, sizeof(next));
+    if (err) {
+        LOG_ERR("Could not save configuration %u, err: %d", (unsigned int)*version, err);
+        return err;
+    }
+
+    key = k_spin_lock(&lock);
+    active = next;
+    k_spin_unlock(&lock, key);
+
+    LOG_INF("Applied configuration version %u", (unsigned int)*version);
+
+    return 0;
+}
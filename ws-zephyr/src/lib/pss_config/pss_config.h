@@ -0,0 +1,51 @@
+#ifndef PSS_CONFIG_H
+#define PSS_CONFIG_H
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Settings that can be changed at runtime, see pss_config_apply().
+ * Defaults come from Kconfig, version 0 means nothing was applied.
+ */
+typedef struct {
+    uint32_t version;          // Version of the applied document
+    uint32_t heartbeat_s;      // Seconds between heartbeats
+    uint16_t batt_max_mv;      // Full battery
+    uint16_t batt_low_mv;      // Knee of the discharge curve
+    uint16_t batt_min_mv;      // Empty battery, 0%
+    uint8_t batt_low_percent;  // Charge left at the knee
+} pss_config_t;
+
+/**
+ * @brief Load the persisted configuration, falls back to the defaults
+ *
+ * @return 0 if successful, negative error otherwise. The defaults are used on error.
+ */
+int32_t pss_config_init(void);
+
+/**
+ * @brief Copy the active configuration. Cheap, it is kept in RAM.
+ *
+ * @param cfg Destination
+ */
+void pss_config_get(pss_config_t* cfg);
+
+/**
+ * @brief Apply a configuration document, e.g.
+ * {"v":3,"hb":21600,"bmax":4200,"blow":3400,"bmin":3200,"blp":10}
+ * Only "v" is required, missing keys take their default. The document is
+ * validated as a whole and persisted before it becomes active, so it is
+ * applied completely or not at all.
+ *
+ * @param doc The document, parsed in place
+ * @param len Length of the document
+ * @param version Set to the version of the document, 0 if it has none
+ * @retval 0 Applied
+ * @retval -EALREADY The version is already active, nothing changed
+ * @retval -ESTALE The version is older than the active one
+ * @retval -EINVAL Malformed, no version or a value out of bounds
+ * @return Otherwise a negative error from settings
+ */
+int32_t pss_config_apply(char* doc, size_t len, uint32_t* version);
+
+#endif /* PSS_CONFIG_H */
@@ -0,0 +1,75 @@
+/**
+ * @file
+ * @brief GENERATED FILE. Home Assistant MQTT discovery payloads, see cfg/ha_entities.csv
+ */
+#ifndef PSS_MQTT_DISCOVERY_H
+#define PSS_MQTT_DISCOVERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zephyr/sys/util_macro.h>
+
+#define PSS_MQTT_DISCOVERY_COUNT 5 /**< Number of discovery entities. */
+#if IS_ENABLED(CONFIG_PSS_MQTT_ENVELOPE)
+#define PSS_MQTT_DISCOVERY_HASH 0x5b4f4710u /**< FNV-1a hash of all topics and payloads. */
+#else
+#define PSS_MQTT_DISCOVERY_HASH 0xa1aee946u /**< FNV-1a hash of all topics and payloads. */
+#endif
+#define PSS_MQTT_DISCOVERY_TOPIC_FMT_MAX 43 /**< Longest topic format. */
+#define PSS_MQTT_DISCOVERY_PAYLOAD_FMT_MAX 303 /**< Longest payload format. */
+
+/**
+ * @brief A discovery config topic and its retained payload.
+ * The topic format takes the device id. The payload format takes the
+ * device topic base, then the device id twice.
+ */
+typedef struct {
+    const char* topic;
+    const char* payload;
+} pss_mqtt_discovery_t;
+
+static const char discovery_water_topic[] = "homeassistant/binary_sensor/%s/water/config";
+static const char discovery_pump_topic[] = "homeassistant/binary_sensor/%s/pump/config";
+static const char discovery_battery_topic[] = "homeassistant/sensor/%s/battery/config";
+static const char discovery_pump_cycles_topic[] = "homeassistant/sensor/%s/pump_cycles/config";
+static const char discovery_pump_runtime_topic[] = "homeassistant/sensor/%s/pump_runtime/config";
+
+#if IS_ENABLED(CONFIG_PSS_MQTT_ENVELOPE)
+// The state is read from the envelope, see pss_mqtt_envelope.c
+static const char discovery_water_payload[] = "{\"~\":\"%s\",\"name\":\"Water\",\"uniq_id\":\"%s_water\",\"stat_t\":\"~/sensor\",\"avty_t\":\"~/availability\",\"dev_cla\":\"moisture\",\"pl_on\":\"ON\",\"pl_off\":\"OFF\",\"dev\":{\"ids\":[\"%s\"],\"name\":\"Sump Water Sensor\",\"mf\":\"mikebush.org\",\"mdl\":\"WaterSensorShield\"},\"val_tpl\":\"{{ value_json.v }}\"}";
+static const char discovery_pump_payload[] = "{\"~\":\"%s\",\"name\":\"Pump\",\"uniq_id\":\"%s_pump\",\"stat_t\":\"~/pump\",\"avty_t\":\"~/availability\",\"dev_cla\":\"running\",\"pl_on\":\"ON\",\"pl_off\":\"OFF\",\"dev\":{\"ids\":[\"%s\"],\"name\":\"Sump Water Sensor\",\"mf\":\"mikebush.org\",\"mdl\":\"WaterSensorShield\"},\"val_tpl\":\"{{ value_json.v }}\"}";
+static const char discovery_battery_payload[] = "{\"~\":\"%s\",\"name\":\"Battery\",\"uniq_id\":\"%s_battery\",\"stat_t\":\"~/batt\",\"avty_t\":\"~/availability\",\"dev_cla\":\"voltage\",\"stat_cla\":\"measurement\",\"unit_of_meas\":\"V\",\"exp_aft\":608400,\"dev\":{\"ids\":[\"%s\"],\"name\":\"Sump Water Sensor\",\"mf\":\"mikebush.org\",\"mdl\":\"WaterSensorShield\"},\"val_tpl\":\"{{ value_json.v }}\"}";
+static const char discovery_pump_cycles_payload[] = "{\"~\":\"%s\",\"name\":\"Pump Cycles\",\"uniq_id\":\"%s_pump_cycles\",\"stat_t\":\"~/pump/cycles\",\"avty_t\":\"~/availability\",\"stat_cla\":\"total_increasing\",\"ic\":\"mdi:counter\",\"dev\":{\"ids\":[\"%s\"],\"name\":\"Sump Water Sensor\",\"mf\":\"mikebush.org\",\"mdl\":\"WaterSensorShield\"},\"val_tpl\":\"{{ value_json.v }}\"}";
+static const char discovery_pump_runtime_payload[] = "{\"~\":\"%s\",\"name\":\"Pump Last Run\",\"uniq_id\":\"%s_pump_runtime\",\"stat_t\":\"~/pump/runtime\",\"avty_t\":\"~/availability\",\"dev_cla\":\"duration\",\"stat_cla\":\"measurement\",\"unit_of_meas\":\"s\",\"dev\":{\"ids\":[\"%s\"],\"name\":\"Sump Water Sensor\",\"mf\":\"mikebush.org\",\"mdl\":\"WaterSensorShield\"},\"val_tpl\":\"{{ value_json.v }}\"}";
+#else
+static const char discovery_water_payload[] = "{\"~\":\"%s\",\"name\":\"Water\",\"uniq_id\":\"%s_water\",\"stat_t\":\"~/sensor\",\"avty_t\":\"~/availability\",\"dev_cla\":\"moisture\",\"pl_on\":\"ON\",\"pl_off\":\"OFF\",\"dev\":{\"ids\":[\"%s\"],\"name\":\"Sump Water Sensor\",\"mf\":\"mikebush.org\",\"mdl\":\"WaterSensorShield\"}}";
+static const char discovery_pump_payload[] = "{\"~\":\"%s\",\"name\":\"Pump\",\"uniq_id\":\"%s_pump\",\"stat_t\":\"~/pump\",\"avty_t\":\"~/availability\",\"dev_cla\":\"running\",\"pl_on\":\"ON\",\"pl_off\":\"OFF\",\"dev\":{\"ids\":[\"%s\"],\"name\":\"Sump Water Sensor\",\"mf\":\"mikebush.org\",\"mdl\":\"WaterSensorShield\"}}";
+static const char discovery_battery_payload[] = "{\"~\":\"%s\",\"name\":\"Battery\",\"uniq_id\":\"%s_battery\",\"stat_t\":\"~/batt\",\"avty_t\":\"~/availability\",\"dev_cla\":\"voltage\",\"stat_cla\":\"measurement\",\"unit_of_meas\":\"V\",\"exp_aft\":608400,\"dev\":{\"ids\":[\"%s\"],\"name\":\"Sump Water Sensor\",\"mf\":\"mikebush.org\",\"mdl\":\"WaterSensorShield\"}}";
+static const char discovery_pump_cycles_payload[] = "{\"~\":\"%s\",\"name\":\"Pump Cycles\",\"uniq_id\":\"%s_pump_cycles\",\"stat_t\":\"~/pump/cycles\",\"avty_t\":\"~/availability\",\"stat_cla\":\"total_increasing\",\"ic\":\"mdi:counter\",\"dev\":{\"ids\":[\"%s\"],\"name\":\"Sump Water Sensor\",\"mf\":\"mikebush.org\",\"mdl\":\"WaterSensorShield\"}}";
+static const char discovery_pump_runtime_payload[] = "{\"~\":\"%s\",\"name\":\"Pump Last Run\",\"uniq_id\":\"%s_pump_runtime\",\"stat_t\":\"~/pump/runtime\",\"avty_t\":\"~/availability\",\"dev_cla\":\"duration\",\"stat_cla\":\"measurement\",\"unit_of_meas\":\"s\",\"dev\":{\"ids\":[\"%s\"],\"name\":\"Sump Water Sensor\",\"mf\":\"mikebush.org\",\"mdl\":\"WaterSensorShield\"}}";
+#endif
+
+static const pss_mqtt_discovery_t pss_mqtt_discovery[PSS_MQTT_DISCOVERY_COUNT] = {
+    {
+        .topic = discovery_water_topic,
+        .payload = discovery_water_payload,
+    },
+    {
+        .topic = discovery_pump_topic,
+        .payload = discovery_pump_payload,
+    },
+    {
+        .topic = discovery_battery_topic,
+        .payload = discovery_battery_payload,
+    },
+    {
+        .topic = discovery_pump_cycles_topic,
+        .payload = discovery_pump_cycles_payload,
+    },
+    {
+        .topic = discovery_pump_runtime_topic,
+        .payload = discovery_pump_runtime_payload,
+    },
+};
+
+#endif // PSS_MQTT_DISCOVERY_H
@@ -0,0 +1,26 @@
+/**
+ * @file
+ * @brief GENERATED FILE. Fields of the CBOR telemetry message, see cfg/telemetry.csv
+ */
+#ifndef PSS_MQTT_TELEMETRY_H
+#define PSS_MQTT_TELEMETRY_H
+
+#define PSS_MQTT_TLM_SCHEMA_ID 0x9434u /**< Sent as key 0, identifies the schema. */
+#define PSS_MQTT_TLM_ENCODED_MAX 54 /**< Largest encoded message. */
+
+/**
+ * @brief Telemetry fields, see pss_mqtt_telemetry_set()
+ */
+typedef enum {
+    PSS_MQTT_TLM_BATT_MV,
+    PSS_MQTT_TLM_PUMP_CYCLES,
+    PSS_MQTT_TLM_PUMP_RUNTIME_S,
+    PSS_MQTT_TLM_UPTIME_S,
+    PSS_MQTT_TLM_LTE_TX_KB,
+    PSS_MQTT_TLM_LTE_RX_KB,
+    PSS_MQTT_TLM_RRC_CONNECTED_S,
+    PSS_MQTT_TLM_PSM_TAU_S,
+    PSS_MQTT_TLM_COUNT
+} pss_mqtt_tlm_field_t;
+
+#endif // PSS_MQTT_TELEMETRY_H
@@ -0,0 +1,32 @@
+/**
+ * @file
+ * @brief GENERATED FILE. CBOR map key and type of each telemetry field, see cfg/telemetry.csv
+ */
+#ifndef PSS_MQTT_TELEMETRY_SCHEMA_H
+#define PSS_MQTT_TELEMETRY_SCHEMA_H
+
+#include "pss_mqtt_telemetry.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief How a field is encoded
+ */
+typedef struct {
+    uint8_t key;
+    bool is_signed;
+} pss_mqtt_tlm_schema_t;
+
+static const pss_mqtt_tlm_schema_t pss_mqtt_tlm_schema[PSS_MQTT_TLM_COUNT] = {
+    [PSS_MQTT_TLM_BATT_MV] = {.key = 1, .is_signed = false},
+    [PSS_MQTT_TLM_PUMP_CYCLES] = {.key = 2, .is_signed = false},
+    [PSS_MQTT_TLM_PUMP_RUNTIME_S] = {.key = 3, .is_signed = false},
+    [PSS_MQTT_TLM_UPTIME_S] = {.key = 4, .is_signed = false},
+    [PSS_MQTT_TLM_LTE_TX_KB] = {.key = 5, .is_signed = false},
+    [PSS_MQTT_TLM_LTE_RX_KB] = {.key = 6, .is_signed = false},
+    [PSS_MQTT_TLM_RRC_CONNECTED_S] = {.key = 7, .is_signed = false},
+    [PSS_MQTT_TLM_PSM_TAU_S] = {.key = 8, .is_signed = true},
+};
+
+#endif // PSS_MQTT_TELEMETRY_SCHEMA_H
@@ -4,12 +4,16 @@
  */
 
 #include "pss_mqtt.h"
+#include "pss_mqtt_private.h"
 #include "pss_nrf_lte.h"
 #if __has_include("gen/pss_mqtt_certs.h")
 #include "gen/pss_mqtt_certs.h"
 #else
 #include "pss_mqtt_certs.h"
 #endif
+#if IS_ENABLED(CONFIG_PSS_MQTT_HA_DISCOVERY)
+#include "gen/pss_mqtt_discovery.h"
+#endif
 #include <math.h>
 #include <modem/modem_key_mgmt.h>
 #include <modem/nrf_modem_lib.h>
@@ -19,20 +23,35 @@
 #include <string.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/base64.h>
 
 #include <zephyr/devicetree.h>
 #include <zephyr/drivers/gpio.h>
 
 LOG_MODULE_REGISTER(pss_mqtt, CONFIG_PSS_MQTT_LOG_LEVEL);
 
+#if defined(PSS_MQTT_CERTS_AVAILABLE)
+// The generated credentials must match the configured profile
+BUILD_ASSERT(PSS_MQTT_CERTS_KEY_EC == IS_ENABLED(CONFIG_PSS_MQTT_CREDENTIALS_ECDSA_P256),
+             "Client key type does not match the credential profile");
+BUILD_ASSERT(PSS_MQTT_CERTS_CRT_EC == PSS_MQTT_CERTS_KEY_EC,
+             "Client certificate and private key types differ");
+BUILD_ASSERT(!IS_ENABLED(CONFIG_MY_MQTT_HELPER_TLS_CIPHERS_ECDSA) || PSS_MQTT_CERTS_ROOT_EC,
+             "ECDSA cipher suites need an ECDSA CA");
+BUILD_ASSERT(!IS_ENABLED(CONFIG_MY_MQTT_HELPER_TLS_CIPHERS_RSA) || !PSS_MQTT_CERTS_ROOT_EC,
+             "RSA cipher suites need an RSA CA");
+BUILD_ASSERT(PSS_MQTT_CERTS_ROOT_COUNT <= CONFIG_PSS_MQTT_CA_CHAIN_MAX,
+             "CA file holds more certificates than PSS_MQTT_CA_CHAIN_MAX");
+#endif
+
 // Local Macro Definitions /////////////////
-#define MQTT_HOSTNAME CONFIG_PSS_MQTT_HOST
 #define CLIENT_ID_BUF_SIZE 64
 #define SUBSCRIBE_ID 1001
 
 // Global Variable Declarations /////////////////
 size_t client_id_size = CLIENT_ID_BUF_SIZE;
-char client_id[CLIENT_ID_BUF_SIZE];
+char client_id[CLIENT_ID_BUF_SIZE + 1]; // Always NUL terminated
 K_SEM_DEFINE(pss_mqtt_do_disconnect_sem, 0, 1); // Ready for subscription
 
 // Local Variable Declarations /////////////////
@@ -41,20 +60,69 @@ static K_SEM_DEFINE(on_connection_sem, 0, 1); // Ready for subscription
 
 static bool mqtt_connected = false;
 static bool mqtt_has_error = true;
+static bool mqtt_closing = false; // Disconnect requested by the on-demand mode
+static bool subscribe_pending = false; // SUBSCRIBE sent, its SUBACK not in yet
+
+// Modem data counters when the connect started, to size the handshake
+static int32_t connect_tx_kb;
+static int32_t connect_rx_kb;
+static bool connect_kb_valid = false;
+
+// Device topics, <prefix>/<client_id>/<leaf>, built once by pss_mqtt_topics_init()
+// The prefix size counts its NUL, one more for the '/'
+#define TOPIC_BASE_MAX (sizeof(CONFIG_PSS_MQTT_TOPIC_PREFIX) + CLIENT_ID_BUF_SIZE + 1)
+#define TOPIC_LEAF_MAX 16
+#define TOPIC_BUF_SIZE (TOPIC_BASE_MAX + TOPIC_LEAF_MAX)
+#define DEVICE_ID_FALLBACK "sump" // Used when the modem has no client id
+
+/**
+ * @brief Fixed attributes of a device topic
+ */
+typedef struct {
+  const char *leaf;
+  enum mqtt_qos qos;
+  bool retain;
+  pss_mqtt_lane_t lane;
+} topic_cfg_t;
+
+static const topic_cfg_t topic_cfg[PSS_MQTT_TOPIC_COUNT] = {
+  [PSS_MQTT_TOPIC_AVAILABILITY] = {"availability", MQTT_QOS_1_AT_LEAST_ONCE, true, PSS_MQTT_LANE_STATE},
+  [PSS_MQTT_TOPIC_SENSOR] = {"sensor", MQTT_QOS_1_AT_LEAST_ONCE, true, PSS_MQTT_LANE_ALARM},
+  [PSS_MQTT_TOPIC_PUMP] = {"pump", MQTT_QOS_1_AT_LEAST_ONCE, true, PSS_MQTT_LANE_STATE},
+  [PSS_MQTT_TOPIC_PUMP_CYCLES] = {"pump/cycles", MQTT_QOS_1_AT_LEAST_ONCE, true, PSS_MQTT_LANE_TELEMETRY},
+  [PSS_MQTT_TOPIC_PUMP_RUNTIME] = {"pump/runtime", MQTT_QOS_1_AT_LEAST_ONCE, true, PSS_MQTT_LANE_TELEMETRY},
+  [PSS_MQTT_TOPIC_BATT] = {"batt", MQTT_QOS_1_AT_LEAST_ONCE, true, PSS_MQTT_LANE_TELEMETRY},
+  [PSS_MQTT_TOPIC_CONFIG_APPLIED] = {"config/applied", MQTT_QOS_1_AT_LEAST_ONCE, true, PSS_MQTT_LANE_STATE},
+  [PSS_MQTT_TOPIC_TELEMETRY] = {"tlm", MQTT_QOS_1_AT_LEAST_ONCE, false, PSS_MQTT_LANE_TELEMETRY},
+  [PSS_MQTT_TOPIC_ALARM_LAT_QUEUE] = {"alarm/lat/queue", MQTT_QOS_1_AT_LEAST_ONCE, true, PSS_MQTT_LANE_TELEMETRY},
+  [PSS_MQTT_TOPIC_ALARM_LAT_WRITE] = {"alarm/lat/write", MQTT_QOS_1_AT_LEAST_ONCE, true, PSS_MQTT_LANE_TELEMETRY},
+  [PSS_MQTT_TOPIC_ALARM_LAT_ACK] = {"alarm/lat/ack", MQTT_QOS_1_AT_LEAST_ONCE, true, PSS_MQTT_LANE_TELEMETRY},
+  [PSS_MQTT_TOPIC_ALARM_LAT_TOTAL] = {"alarm/lat/total", MQTT_QOS_1_AT_LEAST_ONCE, true, PSS_MQTT_LANE_TELEMETRY},
+};
+
+static char topic_base[TOPIC_BASE_MAX];
+static const char *device_id = DEVICE_ID_FALLBACK;
+static char topic_buf[PSS_MQTT_TOPIC_COUNT][TOPIC_BUF_SIZE];
+static struct mqtt_topic topics[PSS_MQTT_TOPIC_COUNT];
 
-const uint8_t status_topic[] = "homeassistant/sump/availability";
 struct mqtt_topic lwt_topic = {
   .qos = 1,
-  .topic = {
-    .utf8 = status_topic,
-    .size = sizeof(status_topic) - 1
-  }
+  // .topic is set to the availability topic by pss_mqtt_topics_init()
 };
+
 struct mqtt_utf8 lwt_msg = {
   .utf8 = "offline",
   .size = 7
 };
 
+#if IS_ENABLED(CONFIG_PSS_MQTT_HA_DISCOVERY)
+static uint32_t discovery_hash = 0; // Hash of the last discovery set the broker accepted
+static uint16_t discovery_ids[PSS_MQTT_DISCOVERY_COUNT]; // Packet ids waiting for a PUBACK, 0 once acknowledged
+static size_t discovery_unacked = 0;
+static char discovery_topic[PSS_MQTT_DISCOVERY_TOPIC_FMT_MAX + CLIENT_ID_BUF_SIZE];
+static char discovery_payload[PSS_MQTT_DISCOVERY_PAYLOAD_FMT_MAX + TOPIC_BASE_MAX + (2 * CLIENT_ID_BUF_SIZE)];
+#endif
+
 static const struct gpio_dt_spec led2 = GPIO_DT_SPEC_GET(DT_NODELABEL(led1), gpios);
 
 static int32_t init_led(void)
@@ -86,137 +154,336 @@ bool pss_mqtt_connected(void)
   return mqtt_connected;
 }
 
-int32_t pss_mqtt_provision(void)
+/**
+ * @brief Build the device topics from the prefix and the client id.
+ * Done once so publishing needs no formatting or strlen.
+ */
+static void pss_mqtt_topics_init(void)
 {
-  int32_t err;
-  bool exists;
+  // Provisioning terminates the id, the bound guards a read that never happened
+  size_t id_len = strnlen(client_id, MIN(client_id_size, sizeof(client_id)));
+  int len;
+
+  if (id_len > 0)
+  {
+    device_id = client_id;
+    (void)snprintf(topic_base, sizeof(topic_base), "%s/%.*s",
+                   CONFIG_PSS_MQTT_TOPIC_PREFIX, (int)id_len, client_id);
+  }
+  else
+  {
+    LOG_WRN("No client id, using shared topics");
+    device_id = DEVICE_ID_FALLBACK;
+    (void)snprintf(topic_base, sizeof(topic_base), "%s", CONFIG_PSS_MQTT_TOPIC_PREFIX);
+  }
+
+  for (size_t i = 0; i < PSS_MQTT_TOPIC_COUNT; i++)
+  {
+    len = snprintf(topic_buf[i], TOPIC_BUF_SIZE, "%s/%s", topic_base, topic_cfg[i].leaf);
+    topics[i].topic.utf8 = (uint8_t *)topic_buf[i];
+    topics[i].topic.size = (uint32_t)len;
+    topics[i].qos = topic_cfg[i].qos;
+  }
+
+  lwt_topic.topic = topics[PSS_MQTT_TOPIC_AVAILABILITY].topic;
+
+  LOG_INF("Topic base: %s", topic_base);
+
+  (void)pss_mqtt_sub_init(topic_base);
+}
 
 #if defined(PSS_MQTT_CERTS_AVAILABLE)
-  // Provision the Root Certificate
-  (void)modem_key_mgmt_exists(CONFIG_MY_MQTT_HELPER_SEC_TAG,
-                              MODEM_KEY_MGMT_CRED_TYPE_CA_CHAIN,
-                              &exists);
-  if (exists && !IS_ENABLED(CONFIG_PSS_MQTT_FORCE_PROVISION))
-  { // lint !e774 !e506
-    LOG_INF("Cred type: %d for sec tag %d",
-            MODEM_KEY_MGMT_CRED_TYPE_CA_CHAIN,
-            CONFIG_MY_MQTT_HELPER_SEC_TAG);
+/**
+ * @brief Digest of a credential as last written to the modem
+ */
+typedef struct {
+  int32_t sec_tag;
+  uint8_t digest[PSS_MQTT_CERTS_DIGEST_LEN];
+} cred_record_t;
+
+static cred_record_t cred_records[PSS_MQTT_CERTS_COUNT];
+static char pem_buf[PSS_MQTT_CERTS_PEM_MAX];
+
+/**
+ * @brief Settings handler, loads the records saved under pss_mqtt/cred<n>
+ */
+static int cred_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+  unsigned long idx;
+
+  if (strncmp(name, "cred", 4) != 0)
+  {
+    return -ENOENT;
+  }
+
+  idx = strtoul(name + 4, NULL, 10);
+  if ((idx >= ARRAY_SIZE(cred_records)) || (len != sizeof(cred_records[0])))
+  {
+    // Left over from a different credential set, rewritten on mismatch
+    return 0;
+  }
+
+  return (read_cb(cb_arg, &cred_records[idx], len) == (ssize_t)len) ? 0 : -EIO;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(pss_mqtt_cred, "pss_mqtt", NULL, cred_settings_set, NULL, NULL);
+
+/**
+ * @brief Length of the DER object at the start of a buffer, header included
+ *
+ * @return The length, 0 if the buffer does not start with a valid object
+ */
+static size_t der_len(const uint8_t *der, size_t avail)
+{
+  size_t len;
+  size_t hdr;
+
+  if (avail < 2)
+  {
+    return 0;
+  }
+
+  if (der[1] < 0x80)
+  {
+    hdr = 2;
+    len = der[1];
+  }
+  else if ((der[1] == 0x81) && (avail >= 3))
+  {
+    hdr = 3;
+    len = der[2];
+  }
+  else if ((der[1] == 0x82) && (avail >= 4))
+  {
+    hdr = 4;
+    len = ((size_t)der[2] << 8) | der[3];
   }
   else
   {
-    err = modem_key_mgmt_write(CONFIG_MY_MQTT_HELPER_SEC_TAG,
-                               MODEM_KEY_MGMT_CRED_TYPE_CA_CHAIN,
-                               root_ca,
-                               sizeof(root_ca) - 1); // lint !e778
-    if (err)
+    return 0;
+  }
+
+  return ((hdr + len) <= avail) ? (hdr + len) : 0;
+}
+
+/**
+ * @brief Rebuild the PEM the modem expects from a DER credential.
+ * A CA chain holds several DER objects back to back, each gets its own block.
+ *
+ * @return Length of the PEM, negative error otherwise
+ */
+static int32_t pem_from_der(const pss_mqtt_cred_t *cred, char *buf, size_t size)
+{
+  size_t pos = 0;
+  size_t off = 0;
+
+  while (off < cred->len)
+  {
+    size_t obj = der_len(&cred->data[off], cred->len - off);
+    int ret;
+
+    if (obj == 0)
     {
-      LOG_ERR("Failed to register CA certificate: %d", err);
-      return err;
+      return -EINVAL;
     }
-    else
+
+    ret = snprintf(&buf[pos], size - pos, "-----BEGIN %s-----\n", cred->label);
+    if ((ret < 0) || ((size_t)ret >= (size - pos)))
     {
-      LOG_INF("Provisioned CA Certificate");
+      return -ENOMEM;
     }
-  }
+    pos += ret;
 
-  // Provision the Ublox Certificate
-  (void)modem_key_mgmt_exists(CONFIG_MY_MQTT_HELPER_SEC_TAG,
-                              MODEM_KEY_MGMT_CRED_TYPE_PUBLIC_CERT,
-                              &exists);
-  if (exists && !IS_ENABLED(CONFIG_PSS_MQTT_FORCE_PROVISION))
-  { // lint !e774 !e506
-    LOG_INF("Cred type: %d for sec tag %d",
-            MODEM_KEY_MGMT_CRED_TYPE_PUBLIC_CERT,
-            CONFIG_MY_MQTT_HELPER_SEC_TAG);
-  }
-  else
-  {
-    err = modem_key_mgmt_write(CONFIG_MY_MQTT_HELPER_SEC_TAG,
-                               MODEM_KEY_MGMT_CRED_TYPE_PUBLIC_CERT,
-                               ublox_ca_certificate,
-                               sizeof(ublox_ca_certificate) - 1); // lint !e778
-    if (err)
+    // 48 bytes encode to one 64 character line
+    for (size_t i = 0; i < obj; i += 48)
     {
-      LOG_ERR("Failed to register private key: %d", err);
-      return err;
+      size_t olen;
+
+      if (0 != base64_encode((uint8_t *)&buf[pos], size - pos, &olen,
+                             &cred->data[off + i], MIN(48, obj - i)))
+      {
+        return -ENOMEM;
+      }
+      pos += olen;
+      if (pos >= (size - 1))
+      {
+        return -ENOMEM;
+      }
+      buf[pos++] = '\n';
     }
-    else
+
+    ret = snprintf(&buf[pos], size - pos, "-----END %s-----\n", cred->label);
+    if ((ret < 0) || ((size_t)ret >= (size - pos)))
     {
-      LOG_INF("Provisioned Client Certificate");
+      return -ENOMEM;
     }
+    pos += ret;
+
+    off += obj;
   }
 
-  // Provision the Private Key
-  (void)modem_key_mgmt_exists(CONFIG_MY_MQTT_HELPER_SEC_TAG,
-                              MODEM_KEY_MGMT_CRED_TYPE_PRIVATE_CERT,
-                              &exists);
-  if (exists && !IS_ENABLED(CONFIG_PSS_MQTT_FORCE_PROVISION))
-  { // lint !e774 !e506
-    LOG_INF("Cred type: %d for sec tag %d",
-            MODEM_KEY_MGMT_CRED_TYPE_PRIVATE_CERT,
-            CONFIG_MY_MQTT_HELPER_SEC_TAG);
+  return (int32_t)pos;
+}
+
+/**
+ * @brief Write one credential to the modem
+ */
+static int32_t cred_write(const pss_mqtt_cred_t *cred)
+{
+  int32_t len;
+
+  if (cred->label == NULL)
+  {
+    return modem_key_mgmt_write(CONFIG_MY_MQTT_HELPER_SEC_TAG, cred->type, cred->data, cred->len);
   }
-  else
+
+  len = pem_from_der(cred, pem_buf, sizeof(pem_buf));
+  if (len < 0)
+  {
+    return len;
+  }
+
+  return modem_key_mgmt_write(CONFIG_MY_MQTT_HELPER_SEC_TAG, cred->type, pem_buf, (size_t)len);
+}
+
+/**
+ * @brief Write the credentials that changed since they were last written
+ *
+ * @param written Incremented for every credential written
+ * @return 0 on success, the error of the first credential that failed
+ */
+static int32_t pss_mqtt_creds_write(uint32_t *written)
+{
+  int32_t err;
+  char name[16];
+
+  for (size_t i = 0; i < ARRAY_SIZE(pss_mqtt_creds); i++)
   {
-    err = modem_key_mgmt_write(CONFIG_MY_MQTT_HELPER_SEC_TAG,
-                               MODEM_KEY_MGMT_CRED_TYPE_PRIVATE_CERT,
-                               ublox_key,
-                               sizeof(ublox_key) - 1); // lint !e778
+    const pss_mqtt_cred_t *cred = &pss_mqtt_creds[i];
+    cred_record_t *rec = &cred_records[i];
 
+    if (!IS_ENABLED(CONFIG_PSS_MQTT_FORCE_PROVISION)
+        && (rec->sec_tag == CONFIG_MY_MQTT_HELPER_SEC_TAG)
+        && (0 == memcmp(rec->digest, cred->digest, sizeof(rec->digest))))
+    { // lint !e774 !e506
+      continue;
+    }
+
+    err = cred_write(cred);
     if (err)
     {
-      LOG_ERR("Failed to register private key: %d", err);
+      LOG_ERR("Failed to provision cred type %d: %d", cred->type, err);
       return err;
     }
-    else
+
+    rec->sec_tag = CONFIG_MY_MQTT_HELPER_SEC_TAG;
+    memcpy(rec->digest, cred->digest, sizeof(rec->digest));
+    (void)snprintf(name, sizeof(name), "pss_mqtt/cred%d", (int)i);
+    err = settings_save_one(name, rec, sizeof(*rec));
+    if (err)
     {
-      LOG_INF("Provisioned Private Key Certificate");
+      LOG_WRN("Failed to save credential record, err: %d", err);
     }
+
+    LOG_INF("Provisioned cred type %d", cred->type);
+    (*written)++;
   }
 
-  // Provision the Client ID
-  (void)modem_key_mgmt_exists(CONFIG_MY_MQTT_HELPER_SEC_TAG,
-                              MODEM_KEY_MGMT_CRED_TYPE_IDENTITY,
-                              &exists);
-  if (exists && !IS_ENABLED(CONFIG_PSS_MQTT_FORCE_PROVISION))
-  { // lint !e774 !e506
-    LOG_INF("Cred type: %d for sec tag %d",
-            MODEM_KEY_MGMT_CRED_TYPE_IDENTITY,
-            CONFIG_MY_MQTT_HELPER_SEC_TAG);
+  return 0;
+}
+
+int32_t pss_mqtt_provision(void)
+{
+  int32_t err;
+  uint32_t written = 0;
+
+  err = settings_subsys_init();
+  if (0 == err)
+  {
+    err = settings_load_subtree("pss_mqtt");
   }
-  else
+  if (err)
   {
-    err = modem_key_mgmt_write(CONFIG_MY_MQTT_HELPER_SEC_TAG,
-                               MODEM_KEY_MGMT_CRED_TYPE_IDENTITY,
-                               new_client_id,
-                               sizeof(new_client_id) - 1); // lint !e778
+    // Without records every credential is rewritten
+    LOG_WRN("Credential records unavailable, err: %d", err);
+  }
 
-    if (err)
-    {
-      LOG_ERR("Failed to register client id: %d", err);
-      return err;
-    }
-    else
-    {
-      LOG_INF("Provisioned Client ID");
-    }
+  // The topics are set up even if a write fails, nothing may publish on NULL topics
+  err = pss_mqtt_creds_write(&written);
+
+  if (written)
+  {
+    // A session cached with the old credentials must not be resumed
+    mqtt_helper_tls_session_invalidate();
   }
+
+  LOG_INF("Credentials %s, %d of %d written", PSS_MQTT_CERTS_DIGEST, (int)written, (int)ARRAY_SIZE(pss_mqtt_creds));
+
+  // The identity is known at build time, no need to read it back
+  client_id_size = MIN(sizeof(new_client_id) - 1, CLIENT_ID_BUF_SIZE);
+  memcpy(client_id, new_client_id, client_id_size);
+  client_id[client_id_size] = '\0';
+  LOG_INF("Client ID: %s", client_id);
+
+  pss_mqtt_topics_init();
+
+  return err;
+}
 #else
-  ARG_UNUSED(exists);
-  ARG_UNUSED(new_client_id);
-  ARG_UNUSED(ublox_ca_certificate);
-  ARG_UNUSED(ublox_key);
-  ARG_UNUSED(root_ca);
-#endif /* defined(PSS_MQTT_CERTS_AVAILABLE) */
+int32_t pss_mqtt_provision(void)
+{
+  int32_t err;
 
   err = modem_key_mgmt_read(CONFIG_MY_MQTT_HELPER_SEC_TAG,
                             MODEM_KEY_MGMT_CRED_TYPE_IDENTITY,
                             client_id,
                             &client_id_size);
+  client_id_size = (0 == err) ? MIN(strnlen(client_id, client_id_size), CLIENT_ID_BUF_SIZE) : 0;
+  client_id[client_id_size] = '\0';
   LOG_INF("Client ID: %s", client_id);
 
+  pss_mqtt_topics_init();
+
   return err;
-};
+}
+#endif /* defined(PSS_MQTT_CERTS_AVAILABLE) */
+
+/**
+ * @brief Log the cost of the connect that just completed.
+ * The modem counts in kilobytes, so the traffic is only a coarse figure.
+ * Runs on the system work queue, reading the counters is a blocking AT
+ * command the helper thread must not wait for.
+ */
+static void pss_mqtt_log_connect_cost(struct k_work *work)
+{
+  struct mqtt_helper_stats stats;
+  int32_t tx_kb;
+  int32_t rx_kb;
+
+  ARG_UNUSED(work);
+
+  mqtt_helper_stats_get(&stats);
+
+  LOG_INF("Connect took %d ms (full: %d, avg %d ms, resumed: %d, avg %d ms)",
+          (int)stats.last_connect_ms,
+          (int)stats.full_handshakes,
+          (int)(stats.full_handshakes ? (stats.full_connect_ms / stats.full_handshakes) : 0),
+          (int)stats.resume_attempts,
+          (int)(stats.resume_attempts ? (stats.resume_connect_ms / stats.resume_attempts) : 0));
+  LOG_INF("DNS lookups: %d (failed: %d, last %d ms), cache hits: %d, fallbacks: %d",
+          (int)stats.dns_lookups,
+          (int)stats.dns_failures,
+          (int)stats.last_dns_ms,
+          (int)stats.dns_cache_hits,
+          (int)stats.dns_fallbacks);
+
+  if (connect_kb_valid && (0 == pss_nrf_lte_get_data_kb(&tx_kb, &rx_kb)))
+  {
+    LOG_INF("Connect traffic: TX %d KB, RX %d KB", tx_kb - connect_tx_kb, rx_kb - connect_rx_kb);
+  }
+}
+
+static K_WORK_DEFINE(connect_cost_work, pss_mqtt_log_connect_cost);
 
 /**
  * @brief Callback from a connection event.
@@ -228,6 +495,16 @@ static void mqtt_connected_cb(enum mqtt_conn_return_code return_code)
   if (return_code == MQTT_CONNECTION_ACCEPTED)
   {
     LOG_INF("MQTT Connected successfully");
+    (void)k_work_submit(&connect_cost_work);
+    pss_mqtt_backoff_connected();
+    if (pss_mqtt_broker_connected())
+    {
+      // Another broker, it holds none of the retained values or discovery
+      pss_mqtt_shadow_dirty_all();
+#if IS_ENABLED(CONFIG_PSS_MQTT_HA_DISCOVERY)
+      discovery_hash = 0;
+#endif
+    }
     mqtt_connected = true;
     gpio_pin_set_dt(&led2,1);
     mqtt_has_error = false;
@@ -252,7 +529,23 @@ static void mqtt_disconnected_cb(int result)
 {
   LOG_WRN("MQTT Disconnected %d", (int)result);
   mqtt_connected = false;
+  // The session is clean, the next one subscribes and publishes discovery again
+  subscribe_pending = false;
+#if IS_ENABLED(CONFIG_PSS_MQTT_HA_DISCOVERY)
+  discovery_unacked = 0;
+#endif
   gpio_pin_set_dt(&led2,0);
+  if (mqtt_closing)
+  {
+    // Nothing went wrong, the next session starts on demand
+    mqtt_closing = false;
+    pss_mqtt_backoff_reset();
+  }
+  else
+  {
+    pss_mqtt_backoff_failed();
+    pss_mqtt_broker_failed();
+  }
   k_sem_give(&do_connection_sem);
 }
 
@@ -268,33 +561,126 @@ static void mqtt_error_cb(enum mqtt_helper_error error)
 }
 
 /**
- * @brief Callback from a publish event
+ * @brief Callback with a part of an incoming publish. Payloads are streamed
+ * through the helper's payload buffer, so their size is not limited by it.
  *
- * @param topic The topic that has published by PointPerfect
- * @param payload The contents of that published topic
+ * @param topic The topic of the publish
+ * @param offset Position of the chunk in the payload
+ * @param chunk The chunk
+ * @param total Length of the whole payload
+ * @return 0 to continue, negative to drop the rest
  */
-static void mqtt_publish_cb(struct mqtt_helper_buf topic, struct mqtt_helper_buf payload)
+static int mqtt_publish_chunk_cb(struct mqtt_helper_buf topic,
+                                 size_t offset,
+                                 struct mqtt_helper_buf chunk,
+                                 size_t total)
 {
-  int32_t err = 0;
+  static int64_t start_ms;
+  int32_t err;
+  pss_mqtt_rx_t rx = {
+    .topic = topic,
+    .offset = offset,
+    .total = total,
+    .chunk = chunk,
+  };
 
-  LOG_INF("Topic %s - Payload size: %d", topic.ptr, payload.size);
+  if (offset == 0)
+  {
+    start_ms = k_uptime_get();
+    LOG_INF("Topic %.*s - Payload size: %d", (int)topic.size, topic.ptr, (int)total);
+  }
 
-  // TODO
-  // err = pss_mqtt_ubx_process_payload(topic, payload);
+  err = pss_mqtt_sub_dispatch(&rx);
   if (err < 0)
   {
     LOG_ERR("Error processing payload, err %d", err);
     mqtt_has_error = true;
+    return err;
   }
-  else
+
+#if IS_ENABLED(CONFIG_PSS_MQTT_DUMP_HEX)
+  LOG_HEXDUMP_INF(chunk.ptr, chunk.size, "Payload Data: ");
+#endif
+
+  if ((offset + chunk.size) == total)
   {
+    int64_t ms = k_uptime_get() - start_ms;
+
+    LOG_INF("Received %d bytes in %d ms", (int)total, (int)ms);
     mqtt_has_error = false;
   }
 
-#if IS_ENABLED(CONFIG_PSS_MQTT_DUMP_HEX)
-  LOG_INF("From Topic: %s", topic.ptr);
-  LOG_HEXDUMP_INF(payload.ptr, payload.size, "Payload Data: ");
+  return 0;
+}
+
+#if IS_ENABLED(CONFIG_PSS_MQTT_HA_DISCOVERY)
+/**
+ * @brief Count the PUBACK of a discovery config. The set is only taken as
+ * held by the broker once every config is acknowledged.
+ *
+ * @param message_id The id of the acknowledged publish
+ * @return true if the id belongs to a discovery config
+ */
+static bool pss_mqtt_discovery_acked(uint16_t message_id)
+{
+  for (size_t i = 0; i < PSS_MQTT_DISCOVERY_COUNT; i++)
+  {
+    if ((discovery_unacked > 0) && (discovery_ids[i] == message_id))
+    {
+      discovery_ids[i] = 0;
+      discovery_unacked--;
+      if (discovery_unacked == 0)
+      {
+        LOG_INF("Discovery acknowledged, hash 0x%08x", PSS_MQTT_DISCOVERY_HASH);
+        discovery_hash = PSS_MQTT_DISCOVERY_HASH;
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+#endif
+
+/**
+ * @brief Callback from a PUBACK
+ *
+ * @param message_id The id of the acknowledged publish
+ * @param result The result of the publish
+ */
+static void mqtt_puback_cb(uint16_t message_id, int result)
+{
+#if IS_ENABLED(CONFIG_PSS_MQTT_HA_DISCOVERY)
+  if (pss_mqtt_discovery_acked(message_id))
+  {
+    pss_mqtt_tx_burst_acked();
+    pss_mqtt_tx_rai_release();
+    return;
+  }
 #endif
+
+  pss_mqtt_inflight_ack(message_id, result);
+  pss_mqtt_tx_burst_acked();
+  pss_mqtt_tx_rai_release();
+}
+
+/**
+ * @brief Callback from a PINGRESP. The helper aborts the connection when it
+ * is late, so an answer means the session is alive.
+ */
+static void mqtt_pingresp_cb(void)
+{
+  struct mqtt_helper_stats stats;
+
+  mqtt_helper_stats_get(&stats);
+
+  LOG_DBG("PINGRESP in %d ms, keepalive %d s (search %d..%d s)",
+          (int)stats.last_ping_rtt_ms,
+          (int)stats.keepalive_sec,
+          (int)stats.keepalive_lo_sec,
+          (int)stats.keepalive_hi_sec);
+  pss_mqtt_broker_rtt(stats.last_ping_rtt_ms);
+  mqtt_has_error = false;
 }
 
 /**
@@ -305,6 +691,11 @@ static void mqtt_publish_cb(struct mqtt_helper_buf topic, struct mqtt_helper_buf
  */
 static void mqtt_subscribe_cb(uint16_t message_id, int result)
 {
+  if (message_id == SUBSCRIBE_ID)
+  {
+    subscribe_pending = false;
+  }
+
   if ((message_id == SUBSCRIBE_ID) && (result == (int)MQTT_SUBACK_SUCCESS_QoS_0))
   {
     LOG_INF("Subscribed to topics, with ID %d", SUBSCRIBE_ID);
@@ -319,6 +710,8 @@ static void mqtt_subscribe_cb(uint16_t message_id, int result)
   {
     LOG_WRN("Subscribed to unknown topic, id: %d", message_id);
   }
+
+  pss_mqtt_tx_rai_release();
 }
 
 /**
@@ -329,42 +722,58 @@ static void mqtt_subscribe_cb(uint16_t message_id, int result)
 static void pss_mqtt_connect(void)
 {
   int32_t err;
+  const pss_mqtt_broker_t *broker;
 
   struct mqtt_helper_conn_params conn_params = {0};
 
-  conn_params.hostname.ptr = MQTT_HOSTNAME;
-  conn_params.hostname.size = strlen(MQTT_HOSTNAME);
+  pss_mqtt_broker_attempt();
+  broker = pss_mqtt_broker_active();
+
+  conn_params.hostname.ptr = (char *)broker->host;
+  conn_params.hostname.size = strlen(broker->host);
+  conn_params.port = broker->port;
+  conn_params.sec_tag = broker->sec_tag;
   conn_params.device_id.ptr = client_id;
   conn_params.device_id.size = client_id_size;
   conn_params.will_topic = &lwt_topic;
   conn_params.will_message = &lwt_msg;
   conn_params.will_retain = 1;
 
+  connect_kb_valid = (0 == pss_nrf_lte_get_data_kb(&connect_tx_kb, &connect_rx_kb));
+
   err = mqtt_helper_connect(&conn_params);
   if (err)
   {
     LOG_ERR("MQTT Helper connected failed, err: %d", err);
     mqtt_has_error = true;
+    pss_mqtt_backoff_failed();
+    pss_mqtt_broker_failed();
     k_sem_give(&do_connection_sem);
     return;
   }
 }
 
 /**
- * @brief Initiate a subscription to a hardcoded set of topics
- * QoS level is set to: MQTT_QOS_0_AT_MOST_ONCE
+ * @brief Subscribe to every PSS_MQTT_SUBSCRIBE() filter.
+ * The session is clean, so this is repeated on every connect.
  *
- * @retval 0 The subscription attempt was successful
+ * @retval 0 The subscription attempt was successful or there is nothing to subscribe
  */
 static int pss_mqtt_subscribe(void)
 {
   int err;
+  struct mqtt_subscription_list list;
 
-  struct mqtt_subscription_list list; // TODO = pss_mqtt_ubx_get_sub_list(SUBSCRIBE_ID);
+  if (IS_ENABLED(CONFIG_PSS_MQTT_DISABLE_SUBSCRIPTIONS) || (0 == pss_mqtt_sub_list(&list, SUBSCRIBE_ID)))
+  {
+    return 0;
+  }
 
   for (size_t i = 0; i < list.list_count; i++)
   {
-    LOG_INF("Attempting subscription to: %s", (char *)list.list[i].topic.utf8);
+    LOG_INF("Attempting subscription to: %.*s",
+            (int)list.list[i].topic.size,
+            (char *)list.list[i].topic.utf8);
   }
 
   err = mqtt_helper_subscribe(&list);
@@ -374,44 +783,335 @@ static int pss_mqtt_subscribe(void)
     mqtt_has_error = true;
     return -1;
   }
+  subscribe_pending = true;
   mqtt_has_error = false;
   return 0;
 }
 
-int32_t pss_mqtt_publish(const uint8_t *pub_topic, char *msg, uint8_t QOS)
+bool pss_mqtt_session_pending(void)
+{
+#if IS_ENABLED(CONFIG_PSS_MQTT_HA_DISCOVERY)
+  if (discovery_unacked > 0)
+  {
+    return true;
+  }
+#endif
+
+  return subscribe_pending;
+}
+
+pss_mqtt_lane_t pss_mqtt_topic_lane(pss_mqtt_topic_t topic)
+{
+  return topic_cfg[topic].lane;
+}
+
+uint8_t pss_mqtt_topic_qos(pss_mqtt_topic_t topic)
+{
+  return topic_cfg[topic].qos;
+}
+
+bool pss_mqtt_topic_retain(pss_mqtt_topic_t topic)
+{
+  return topic_cfg[topic].retain;
+}
+
+bool pss_mqtt_topic_enveloped(pss_mqtt_topic_t topic)
+{
+  // Availability doubles as the last will, which has no envelope
+  return IS_ENABLED(CONFIG_PSS_MQTT_ENVELOPE) && (topic != PSS_MQTT_TOPIC_AVAILABILITY);
+}
+
+/**
+ * @brief Size of a PUBLISH packet on the wire, before TLS
+ */
+static uint32_t pss_mqtt_publish_len(const struct mqtt_publish_param *param)
+{
+  // Topic, packet id and payload, behind the fixed header and its remaining length
+  uint32_t len = 2 + param->message.topic.topic.size + (param->message_id ? 2 : 0) + param->message.payload.len;
+
+  return len + 1 + ((len < 128) ? 1 : 2);
+}
+
+int32_t pss_mqtt_send(const pss_mqtt_msg_t *msg, uint16_t message_id, bool dup)
 {
-  int32_t err = 0;
+  uint32_t len;
+  int32_t err;
 
   struct mqtt_publish_param param = {
-      .message.payload.data = msg,
-      .message.payload.len = strlen(msg),
-      .message.topic.qos = QOS,
-      .message_id = k_uptime_get_32(),
-      .message.topic.topic.utf8 = pub_topic,
-      .message.topic.topic.size = strlen(pub_topic),
-      .retain_flag = 1
+      .message.topic = topics[msg->topic],
+      .message.payload.data = (uint8_t *)msg->payload,
+      .message.payload.len = msg->len,
+      .message_id = message_id,
+      .dup_flag = dup,
+      .retain_flag = topic_cfg[msg->topic].retain
   };
 
-  if (mqtt_connected)
+  if (!mqtt_connected)
   {
+    return -ENOTCONN;
+  }
+
+#if IS_ENABLED(CONFIG_PSS_MQTT_ENVELOPE)
+  // Only the service thread sends, every character may need an escape
+  static uint8_t env_buf[(2 * CONFIG_PSS_MQTT_TX_PAYLOAD_MAX) + 64];
+
+  if (pss_mqtt_topic_enveloped((pss_mqtt_topic_t)msg->topic))
+  {
+    param.message.payload.len = pss_mqtt_env_wrap(msg, env_buf, sizeof(env_buf));
+    if (param.message.payload.len == 0)
+    {
+      LOG_ERR("Envelope does not fit, topic %d", (int)msg->topic);
+      return -EMSGSIZE;
+    }
+    param.message.payload.data = env_buf;
+  }
+#endif
+
+  err = mqtt_helper_publish(&param);
+  if (err)
+  {
+    LOG_ERR("Failed to send payload, err: %d", err);
+    return err;
+  }
+
+  len = pss_mqtt_publish_len(&param);
+  pss_mqtt_tx_burst_sent(len);
+  if (IS_ENABLED(CONFIG_PSS_MQTT_USAGE))
+  {
+    pss_mqtt_usage_sent((pss_mqtt_topic_t)msg->topic, len, message_id != 0);
+  }
+
+  // The payload may be a binary envelope, only dumped at debug level
+  LOG_INF("Published %u bytes on topic: \"%.*s\"", (unsigned int)param.message.payload.len,
+          topics[msg->topic].topic.size,
+          topics[msg->topic].topic.utf8);
+  LOG_HEXDUMP_DBG(param.message.payload.data, param.message.payload.len, "Payload");
+
+  return 0;
+}
+
+#if IS_ENABLED(CONFIG_PSS_MQTT_HA_DISCOVERY)
+/**
+ * @brief Publish the retained Home Assistant discovery configs.
+ * Skipped when the broker already holds the current set.
+ *
+ * @retval 0 Discovery is up to date on the broker
+ */
+static int32_t pss_mqtt_publish_discovery(void)
+{
+  int32_t err;
+
+  if (discovery_hash == PSS_MQTT_DISCOVERY_HASH)
+  {
+    LOG_DBG("Discovery unchanged, skipping");
+    return 0;
+  }
+
+  // PUBACKs of an earlier, unfinished set are not counted anymore
+  memset(discovery_ids, 0, sizeof(discovery_ids));
+  discovery_unacked = 0;
+
+  for (size_t i = 0; i < PSS_MQTT_DISCOVERY_COUNT; i++)
+  {
+    int topic_len = snprintf(discovery_topic, sizeof(discovery_topic),
+                             pss_mqtt_discovery[i].topic, device_id);
+    int payload_len = snprintf(discovery_payload, sizeof(discovery_payload),
+                               pss_mqtt_discovery[i].payload, topic_base, device_id, device_id);
+
+    struct mqtt_publish_param param = {
+        .message.payload.data = discovery_payload,
+        .message.payload.len = (uint32_t)payload_len,
+        .message.topic.qos = MQTT_QOS_1_AT_LEAST_ONCE,
+        .message_id = pss_mqtt_msg_id_next(),
+        .message.topic.topic.utf8 = discovery_topic,
+        .message.topic.topic.size = (uint32_t)topic_len,
+        .retain_flag = 1
+    };
+    uint32_t len;
+
     err = mqtt_helper_publish(&param);
     if (err)
     {
-      LOG_ERR("Failed to send payload, err: %d", err);
+      LOG_ERR("Failed to publish discovery %s, err: %d", discovery_topic, err);
       return err;
     }
+    discovery_ids[i] = param.message_id;
+    discovery_unacked++;
+    len = pss_mqtt_publish_len(&param);
+    // Counted like any publish, its PUBACK closes the burst
+    pss_mqtt_tx_burst_sent(len);
+    if (IS_ENABLED(CONFIG_PSS_MQTT_USAGE))
+    {
+      pss_mqtt_usage_discovery_sent(len);
+    }
+  }
+
+  // The hash is recorded by the last PUBACK, a session lost before sends it again
+  LOG_INF("Published %d discovery configs, hash 0x%08x",
+          PSS_MQTT_DISCOVERY_COUNT,
+          PSS_MQTT_DISCOVERY_HASH);
+
+  return 0;
+}
 
-    LOG_INF("Published message: \"%.*s\" on topic: \"%.*s\"", param.message.payload.len,
-            param.message.payload.data,
-            param.message.topic.topic.size,
-            param.message.topic.topic.utf8);
+/**
+ * @brief Home Assistant came online, it may have lost the discovery configs
+ */
+static int ha_status_handler(const pss_mqtt_rx_t *rx)
+{
+  static const char online[] = "online";
+
+  if ((rx->total != (sizeof(online) - 1)) || (0 != memcmp(rx->chunk.ptr, &online[rx->offset], rx->chunk.size)))
+  {
+    return 0;
   }
-  else
+
+  if ((rx->offset + rx->chunk.size) == rx->total)
   {
-    LOG_WRN("Cannot publish to %s, no mqtt connection", pub_topic);
+    LOG_INF("Home Assistant online, publishing discovery again");
+    discovery_hash = 0;
+    if (pss_mqtt_publish_discovery())
+    {
+      mqtt_has_error = true;
+    }
   }
 
-  return err;
+  return 0;
+}
+
+PSS_MQTT_SUBSCRIBE(pss_mqtt_ha_status, CONFIG_PSS_MQTT_HA_STATUS_TOPIC, MQTT_QOS_0_AT_MOST_ONCE, ha_status_handler);
+#endif
+
+void pss_mqtt_session_start(void)
+{
+  if (pss_mqtt_subscribe())
+  {
+    mqtt_has_error = true;
+  }
+
+  // A dropped session may have left the last will behind
+  pss_mqtt_shadow_forget(PSS_MQTT_TOPIC_AVAILABILITY);
+  (void)pss_mqtt_publish(PSS_MQTT_TOPIC_AVAILABILITY, PSS_MQTT_PAYLOAD_LIT("online"));
+  pss_mqtt_shadow_resync();
+
+#if IS_ENABLED(CONFIG_PSS_MQTT_HA_DISCOVERY)
+  if (pss_mqtt_publish_discovery())
+  {
+    mqtt_has_error = true;
+  }
+#endif
+}
+
+/**
+ * @brief On-demand mode, close the session once everything is sent and
+ * acknowledged and the link stayed idle for the linger time. A clean
+ * disconnect leaves the retained availability at online, the last will is
+ * only for sessions that drop.
+ *
+ * @return Milliseconds until the linger time runs out, SYS_FOREVER_MS if
+ * the session is busy or closing
+ */
+static int32_t pss_mqtt_on_demand_check(void)
+{
+#if IS_ENABLED(CONFIG_PSS_MQTT_ON_DEMAND)
+  static int64_t idle_since_ms = -1;
+  int64_t now = k_uptime_get();
+
+  // Closing before the discovery PUBACKs loses the hash, the next session would publish the set again
+  if (!mqtt_connected || mqtt_closing || !pss_mqtt_tx_idle() || pss_mqtt_session_pending())
+  {
+    idle_since_ms = -1;
+    return SYS_FOREVER_MS;
+  }
+
+  if (idle_since_ms < 0)
+  {
+    idle_since_ms = now;
+  }
+  else if ((now - idle_since_ms) >= CONFIG_PSS_MQTT_ON_DEMAND_LINGER_MS)
+  {
+    LOG_INF("Queue drained, closing the MQTT session");
+    idle_since_ms = -1;
+    mqtt_closing = true;
+    if (mqtt_helper_disconnect())
+    {
+      mqtt_closing = false;
+    }
+    return SYS_FOREVER_MS;
+  }
+
+  return (int32_t)(CONFIG_PSS_MQTT_ON_DEMAND_LINGER_MS - (now - idle_since_ms));
+#else
+  return SYS_FOREVER_MS;
+#endif
+}
+
+/**
+ * @brief Close an idle session on a fallback broker once the primary is due
+ * for a probe, the next connect goes to the primary
+ *
+ * @return Milliseconds until the probe is due, SYS_FOREVER_MS on the primary
+ * or while the session is busy or closing
+ */
+static int32_t pss_mqtt_failback_check(void)
+{
+  int32_t left = pss_mqtt_broker_failback_in();
+
+  if ((left == SYS_FOREVER_MS) || !mqtt_connected || mqtt_closing)
+  {
+    return SYS_FOREVER_MS;
+  }
+
+  if (left > 0)
+  {
+    return left;
+  }
+
+  if (!pss_mqtt_tx_idle())
+  {
+    // Retried after the next PUBACK wakes the writer
+    return SYS_FOREVER_MS;
+  }
+
+  LOG_INF("Closing the session on the fallback broker to probe the primary");
+  mqtt_closing = true;
+  if (mqtt_helper_disconnect())
+  {
+    mqtt_closing = false;
+  }
+
+  return SYS_FOREVER_MS;
+}
+
+/**
+ * @brief Callback from the service thread while connected. Drains the queue
+ * and closes idle on-demand sessions, never at the same time as the MQTT
+ * callbacks.
+ *
+ * @return Milliseconds until it needs to run again, SYS_FOREVER_MS to wait
+ * for a wake
+ */
+static int32_t mqtt_service_cb(void)
+{
+  int32_t tx = pss_mqtt_tx_service();
+  int32_t linger = pss_mqtt_on_demand_check();
+  int32_t failback = pss_mqtt_failback_check();
+
+  if (tx < 0)
+  {
+    tx = linger;
+  }
+  else if (linger >= 0)
+  {
+    tx = MIN(tx, linger);
+  }
+
+  if (tx < 0)
+  {
+    return failback;
+  }
+
+  return (failback < 0) ? tx : MIN(tx, failback);
 }
 
 int32_t pss_mqtt_init(void)
@@ -424,8 +1124,11 @@ int32_t pss_mqtt_init(void)
   init_cfg.cb.on_connack = mqtt_connected_cb;
   init_cfg.cb.on_disconnect = mqtt_disconnected_cb;
   init_cfg.cb.on_error = mqtt_error_cb;
-  init_cfg.cb.on_publish = mqtt_publish_cb;
+  init_cfg.cb.on_publish_chunk = mqtt_publish_chunk_cb;
   init_cfg.cb.on_suback = mqtt_subscribe_cb;
+  init_cfg.cb.on_puback = mqtt_puback_cb;
+  init_cfg.cb.on_pingresp = mqtt_pingresp_cb;
+  init_cfg.cb.on_service = mqtt_service_cb;
 
   err = mqtt_helper_init(&init_cfg);
   if (err)
@@ -438,11 +1141,24 @@ int32_t pss_mqtt_init(void)
   k_sem_give(&do_connection_sem);
 #endif
 
+  if (IS_ENABLED(CONFIG_PSS_MQTT_USAGE))
+  {
+    pss_mqtt_usage_init();
+  }
+
   init_led();
 
   return err;
 }
 
+/**
+ * @brief Returns true if a connection is wanted now
+ */
+static bool pss_mqtt_connect_wanted(void)
+{
+  return !IS_ENABLED(CONFIG_PSS_MQTT_ON_DEMAND) || !pss_mqtt_tx_idle();
+}
+
 void pss_mqtt_main(void)
 {
   if (pss_nrf_lte_connected())
@@ -451,13 +1167,14 @@ void pss_mqtt_main(void)
     {
       (void)mqtt_helper_disconnect();
     }
-    else if (0 == k_sem_take(&do_connection_sem, K_NO_WAIT))
+    else if (pss_mqtt_connect_wanted() && pss_mqtt_backoff_due()
+             && (0 == k_sem_take(&do_connection_sem, K_NO_WAIT)))
     {
       pss_mqtt_connect();
     }
     else if (0 == k_sem_take(&on_connection_sem, K_NO_WAIT))
     {
-      // void pss_mqtt_startup(void);
+      pss_mqtt_tx_session_start();
     }
   }
 }
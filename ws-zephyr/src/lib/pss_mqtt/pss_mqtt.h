@@ -5,14 +5,193 @@
 #ifndef PSS_MQTT_H
 #define PSS_MQTT_H
 
+#include "gen/pss_mqtt_telemetry.h"
+
 #include <net/mqtt_helper.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <zephyr/sys/iterable_sections.h>
+
+/**
+ * @brief Topics published by the device.
+ * Each one lives under CONFIG_PSS_MQTT_TOPIC_PREFIX/<client_id>/
+ */
+typedef enum {
+    PSS_MQTT_TOPIC_AVAILABILITY,
+    PSS_MQTT_TOPIC_SENSOR,
+    PSS_MQTT_TOPIC_PUMP,
+    PSS_MQTT_TOPIC_PUMP_CYCLES,
+    PSS_MQTT_TOPIC_PUMP_RUNTIME,
+    PSS_MQTT_TOPIC_BATT,
+    PSS_MQTT_TOPIC_CONFIG_APPLIED,
+    PSS_MQTT_TOPIC_TELEMETRY,
+    PSS_MQTT_TOPIC_ALARM_LAT_QUEUE,
+    PSS_MQTT_TOPIC_ALARM_LAT_WRITE,
+    PSS_MQTT_TOPIC_ALARM_LAT_ACK,
+    PSS_MQTT_TOPIC_ALARM_LAT_TOTAL,
+    PSS_MQTT_TOPIC_COUNT
+} pss_mqtt_topic_t;
+
+/**
+ * @brief A view of a payload, it is not copied or scanned
+ */
+typedef struct {
+    const uint8_t* ptr;
+    size_t len;
+} pss_mqtt_payload_t;
+
+/** @brief Payload view of a string literal, the length is computed at compile time */
+#define PSS_MQTT_PAYLOAD_LIT(str) \
+    ((pss_mqtt_payload_t){.ptr = (const uint8_t*)("" str), .len = sizeof(str) - 1})
+
+/** @brief Number of bins in a latency histogram */
+#define PSS_MQTT_HIST_BINS 8
+
+/**
+ * @brief Fixed bin latency histogram.
+ * Bin upper bounds in ms: 100, 250, 500, 1000, 2000, 5000, 10000, above.
+ */
+typedef struct {
+    uint32_t bins[PSS_MQTT_HIST_BINS];
+    uint32_t count;
+    uint32_t max_ms;
+    uint64_t sum_ms;
+} pss_mqtt_hist_t;
+
+/**
+ * @brief Stages of an alarm, from the GPIO edge to the PUBACK
+ */
+typedef enum {
+    PSS_MQTT_ALARM_STAGE_QUEUE, // Edge to the publish entering its lane
+    PSS_MQTT_ALARM_STAGE_WRITE, // Lane to the first write on the socket, connecting included
+    PSS_MQTT_ALARM_STAGE_ACK,   // First write to the PUBACK, retransmissions included
+    PSS_MQTT_ALARM_STAGE_TOTAL, // Edge to the PUBACK
+    PSS_MQTT_ALARM_STAGE_COUNT
+} pss_mqtt_alarm_stage_t;
+
+/** @brief Number of bins in an alarm stage histogram */
+#define PSS_MQTT_ALARM_BINS 12
+
+/**
+ * @brief Fixed bin histogram of an alarm stage.
+ * Bin upper bounds in us: 100, 1000, 10000, 50000, 100000, 250000, 500000,
+ * 1000000, 2000000, 5000000, 10000000, above.
+ */
+typedef struct {
+    uint32_t bins[PSS_MQTT_ALARM_BINS];
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t sum_us;
+} pss_mqtt_alarm_hist_t;
+
+/**
+ * @brief Cost of a burst, from the first publish to the last PUBACK.
+ * A heartbeat is one burst.
+ */
+typedef struct {
+    uint32_t bursts;      // Bursts completed since boot
+    uint32_t publishes;   // Publishes written in the last burst, retransmissions included
+    uint32_t records;     // TLS records of the last burst, one per publish and per PUBACK
+    uint32_t bytes;       // MQTT bytes of the last burst, both directions
+    uint32_t duration_ms; // First publish to last PUBACK of the last burst
+} pss_mqtt_burst_t;
+
+/**
+ * @brief State of the reconnect policy
+ */
+typedef struct {
+    uint32_t attempts;      // Failed attempts since the last stable session
+    uint32_t failures;      // Failed attempts or dropped sessions since boot
+    uint32_t next_retry_ms; // Time until the next attempt is allowed, 0 if now
+} pss_mqtt_reconnect_t;
+
+/**
+ * @brief Health of a broker of the failover list
+ */
+typedef struct {
+    const char* host;
+    uint16_t port;
+    bool active;          // Used for the next connect
+    uint32_t attempts;    // Connects attempted
+    uint32_t connects;    // Attempts accepted with a CONNACK
+    uint32_t drops;       // Accepted sessions that ended without being closed on purpose
+    uint32_t fail_streak; // Failed attempts and drops in a row
+    uint32_t rtt_ms;      // Smoothed PINGRESP round trip, 0 before the first
+} pss_mqtt_broker_info_t;
+
+/**
+ * @brief Data usage of the current month
+ */
+typedef struct {
+    uint32_t month;       // Year * 12 + month - 1, 0 before the first network time
+    uint32_t budget_kb;   // CONFIG_PSS_MQTT_USAGE_BUDGET_KB, 0 if unlimited
+    uint32_t used_kb;     // Charged against the budget, the larger of est_bytes and modem_kb
+    uint32_t est_bytes;   // Publishes and PUBACKs with estimated TLS and TCP/IP overhead
+    uint32_t modem_kb;    // %XCONNSTAT traffic, both directions
+    uint8_t throttle;     // Telemetry keeps 1 of 2^throttle publishes, UINT8_MAX if stopped
+    uint32_t topic_bytes[PSS_MQTT_TOPIC_COUNT]; // Estimated bytes per topic
+    uint32_t discovery_bytes; // Estimated bytes of the Home Assistant discovery configs
+} pss_mqtt_usage_t;
+
+/** @brief Payload view of a buffer formatted at runtime */
+#define PSS_MQTT_PAYLOAD(buf, length) ((pss_mqtt_payload_t){.ptr = (const uint8_t*)(buf), .len = (length)})
+
+/**
+ * @brief A part of an inbound message, handed to a subscription handler.
+ * Payloads are streamed, chunk.ptr is only valid during the call.
+ */
+typedef struct {
+    struct mqtt_helper_buf topic; // Full topic, not NUL terminated
+    size_t offset;                // Position of the chunk in the payload
+    size_t total;                 // Payload length
+    struct mqtt_helper_buf chunk;
+} pss_mqtt_rx_t;
+
+/**
+ * @brief Handler of a subscription, called once per chunk.
+ * Returns 0 to continue, negative to drop the rest of the message.
+ */
+typedef int (*pss_mqtt_sub_handler_t)(const pss_mqtt_rx_t* rx);
+
+/**
+ * @brief A topic filter and its handler, see PSS_MQTT_SUBSCRIBE()
+ */
+struct pss_mqtt_sub {
+    const char* filter;
+    uint8_t qos;
+    pss_mqtt_sub_handler_t handler;
+};
+
+/**
+ * @brief Register a subscription from any module. It is subscribed on every
+ * new session. A filter starting with "~/" is relative to the device topic
+ * base, <prefix>/<client_id>/, like the "~" of Home Assistant discovery.
+ * "+" and "#" wildcards are allowed.
+ *
+ * @param name Unique name of the registration
+ * @param filter_str Topic filter
+ * @param qos_lvl Maximum QoS of the subscription
+ * @param handler_fn Called with every chunk of a matching message
+ */
+#define PSS_MQTT_SUBSCRIBE(name, filter_str, qos_lvl, handler_fn) \
+    STRUCT_SECTION_ITERABLE(pss_mqtt_sub, name) = {               \
+        .filter = (filter_str),                                   \
+        .qos = (qos_lvl),                                         \
+        .handler = (handler_fn),                                  \
+    }
 
 /**
  * @brief Initialize the MQTT client and callbacks
  */
 int32_t pss_mqtt_init(void);
 
+/**
+ * @brief Load the envelope sequence reserve. Call it before anything can
+ * publish, the numbers taken before it are reused after a reboot.
+ */
+void pss_mqtt_env_init(void);
+
 /*
  * @brief Main thread function for the MQTT client
  */
@@ -25,6 +204,7 @@ void pss_mqtt_main(void);
  * it will be saved.
  * CONFIG_PSS_MQTT_FORCE_PROVISION forces existing certs to be
  * replaced with new certs, if available.
+ * The device topics are built from the client id read here.
  *
  * @return 0 All required certificates successfully provisioned
 */
@@ -50,6 +230,99 @@ bool pss_mqtt_connected(void);
 bool pss_mqtt_has_error(void);
 
 
-int32_t pss_mqtt_publish(const uint8_t* pub_topic, char * msg, uint8_t QOS);
+/**
+ * @brief Queue a message for one of the device topics.
+ * Never blocks, so it can be called from an ISR. The payload is copied
+ * and the MQTT service thread sends it in priority order: alarms, then state,
+ * then telemetry. Messages stay queued while disconnected.
+ * QoS and retain come from the topic table.
+ *
+ * @param topic The device topic to publish on
+ * @param payload The payload to send, see PSS_MQTT_PAYLOAD_LIT()
+ * @retval 0 The message was queued
+ * @retval -EINVAL Unknown topic
+ * @retval -EMSGSIZE Payload is larger than CONFIG_PSS_MQTT_TX_PAYLOAD_MAX
+ * @retval -ENOBUFS The topic's lane is full, the message was dropped
+ * @retval -EDQUOT Telemetry held back by the monthly data budget
+ */
+int32_t pss_mqtt_publish(pss_mqtt_topic_t topic, pss_mqtt_payload_t payload);
+
+/**
+ * @brief Set a field of the next CBOR telemetry message.
+ * Can be called from an ISR. Requires CONFIG_PSS_MQTT_TELEMETRY_CBOR.
+ *
+ * @param field The field, see cfg/telemetry.csv
+ * @param value The value, unsigned fields must not be negative
+ */
+void pss_mqtt_telemetry_set(pss_mqtt_tlm_field_t field, int32_t value);
+
+/**
+ * @brief Queue the fields set since the last flush as one CBOR map on
+ * the telemetry topic. Can be called from an ISR.
+ *
+ * @retval 0 The message was queued, or there was nothing to send
+ * @return Otherwise a negative error from encoding or pss_mqtt_publish()
+ */
+int32_t pss_mqtt_telemetry_flush(void);
+
+/**
+ * @brief Copy the publish to PUBACK round trip histogram of QoS 1 messages
+ *
+ * @param hist Destination
+ */
+void pss_mqtt_puback_latency_get(pss_mqtt_hist_t* hist);
+
+/**
+ * @brief Mark the GPIO edge of an alarm, the next publish on the alarm lane
+ * carries it. Call first in the interrupt handler.
+ * Requires CONFIG_PSS_MQTT_ALARM_LATENCY.
+ *
+ * @param cycles k_cycle_get_32() at the edge
+ */
+void pss_mqtt_alarm_edge(uint32_t cycles);
+
+/**
+ * @brief Copy the alarm latency histograms, see pss_mqtt_alarm_stage_t
+ *
+ * @param hist Destination, one histogram per stage
+ */
+void pss_mqtt_alarm_latency_get(pss_mqtt_alarm_hist_t hist[PSS_MQTT_ALARM_STAGE_COUNT]);
+
+/**
+ * @brief Returns the number of QoS 1 publishes waiting for a PUBACK
+ */
+uint32_t pss_mqtt_inflight_count(void);
+
+/**
+ * @brief Copy the cost of the last burst, see pss_mqtt_burst_t
+ *
+ * @param burst Destination
+ */
+void pss_mqtt_burst_get(pss_mqtt_burst_t* burst);
+
+/**
+ * @brief Copy the health of a broker of the failover list
+ *
+ * @param index Position in the list, 0 is CONFIG_PSS_MQTT_HOST
+ * @param info Destination
+ * @retval 0 Success
+ * @retval -EINVAL There is no broker at this position
+ */
+int32_t pss_mqtt_broker_get(size_t index, pss_mqtt_broker_info_t* info);
+
+/**
+ * @brief Copy the data usage of the current month.
+ * Requires CONFIG_PSS_MQTT_USAGE.
+ *
+ * @param info Destination
+ */
+void pss_mqtt_usage_get(pss_mqtt_usage_t* info);
+
+/**
+ * @brief Copy the state of the reconnect policy
+ *
+ * @param info Destination
+ */
+void pss_mqtt_reconnect_get(pss_mqtt_reconnect_t* info);
 
 #endif /* PSS_MQTT_H */
@@ -0,0 +1,255 @@
+/**
+ * @brief Alarm latency. An alarm is stamped at its GPIO edge, when it enters
+ * its lane, when it is first written and when its PUBACK arrives. Each
+ * stage goes into a fixed bin histogram, shown by the "pss_mqtt latency"
+ * shell command and published on <base>/alarm/lat/<stage>.
+ */
+
+#include "pss_mqtt_private.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/sys/atomic.h>
+
+LOG_MODULE_DECLARE(pss_mqtt, CONFIG_PSS_MQTT_LOG_LEVEL);
+
+// Upper bound of each bin, the last bin takes everything above
+static const uint32_t alarm_bounds_us[PSS_MQTT_ALARM_BINS - 1] = {
+  100, 1000, 10000, 50000, 100000, 250000, 500000, 1000000, 2000000, 5000000, 10000000
+};
+
+static const char *const stage_names[PSS_MQTT_ALARM_STAGE_COUNT] = {
+  [PSS_MQTT_ALARM_STAGE_QUEUE] = "queue",
+  [PSS_MQTT_ALARM_STAGE_WRITE] = "write",
+  [PSS_MQTT_ALARM_STAGE_ACK] = "ack",
+  [PSS_MQTT_ALARM_STAGE_TOTAL] = "total",
+};
+
+static const pss_mqtt_topic_t stage_topics[PSS_MQTT_ALARM_STAGE_COUNT] = {
+  [PSS_MQTT_ALARM_STAGE_QUEUE] = PSS_MQTT_TOPIC_ALARM_LAT_QUEUE,
+  [PSS_MQTT_ALARM_STAGE_WRITE] = PSS_MQTT_TOPIC_ALARM_LAT_WRITE,
+  [PSS_MQTT_ALARM_STAGE_ACK] = PSS_MQTT_TOPIC_ALARM_LAT_ACK,
+  [PSS_MQTT_ALARM_STAGE_TOTAL] = PSS_MQTT_TOPIC_ALARM_LAT_TOTAL,
+};
+
+static pss_mqtt_alarm_hist_t alarm_hist[PSS_MQTT_ALARM_STAGE_COUNT];
+static struct k_spinlock alarm_lock;
+static atomic_t edge_pending = ATOMIC_INIT(0);
+
+/**
+ * @brief Add the time between two cycle stamps to the histogram of a stage
+ */
+static void alarm_hist_add(pss_mqtt_alarm_stage_t stage, uint32_t from_cyc, uint32_t to_cyc)
+{
+  uint32_t us = k_cyc_to_us_floor32(to_cyc - from_cyc);
+  pss_mqtt_alarm_hist_t *hist = &alarm_hist[stage];
+  size_t bin = 0;
+  k_spinlock_key_t key;
+
+  while ((bin < ARRAY_SIZE(alarm_bounds_us)) && (us > alarm_bounds_us[bin]))
+  {
+    bin++;
+  }
+
+  key = k_spin_lock(&alarm_lock);
+  hist->bins[bin]++;
+  hist->count++;
+  hist->sum_us += us;
+  if (us > hist->max_us)
+  {
+    hist->max_us = us;
+  }
+  k_spin_unlock(&alarm_lock, key);
+}
+
+/**
+ * @brief Percentile of a histogram in us, the upper bound of its bin and
+ * never above the maximum
+ */
+static uint32_t alarm_hist_percentile(const pss_mqtt_alarm_hist_t *hist, uint32_t percent)
+{
+  uint32_t rank = ((hist->count * percent) + 99) / 100;
+  uint32_t seen = 0;
+
+  for (size_t bin = 0; bin < ARRAY_SIZE(alarm_bounds_us); bin++)
+  {
+    seen += hist->bins[bin];
+    if (seen >= rank)
+    {
+      return MIN(alarm_bounds_us[bin], hist->max_us);
+    }
+  }
+
+  return hist->max_us;
+}
+
+void pss_mqtt_alarm_edge(uint32_t cycles)
+{
+  // Never 0, which means no edge is pending
+  (void)atomic_set(&edge_pending, (atomic_val_t)(cycles | 1));
+}
+
+void pss_mqtt_alarm_take(pss_mqtt_msg_t *msg)
+{
+  msg->edge_cyc = 0;
+  if (pss_mqtt_topic_lane((pss_mqtt_topic_t)msg->topic) == PSS_MQTT_LANE_ALARM)
+  {
+    msg->edge_cyc = (uint32_t)atomic_clear(&edge_pending);
+  }
+}
+
+void pss_mqtt_alarm_stamp(pss_mqtt_msg_t *msg)
+{
+  if (msg->edge_cyc == 0)
+  {
+    return;
+  }
+
+  msg->stage = PSS_MQTT_ALARM_STAGE_WRITE;
+  msg->stage_cyc = k_cycle_get_32();
+}
+
+void pss_mqtt_alarm_queued(const pss_mqtt_msg_t *msg)
+{
+  if (msg->edge_cyc == 0)
+  {
+    return;
+  }
+
+  // A full lane drops the alarm, only accepted ones are counted
+  alarm_hist_add(PSS_MQTT_ALARM_STAGE_QUEUE, msg->edge_cyc, msg->stage_cyc);
+}
+
+void pss_mqtt_alarm_written(pss_mqtt_msg_t *msg)
+{
+  uint32_t now;
+
+  if ((msg->edge_cyc == 0) || (msg->stage != PSS_MQTT_ALARM_STAGE_WRITE))
+  {
+    return;
+  }
+
+  now = k_cycle_get_32();
+  alarm_hist_add(PSS_MQTT_ALARM_STAGE_WRITE, msg->stage_cyc, now);
+  msg->stage = PSS_MQTT_ALARM_STAGE_ACK;
+  msg->stage_cyc = now;
+}
+
+void pss_mqtt_alarm_acked(const pss_mqtt_msg_t *msg)
+{
+  pss_mqtt_alarm_hist_t hist[PSS_MQTT_ALARM_STAGE_COUNT];
+  char buf[CONFIG_PSS_MQTT_TX_PAYLOAD_MAX];
+  uint32_t now;
+  int len;
+
+  if ((msg->edge_cyc == 0) || (msg->stage != PSS_MQTT_ALARM_STAGE_ACK))
+  {
+    return;
+  }
+
+  now = k_cycle_get_32();
+  alarm_hist_add(PSS_MQTT_ALARM_STAGE_ACK, msg->stage_cyc, now);
+  alarm_hist_add(PSS_MQTT_ALARM_STAGE_TOTAL, msg->edge_cyc, now);
+
+  pss_mqtt_alarm_latency_get(hist);
+  LOG_INF("Alarm delivered %u ms after the edge",
+          (unsigned int)(k_cyc_to_ms_floor32(k_cycle_get_32() - msg->edge_cyc)));
+
+  // "count,p50,p90,p99,max" in ms, retained so the last state is always there
+  for (size_t stage = 0; stage < PSS_MQTT_ALARM_STAGE_COUNT; stage++)
+  {
+    len = snprintf(buf, sizeof(buf), "%u,%u,%u,%u,%u",
+                   (unsigned int)hist[stage].count,
+                   (unsigned int)(alarm_hist_percentile(&hist[stage], 50) / USEC_PER_MSEC),
+                   (unsigned int)(alarm_hist_percentile(&hist[stage], 90) / USEC_PER_MSEC),
+                   (unsigned int)(alarm_hist_percentile(&hist[stage], 99) / USEC_PER_MSEC),
+                   (unsigned int)(hist[stage].max_us / USEC_PER_MSEC));
+    if ((len > 0) && ((size_t)len < sizeof(buf)))
+    {
+      (void)pss_mqtt_publish(stage_topics[stage], PSS_MQTT_PAYLOAD(buf, len));
+    }
+  }
+}
+
+void pss_mqtt_alarm_latency_get(pss_mqtt_alarm_hist_t hist[PSS_MQTT_ALARM_STAGE_COUNT])
+{
+  k_spinlock_key_t key = k_spin_lock(&alarm_lock);
+
+  memcpy(hist, alarm_hist, sizeof(alarm_hist));
+  k_spin_unlock(&alarm_lock, key);
+}
+
+#if IS_ENABLED(CONFIG_SHELL)
+static int cmd_latency(const struct shell *sh, size_t argc, char **argv)
+{
+  pss_mqtt_alarm_hist_t hist[PSS_MQTT_ALARM_STAGE_COUNT];
+
+  ARG_UNUSED(argc);
+  ARG_UNUSED(argv);
+
+  pss_mqtt_alarm_latency_get(hist);
+
+  shell_print(sh, "%-6s %6s %9s %9s %9s %9s %9s", "stage", "count", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+  for (size_t stage = 0; stage < PSS_MQTT_ALARM_STAGE_COUNT; stage++)
+  {
+    shell_print(sh, "%-6s %6u %9u %9u %9u %9u %9u",
+                stage_names[stage],
+                (unsigned int)hist[stage].count,
+                (unsigned int)(hist[stage].count ? (hist[stage].sum_us / hist[stage].count) : 0),
+                (unsigned int)alarm_hist_percentile(&hist[stage], 50),
+                (unsigned int)alarm_hist_percentile(&hist[stage], 90),
+                (unsigned int)alarm_hist_percentile(&hist[stage], 99),
+                (unsigned int)hist[stage].max_us);
+  }
+
+  shell_print(sh, "\n%9s %6s %6s %6s %6s", "bin us", stage_names[0], stage_names[1], stage_names[2], stage_names[3]);
+  for (size_t bin = 0; bin < PSS_MQTT_ALARM_BINS; bin++)
+  {
+    char bound[12];
+
+    if (bin < ARRAY_SIZE(alarm_bounds_us))
+    {
+      (void)snprintf(bound, sizeof(bound), "%u", (unsigned int)alarm_bounds_us[bin]);
+    }
+    else
+    {
+      (void)snprintf(bound, sizeof(bound), "above");
+    }
+
+    shell_print(sh, "%9s %6u %6u %6u %6u", bound,
+                (unsigned int)hist[PSS_MQTT_ALARM_STAGE_QUEUE].bins[bin],
+                (unsigned int)hist[PSS_MQTT_ALARM_STAGE_WRITE].bins[bin],
+                (unsigned int)hist[PSS_MQTT_ALARM_STAGE_ACK].bins[bin],
+                (unsigned int)hist[PSS_MQTT_ALARM_STAGE_TOTAL].bins[bin]);
+  }
+
+  return 0;
+}
+
+static int cmd_latency_reset(const struct shell *sh, size_t argc, char **argv)
+{
+  k_spinlock_key_t key;
+
+  ARG_UNUSED(argc);
+  ARG_UNUSED(argv);
+
+  key = k_spin_lock(&alarm_lock);
+  memset(alarm_hist, 0, sizeof(alarm_hist));
+  k_spin_unlock(&alarm_lock, key);
+
+  shell_print(sh, "Alarm latency cleared");
+
+  return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_pss_mqtt,
+  SHELL_CMD(latency, NULL, "Alarm latency per stage, GPIO edge to PUBACK", cmd_latency),
+  SHELL_CMD(latency_reset, NULL, "Clear the alarm latency histograms", cmd_latency_reset),
+  SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(pss_mqtt, &sub_pss_mqtt, "PSS MQTT statistics", NULL);
+#endif
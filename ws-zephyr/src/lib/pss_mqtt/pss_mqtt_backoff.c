@@ -0,0 +1,163 @@
+/**
+ * @brief Reconnect policy. Exponential backoff with full jitter, so a fleet
+ * that lost the broker at the same moment does not come back in lockstep.
+ */
+
+#include "pss_mqtt_private.h"
+#include "pss_nrf_lte.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/random/rand32.h>
+
+LOG_MODULE_DECLARE(pss_mqtt, CONFIG_PSS_MQTT_LOG_LEVEL);
+
+BUILD_ASSERT(CONFIG_PSS_MQTT_BACKOFF_BASE_MS <= CONFIG_PSS_MQTT_BACKOFF_CAP_MS,
+             "Backoff base must not exceed the cap");
+
+static uint32_t attempts = 0;      // Failures since the last stable session
+static uint32_t failures = 0;      // Failures since boot
+static int64_t next_retry_ms = 0;  // Uptime of the next allowed attempt
+static int64_t connected_ms = -1;  // Uptime of the last CONNACK, -1 if not connected
+static bool lte_down = false;
+static struct k_spinlock backoff_lock; // The helper thread fails and connects, the main thread polls
+
+/**
+ * @brief Upper bound of the next delay, base * 2^(attempts - 1) up to the cap.
+ * With PSM the cap is also held to the periodic TAU, the modem wakes up for
+ * it anyway so a longer wait saves nothing.
+ */
+static uint32_t backoff_window(void)
+{
+  uint32_t cap = CONFIG_PSS_MQTT_BACKOFF_CAP_MS;
+  uint32_t window = CONFIG_PSS_MQTT_BACKOFF_BASE_MS;
+  int32_t tau = pss_nrf_lte_get_psm_tau();
+
+  if ((tau > 0) && (((uint32_t)tau * MSEC_PER_SEC) < cap))
+  {
+    cap = MAX((uint32_t)tau * MSEC_PER_SEC, CONFIG_PSS_MQTT_BACKOFF_BASE_MS);
+  }
+
+  for (uint32_t i = 1; (i < attempts) && (window < cap); i++)
+  {
+    window <<= 1;
+  }
+
+  return MIN(window, cap);
+}
+
+/**
+ * @brief Pick the next attempt uniformly in [0, window]. Called with the
+ * lock held.
+ *
+ * @param window Set to the upper bound of the delay
+ * @return The delay in ms
+ */
+static uint32_t backoff_schedule(uint32_t *window)
+{
+  uint32_t delay;
+
+  *window = backoff_window();
+  delay = sys_rand32_get() % (*window + 1);
+  next_retry_ms = k_uptime_get() + delay;
+
+  return delay;
+}
+
+static void backoff_log(uint32_t attempt, uint32_t delay, uint32_t window)
+{
+  LOG_INF("MQTT reconnect attempt %d in %d ms (window %d ms)",
+          (int)attempt,
+          (int)delay,
+          (int)window);
+}
+
+void pss_mqtt_backoff_connected(void)
+{
+  k_spinlock_key_t key = k_spin_lock(&backoff_lock);
+
+  connected_ms = k_uptime_get();
+  k_spin_unlock(&backoff_lock, key);
+}
+
+void pss_mqtt_backoff_failed(void)
+{
+  int64_t now = k_uptime_get();
+  uint32_t attempt;
+  uint32_t delay;
+  uint32_t window;
+  k_spinlock_key_t key = k_spin_lock(&backoff_lock);
+
+  if ((connected_ms >= 0) && ((now - connected_ms) >= CONFIG_PSS_MQTT_BACKOFF_STABLE_MS))
+  {
+    // The session held long enough, start over
+    attempts = 0;
+  }
+
+  connected_ms = -1;
+  attempts++;
+  failures++;
+  attempt = attempts;
+  delay = backoff_schedule(&window);
+  k_spin_unlock(&backoff_lock, key);
+
+  backoff_log(attempt, delay, window);
+}
+
+void pss_mqtt_backoff_reset(void)
+{
+  k_spinlock_key_t key = k_spin_lock(&backoff_lock);
+
+  attempts = 0;
+  connected_ms = -1;
+  next_retry_ms = 0;
+  k_spin_unlock(&backoff_lock, key);
+}
+
+bool pss_mqtt_backoff_due(void)
+{
+  bool rescheduled = false;
+  bool due;
+  uint32_t attempt;
+  uint32_t delay = 0;
+  uint32_t window = 0;
+  k_spinlock_key_t key;
+
+  if (pss_nrf_lte_get_state() != LTE_STATE_CONNECTED)
+  {
+    // No point in trying, and the attempt would be charged to the broker
+    lte_down = true;
+    return false;
+  }
+
+  key = k_spin_lock(&backoff_lock);
+  if (lte_down)
+  {
+    // Back on the network, the broker is likely fine. Spread the first attempt.
+    lte_down = false;
+    attempts = MIN(attempts, 1);
+    delay = backoff_schedule(&window);
+    rescheduled = true;
+  }
+  attempt = attempts;
+  due = (k_uptime_get() >= next_retry_ms);
+  k_spin_unlock(&backoff_lock, key);
+
+  if (rescheduled)
+  {
+    backoff_log(attempt, delay, window);
+  }
+
+  return due;
+}
+
+void pss_mqtt_reconnect_get(pss_mqtt_reconnect_t *info)
+{
+  int64_t now = k_uptime_get();
+  k_spinlock_key_t key = k_spin_lock(&backoff_lock);
+
+  info->attempts = attempts;
+  info->failures = failures;
+  info->next_retry_ms = (next_retry_ms > now) ? (uint32_t)(next_retry_ms - now) : 0;
+  k_spin_unlock(&backoff_lock, key);
+}
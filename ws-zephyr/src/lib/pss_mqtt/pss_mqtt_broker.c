@@ -0,0 +1,170 @@
+/**
+ * @brief Broker failover. The brokers are tried in list order: the primary,
+ * CONFIG_PSS_MQTT_HOST, then CONFIG_PSS_MQTT_FAILOVER_HOST. After
+ * CONFIG_PSS_MQTT_FAILOVER_ATTEMPTS failed connects or dropped sessions in a
+ * row the next broker is used, with the backoff cleared so it is tried at
+ * once. Off the primary, the primary is probed again every
+ * CONFIG_PSS_MQTT_FAILBACK_S; one failed probe returns to the broker in use.
+ */
+
+#include "pss_mqtt_private.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_DECLARE(pss_mqtt, CONFIG_PSS_MQTT_LOG_LEVEL);
+
+// Weight of a new PINGRESP round trip in the smoothed value, in 1/8
+#define RTT_WEIGHT 2
+
+typedef struct {
+  pss_mqtt_broker_t cfg;
+  uint32_t attempts;
+  uint32_t connects;
+  uint32_t drops;
+  uint32_t fail_streak;
+  uint32_t rtt_ms;
+} broker_t;
+
+static broker_t brokers[] = {
+  {.cfg = {CONFIG_PSS_MQTT_HOST, CONFIG_MY_MQTT_HELPER_PORT, 0}},
+#if IS_ENABLED(CONFIG_PSS_MQTT_FAILOVER)
+  {.cfg = {CONFIG_PSS_MQTT_FAILOVER_HOST, CONFIG_PSS_MQTT_FAILOVER_PORT, CONFIG_PSS_MQTT_FAILOVER_SEC_TAG}},
+#endif
+};
+
+static size_t active = 0;
+static size_t fallback = 0;        // Broker to return to when a probe of the primary fails
+static bool probing = false;       // The primary is being tried again
+static int64_t switched_ms = 0;    // Uptime when the active broker changed
+static int session_broker = -1;    // Broker of the last accepted session
+static bool connecting = false;    // An attempt was made and has no result yet
+
+/**
+ * @brief Make a broker the active one, the next attempt is made at once
+ */
+static void broker_switch(size_t index, const char *why)
+{
+  LOG_WRN("Broker %s:%d %s, switching to %s:%d",
+          brokers[active].cfg.host,
+          (int)brokers[active].cfg.port,
+          why,
+          brokers[index].cfg.host,
+          (int)brokers[index].cfg.port);
+
+  active = index;
+  brokers[active].fail_streak = 0;
+  switched_ms = k_uptime_get();
+  pss_mqtt_backoff_reset();
+}
+
+const pss_mqtt_broker_t *pss_mqtt_broker_active(void)
+{
+  return &brokers[active].cfg;
+}
+
+void pss_mqtt_broker_attempt(void)
+{
+  if ((active != 0) && (pss_mqtt_broker_failback_in() == 0))
+  {
+    fallback = active;
+    probing = true;
+    broker_switch(0, "is a fallback, probing the primary");
+  }
+
+  brokers[active].attempts++;
+  connecting = true;
+}
+
+bool pss_mqtt_broker_connected(void)
+{
+  bool changed = (session_broker != (int)active);
+
+  if (probing)
+  {
+    LOG_INF("Primary broker is back");
+    probing = false;
+  }
+
+  connecting = false;
+  brokers[active].connects++;
+  brokers[active].fail_streak = 0;
+  session_broker = (int)active;
+
+  return changed;
+}
+
+void pss_mqtt_broker_failed(void)
+{
+  broker_t *broker = &brokers[active];
+
+  if (!connecting)
+  {
+    broker->drops++;
+  }
+  connecting = false;
+  broker->fail_streak++;
+
+#if IS_ENABLED(CONFIG_PSS_MQTT_FAILOVER)
+  if (probing)
+  {
+    probing = false;
+    broker_switch(fallback, "failed the probe");
+  }
+  else if (broker->fail_streak >= CONFIG_PSS_MQTT_FAILOVER_ATTEMPTS)
+  {
+    broker_switch((active + 1) % ARRAY_SIZE(brokers), "is failing");
+  }
+#endif
+}
+
+void pss_mqtt_broker_rtt(uint32_t rtt_ms)
+{
+  broker_t *broker = &brokers[active];
+
+  if (broker->rtt_ms == 0)
+  {
+    broker->rtt_ms = rtt_ms;
+  }
+  else
+  {
+    broker->rtt_ms = ((broker->rtt_ms * (8 - RTT_WEIGHT)) + (rtt_ms * RTT_WEIGHT)) / 8;
+  }
+}
+
+int32_t pss_mqtt_broker_failback_in(void)
+{
+#if IS_ENABLED(CONFIG_PSS_MQTT_FAILOVER)
+  int64_t left;
+
+  if (active != 0)
+  {
+    left = (switched_ms + ((int64_t)CONFIG_PSS_MQTT_FAILBACK_S * MSEC_PER_SEC)) - k_uptime_get();
+    return (left > 0) ? (int32_t)MIN(left, INT32_MAX) : 0;
+  }
+#endif
+
+  return SYS_FOREVER_MS;
+}
+
+int32_t pss_mqtt_broker_get(size_t index, pss_mqtt_broker_info_t *info)
+{
+  const broker_t *broker;
+
+  if (index >= ARRAY_SIZE(brokers))
+  {
+    return -EINVAL;
+  }
+
+  broker = &brokers[index];
+  info->host = broker->cfg.host;
+  info->port = broker->cfg.port;
+  info->active = (index == active);
+  info->attempts = broker->attempts;
+  info->connects = broker->connects;
+  info->drops = broker->drops;
+  info->fail_streak = broker->fail_streak;
+  info->rtt_ms = broker->rtt_ms;
+
+  return 0;
+}
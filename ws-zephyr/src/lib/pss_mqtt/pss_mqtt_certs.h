@@ -1,15 +1,9 @@
 /**
  * @file Defines certs for provisioning
+ * Used when there are no certs to generate gen/pss_mqtt_certs.h from,
+ * the modem keeps whatever it was provisioned with.
  */
 #ifndef PSS_MQTT_CERTS_H
 #define PSS_MQTT_CERTS_H
 
-static const unsigned char new_client_id[] = "";
-
-static const unsigned char ublox_ca_certificate[] = "";
-
-static const unsigned char ublox_key[] = "";
-
-static const unsigned char root_ca[] = "";
-
 #endif // PSS_MQTT_CERTS_H
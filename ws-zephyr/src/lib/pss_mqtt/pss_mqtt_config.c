@@ -0,0 +1,73 @@
+/**
+ * @brief Runtime configuration over MQTT. The backend keeps the document
+ * retained on <base>/config, so a device picks up the latest one on every
+ * session. The outcome is reported, retained, on <base>/config/applied.
+ */
+
+#include "pss_mqtt_private.h"
+#include "pss_config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_DECLARE(pss_mqtt, CONFIG_PSS_MQTT_LOG_LEVEL);
+
+static char doc_buf[CONFIG_PSS_CONFIG_DOC_MAX];
+
+static void config_report(uint32_t version, int32_t err)
+{
+  char payload[CONFIG_PSS_MQTT_TX_PAYLOAD_MAX];
+  int len;
+
+  len = snprintf(payload, sizeof(payload), "{\"v\":%u,\"err\":%d}", (unsigned int)version, (int)err);
+  if ((len > 0) && (len < (int)sizeof(payload)))
+  {
+    (void)pss_mqtt_publish(PSS_MQTT_TOPIC_CONFIG_APPLIED, PSS_MQTT_PAYLOAD(payload, len));
+  }
+}
+
+/**
+ * @brief Collect the document, it is applied once the last chunk is in
+ */
+static int config_handler(const pss_mqtt_rx_t *rx)
+{
+  uint32_t version;
+  int32_t err;
+
+  if (rx->total == 0)
+  {
+    // The retained document was cleared, keep what is active
+    return 0;
+  }
+
+  if (rx->total > sizeof(doc_buf))
+  {
+    if (rx->offset == 0)
+    {
+      LOG_ERR("Configuration document of %u bytes is too large", (unsigned int)rx->total);
+      config_report(0, -EMSGSIZE);
+    }
+    return -EMSGSIZE;
+  }
+
+  memcpy(&doc_buf[rx->offset], rx->chunk.ptr, rx->chunk.size);
+  if ((rx->offset + rx->chunk.size) < rx->total)
+  {
+    return 0;
+  }
+
+  err = pss_config_apply(doc_buf, rx->total, &version);
+  if (err == -EALREADY)
+  {
+    // Redelivered with every session, already reported
+    return 0;
+  }
+
+  config_report(version, err);
+
+  return 0;
+}
+
+PSS_MQTT_SUBSCRIBE(pss_mqtt_config, "~/config", MQTT_QOS_1_AT_LEAST_ONCE, config_handler);
@@ -0,0 +1,210 @@
+/**
+ * @brief Envelope of outbound messages. Every message gets a per-device
+ * sequence number when it is queued, and is wrapped with it and its capture
+ * time when it is written:
+ * {"s":<seq>,"t":<epoch ms>,"u":<uptime ms>,"v":"<payload>"}
+ * The CBOR telemetry map gets the same fields under keys 24, 25 and 26.
+ * Retransmissions keep their number, so the receiver can tell loss,
+ * duplicates and reordering apart.
+ */
+
+#include "pss_mqtt_private.h"
+#include "pss_nrf_lte.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+
+LOG_MODULE_DECLARE(pss_mqtt, CONFIG_PSS_MQTT_LOG_LEVEL);
+
+// CBOR map keys of the envelope, the schema keys end at 23
+#define ENV_KEY_SEQ    24
+#define ENV_KEY_TIME   25
+#define ENV_KEY_UPTIME 26
+#define CBOR_BREAK     0xFF
+
+/*
+ * Sequence numbers are persisted a block ahead, so a reboot skips the rest
+ * of the block instead of reusing numbers. Uptime restarting marks the gap.
+ */
+static atomic_t seq_next = ATOMIC_INIT(0);
+static uint32_t seq_reserved;
+static atomic_t seq_loaded = ATOMIC_INIT(0); // A save before the load would lower the reserve
+
+static void seq_save_fn(struct k_work *work)
+{
+  uint32_t reserve = (uint32_t)atomic_get(&seq_next) + CONFIG_PSS_MQTT_ENVELOPE_SEQ_BLOCK;
+  int err;
+
+  ARG_UNUSED(work);
+
+  if (!atomic_get(&seq_loaded))
+  {
+    return;
+  }
+
+  err = settings_save_one("pss_mqtt/env/seq", &reserve, sizeof(reserve));
+  if (err)
+  {
+    LOG_WRN("Could not save the sequence reserve, err: %d", err);
+    return;
+  }
+
+  seq_reserved = reserve;
+}
+
+static K_WORK_DEFINE(seq_save_work, seq_save_fn);
+
+static int seq_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+  uint32_t reserve;
+
+  if ((name == NULL) || (strcmp(name, "seq") != 0))
+  {
+    return -ENOENT;
+  }
+
+  // Loading the whole pss_mqtt subtree again must not move the counter back
+  if (atomic_get(&seq_loaded))
+  {
+    return 0;
+  }
+
+  if ((len != sizeof(reserve)) || (read_cb(cb_arg, &reserve, len) != (ssize_t)len))
+  {
+    return 0;
+  }
+
+  // Numbers below the reserve may have been used before the reboot
+  seq_reserved = reserve;
+  (void)atomic_set(&seq_next, (atomic_val_t)reserve);
+
+  return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(pss_mqtt_env, "pss_mqtt/env", NULL, seq_settings_set, NULL, NULL);
+
+void pss_mqtt_env_init(void)
+{
+  if (settings_subsys_init() || settings_load_subtree("pss_mqtt/env"))
+  {
+    LOG_WRN("Sequence reserve unavailable, counting from %u", (unsigned int)atomic_get(&seq_next));
+  }
+
+  (void)atomic_set(&seq_loaded, 1);
+  // Publishes queued before the load renew the reserve now
+  if (((uint32_t)atomic_get(&seq_next) + (CONFIG_PSS_MQTT_ENVELOPE_SEQ_BLOCK / 2)) >= seq_reserved)
+  {
+    (void)k_work_submit(&seq_save_work);
+  }
+}
+
+uint32_t pss_mqtt_env_seq_next(void)
+{
+  uint32_t seq = (uint32_t)atomic_inc(&seq_next);
+
+  // Renewed half a block early, the save runs later in the system workqueue
+  if ((seq + (CONFIG_PSS_MQTT_ENVELOPE_SEQ_BLOCK / 2)) >= seq_reserved)
+  {
+    (void)k_work_submit(&seq_save_work);
+  }
+
+  return seq;
+}
+
+/**
+ * @brief Capture time of a message as Unix time in ms, 0 while the
+ * network time is unknown
+ */
+static int64_t env_capture_time(const pss_mqtt_msg_t *msg)
+{
+  int64_t now = pss_nrf_lte_get_time();
+
+  if (now == 0)
+  {
+    return 0;
+  }
+
+  return now - (int64_t)(k_uptime_get_32() - msg->queued_ms);
+}
+
+/**
+ * @brief Append the envelope keys to the CBOR telemetry map, in front of
+ * its break byte
+ */
+static size_t env_wrap_cbor(const pss_mqtt_msg_t *msg, uint8_t *buf, size_t size, int64_t time_ms)
+{
+  size_t len = msg->len;
+
+  if ((len == 0) || (msg->payload[len - 1] != CBOR_BREAK) || ((len + 24) > size))
+  {
+    return 0;
+  }
+
+  memcpy(buf, msg->payload, len - 1);
+  len--;
+
+  // Keys 24..26 take a one byte argument, the values are uint32 and uint64
+  buf[len++] = 0x18;
+  buf[len++] = ENV_KEY_SEQ;
+  buf[len++] = 0x1A;
+  sys_put_be32(msg->seq, &buf[len]);
+  len += 4;
+  buf[len++] = 0x18;
+  buf[len++] = ENV_KEY_TIME;
+  buf[len++] = 0x1B;
+  sys_put_be64((uint64_t)time_ms, &buf[len]);
+  len += 8;
+  buf[len++] = 0x18;
+  buf[len++] = ENV_KEY_UPTIME;
+  buf[len++] = 0x1A;
+  sys_put_be32(msg->queued_ms, &buf[len]);
+  len += 4;
+  buf[len++] = CBOR_BREAK;
+
+  return len;
+}
+
+size_t pss_mqtt_env_wrap(const pss_mqtt_msg_t *msg, uint8_t *buf, size_t size)
+{
+  int64_t time_ms = env_capture_time(msg);
+  int len;
+
+  if (msg->topic == PSS_MQTT_TOPIC_TELEMETRY)
+  {
+    return env_wrap_cbor(msg, buf, size, time_ms);
+  }
+
+  len = snprintf((char *)buf, size, "{\"s\":%u,\"t\":%lld,\"u\":%u,\"v\":\"",
+                 (unsigned int)msg->seq,
+                 (long long)time_ms,
+                 (unsigned int)msg->queued_ms);
+  if ((len < 0) || ((size_t)len >= size))
+  {
+    return 0;
+  }
+
+  for (size_t i = 0; i < msg->len; i++)
+  {
+    // Room for an escape, the character and the closing "}
+    if (((size_t)len + 4) > size)
+    {
+      return 0;
+    }
+
+    if ((msg->payload[i] == '"') || (msg->payload[i] == '\\'))
+    {
+      buf[len++] = '\\';
+    }
+    buf[len++] = msg->payload[i];
+  }
+
+  buf[len++] = '"';
+  buf[len++] = '}';
+
+  return (size_t)len;
+}
@@ -0,0 +1,290 @@
+/**
+ * @brief QoS 1 in-flight window. Tracks every publish until its PUBACK,
+ * retransmits overdue ones and measures the round trip.
+ */
+
+#include "pss_mqtt_private.h"
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_DECLARE(pss_mqtt, CONFIG_PSS_MQTT_LOG_LEVEL);
+
+/**
+ * @brief An outstanding QoS 1 publish
+ */
+typedef struct {
+  bool used;
+  bool sent;        // false until written on the current session
+  bool dup;         // Set once the message may have reached the broker
+  uint8_t retries;
+  uint16_t id;
+  uint32_t sent_ms; // Time of the last transmission
+  pss_mqtt_msg_t msg;
+} inflight_t;
+
+static inflight_t inflight[CONFIG_PSS_MQTT_INFLIGHT_MAX];
+static uint16_t last_id = 0;
+static pss_mqtt_hist_t puback_hist;
+static K_MUTEX_DEFINE(inflight_lock);
+
+// Upper bound of each histogram bin, the last bin takes everything above
+static const uint32_t hist_bounds_ms[PSS_MQTT_HIST_BINS - 1] = {
+  100, 250, 500, 1000, 2000, 5000, 10000
+};
+
+void pss_mqtt_hist_add(pss_mqtt_hist_t *hist, uint32_t ms)
+{
+  size_t bin = 0;
+
+  while ((bin < ARRAY_SIZE(hist_bounds_ms)) && (ms > hist_bounds_ms[bin]))
+  {
+    bin++;
+  }
+
+  hist->bins[bin]++;
+  hist->count++;
+  hist->sum_ms += ms;
+  if (ms > hist->max_ms)
+  {
+    hist->max_ms = ms;
+  }
+}
+
+static bool id_in_flight(uint16_t id)
+{
+  for (size_t i = 0; i < ARRAY_SIZE(inflight); i++)
+  {
+    if (inflight[i].used && (inflight[i].id == id))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+uint16_t pss_mqtt_msg_id_next(void)
+{
+  k_mutex_lock(&inflight_lock, K_FOREVER);
+
+  // The window is far smaller than the id space, this always terminates
+  do
+  {
+    last_id++;
+  } while ((last_id == 0) || id_in_flight(last_id));
+
+  uint16_t id = last_id;
+
+  k_mutex_unlock(&inflight_lock);
+
+  return id;
+}
+
+/**
+ * @brief Write an entry to the socket and update its send state
+ */
+static void inflight_transmit(inflight_t *entry, bool dup)
+{
+  int32_t err;
+
+  err = pss_mqtt_send(&entry->msg, entry->id, dup);
+
+  k_mutex_lock(&inflight_lock, K_FOREVER);
+  if (entry->used)
+  {
+    entry->sent = (err == 0);
+    // Only a publish that was written may have reached the broker
+    entry->dup = entry->dup || (err == 0);
+    entry->sent_ms = k_uptime_get_32();
+    if (IS_ENABLED(CONFIG_PSS_MQTT_ALARM_LATENCY) && (err == 0))
+    {
+      pss_mqtt_alarm_written(&entry->msg);
+    }
+  }
+  k_mutex_unlock(&inflight_lock);
+}
+
+int32_t pss_mqtt_inflight_send(const pss_mqtt_msg_t *msg)
+{
+  inflight_t *entry = NULL;
+  uint16_t id = pss_mqtt_msg_id_next();
+
+  k_mutex_lock(&inflight_lock, K_FOREVER);
+  for (size_t i = 0; i < ARRAY_SIZE(inflight); i++)
+  {
+    if (!inflight[i].used)
+    {
+      entry = &inflight[i];
+      entry->used = true;
+      entry->sent = false;
+      entry->dup = false;
+      entry->retries = 0;
+      entry->id = id;
+      entry->msg = *msg;
+      break;
+    }
+  }
+  k_mutex_unlock(&inflight_lock);
+
+  if (entry == NULL)
+  {
+    return -ENOBUFS;
+  }
+
+  inflight_transmit(entry, false);
+
+  return 0;
+}
+
+void pss_mqtt_inflight_ack(uint16_t message_id, int result)
+{
+  pss_mqtt_msg_t msg;
+  bool found = false;
+  bool delivered = (result == 0);
+  uint32_t rtt_ms = 0;
+
+  k_mutex_lock(&inflight_lock, K_FOREVER);
+  for (size_t i = 0; i < ARRAY_SIZE(inflight); i++)
+  {
+    if (inflight[i].used && (inflight[i].id == message_id))
+    {
+      rtt_ms = k_uptime_get_32() - inflight[i].sent_ms;
+      inflight[i].used = false;
+      msg = inflight[i].msg;
+      pss_mqtt_hist_add(&puback_hist, rtt_ms);
+      found = true;
+      break;
+    }
+  }
+  k_mutex_unlock(&inflight_lock);
+
+  if (found)
+  {
+    LOG_DBG("PUBACK id %d result %d after %d ms", message_id, result, (int)rtt_ms);
+    if (!delivered)
+    {
+      LOG_ERR("PUBACK for topic %d failed, err: %d, dropped", (int)msg.topic, result);
+    }
+    pss_mqtt_shadow_done(&msg, delivered);
+    if (IS_ENABLED(CONFIG_PSS_MQTT_ALARM_LATENCY) && delivered)
+    {
+      pss_mqtt_alarm_acked(&msg);
+    }
+    // A slot is free, let the writer continue
+    pss_mqtt_tx_kick();
+  }
+  else
+  {
+    LOG_WRN("PUBACK for unknown id %d", message_id);
+  }
+}
+
+void pss_mqtt_inflight_retransmit(void)
+{
+  uint32_t now = k_uptime_get_32();
+
+  for (size_t i = 0; i < ARRAY_SIZE(inflight); i++)
+  {
+    inflight_t *entry = &inflight[i];
+    bool resend = false;
+    bool dup = false;
+
+    k_mutex_lock(&inflight_lock, K_FOREVER);
+    if (entry->used && !entry->sent)
+    {
+      // Not written on the current session yet
+      resend = true;
+      dup = entry->dup;
+    }
+    else if (entry->used && ((now - entry->sent_ms) >= CONFIG_PSS_MQTT_INFLIGHT_RETRY_MS))
+    {
+      if (entry->retries >= CONFIG_PSS_MQTT_INFLIGHT_MAX_RETRIES)
+      {
+        LOG_ERR("No PUBACK for id %d after %d retries, dropping", entry->id, entry->retries);
+        entry->used = false;
+        pss_mqtt_shadow_done(&entry->msg, false);
+      }
+      else if (pss_mqtt_msg_expiry_left(&entry->msg) == 0)
+      {
+        LOG_WRN("Id %d expired before its PUBACK, dropping", entry->id);
+        entry->used = false;
+        pss_mqtt_shadow_done(&entry->msg, false);
+      }
+      else
+      {
+        entry->retries++;
+        resend = true;
+        // A duplicate only once an earlier copy was written
+        dup = entry->dup;
+      }
+    }
+    k_mutex_unlock(&inflight_lock);
+
+    if (resend)
+    {
+      LOG_DBG("Retransmitting id %d, dup %d", entry->id, dup);
+      inflight_transmit(entry, dup);
+    }
+  }
+}
+
+void pss_mqtt_inflight_requeue(void)
+{
+  k_mutex_lock(&inflight_lock, K_FOREVER);
+  for (size_t i = 0; i < ARRAY_SIZE(inflight); i++)
+  {
+    if (inflight[i].used)
+    {
+      // Resent, with DUP if it was written before, once the session is up
+      inflight[i].sent = false;
+    }
+  }
+  k_mutex_unlock(&inflight_lock);
+}
+
+int32_t pss_mqtt_inflight_timeout(void)
+{
+  uint32_t now = k_uptime_get_32();
+  int32_t next = -1;
+
+  k_mutex_lock(&inflight_lock, K_FOREVER);
+  for (size_t i = 0; i < ARRAY_SIZE(inflight); i++)
+  {
+    if (inflight[i].used)
+    {
+      int32_t left = CONFIG_PSS_MQTT_INFLIGHT_RETRY_MS - (int32_t)(now - inflight[i].sent_ms);
+
+      left = MAX(left, 0);
+      if ((next < 0) || (left < next))
+      {
+        next = left;
+      }
+    }
+  }
+  k_mutex_unlock(&inflight_lock);
+
+  return (next < 0) ? SYS_FOREVER_MS : next;
+}
+
+void pss_mqtt_puback_latency_get(pss_mqtt_hist_t *hist)
+{
+  k_mutex_lock(&inflight_lock, K_FOREVER);
+  *hist = puback_hist;
+  k_mutex_unlock(&inflight_lock);
+}
+
+uint32_t pss_mqtt_inflight_count(void)
+{
+  uint32_t count = 0;
+
+  k_mutex_lock(&inflight_lock, K_FOREVER);
+  for (size_t i = 0; i < ARRAY_SIZE(inflight); i++)
+  {
+    count += inflight[i].used ? 1 : 0;
+  }
+  k_mutex_unlock(&inflight_lock);
+
+  return count;
+}
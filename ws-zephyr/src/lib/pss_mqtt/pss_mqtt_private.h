@@ -0,0 +1,385 @@
+/**
+ * @file
+ * @brief Internals shared between the pss_mqtt source files
+ */
+#ifndef PSS_MQTT_PRIVATE_H
+#define PSS_MQTT_PRIVATE_H
+
+#include "pss_mqtt.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zephyr/kernel.h>
+
+/** Size of a PUBACK: fixed header and packet id */
+#define PSS_MQTT_PUBACK_BYTES 4
+
+/**
+ * @brief Priority lanes of the outbound queue, drained in this order
+ */
+typedef enum {
+    PSS_MQTT_LANE_ALARM,
+    PSS_MQTT_LANE_STATE,
+    PSS_MQTT_LANE_TELEMETRY,
+    PSS_MQTT_LANE_COUNT
+} pss_mqtt_lane_t;
+
+/**
+ * @brief A queued publish, the payload is copied in so callers never wait
+ */
+typedef struct {
+    uint32_t queued_ms; // Uptime when the message was queued
+    uint32_t seq;       // Envelope sequence number, kept by retransmissions
+    uint32_t edge_cyc;  // Cycles at the GPIO edge of an alarm, 0 if not measured
+    uint32_t stage_cyc; // Cycles when the alarm entered its current stage
+    uint8_t topic;
+    uint8_t len;
+    uint8_t stage;      // pss_mqtt_alarm_stage_t a measured alarm is in
+    uint8_t payload[CONFIG_PSS_MQTT_TX_PAYLOAD_MAX];
+} pss_mqtt_msg_t;
+
+/**
+ * @brief Returns the queue lane a topic is published through
+ */
+pss_mqtt_lane_t pss_mqtt_topic_lane(pss_mqtt_topic_t topic);
+
+/**
+ * @brief Returns the QoS a topic is published with
+ */
+uint8_t pss_mqtt_topic_qos(pss_mqtt_topic_t topic);
+
+/**
+ * @brief Returns true if a topic is published retained
+ */
+bool pss_mqtt_topic_retain(pss_mqtt_topic_t topic);
+
+/**
+ * @brief Returns true if a topic is sent wrapped in an envelope and takes
+ * a sequence number
+ */
+bool pss_mqtt_topic_enveloped(pss_mqtt_topic_t topic);
+
+/**
+ * @brief Time a message stays worth sending
+ *
+ * @return Seconds left, 0 if it expired, SYS_FOREVER_MS if it never expires
+ */
+int32_t pss_mqtt_msg_expiry_left(const pss_mqtt_msg_t* msg);
+
+/**
+ * @brief Put a message in its lane and wake the writer, bypassing the shadow
+ *
+ * @retval 0 The message was queued
+ * @retval -ENOBUFS The lane is full, the message was dropped
+ */
+int32_t pss_mqtt_tx_enqueue(const pss_mqtt_msg_t* msg);
+
+/**
+ * @brief Record the value of a retained topic about to be published
+ *
+ * @retval true The value changed, publish it
+ * @retval false The broker holds or will hold this value, skip it
+ */
+bool pss_mqtt_shadow_update(const pss_mqtt_msg_t* msg);
+
+/**
+ * @brief Count a message of a topic entering (true) or failing to enter
+ * (false) the queue
+ */
+void pss_mqtt_shadow_queued(pss_mqtt_topic_t topic, bool queued);
+
+/**
+ * @brief A message left the queue and the in-flight window
+ *
+ * @param msg The message
+ * @param delivered true if the broker acknowledged it, false if it was dropped
+ */
+void pss_mqtt_shadow_done(const pss_mqtt_msg_t* msg, bool delivered);
+
+/**
+ * @brief Forget the value of a topic, the next publish is always sent.
+ * For values the broker may have replaced, like the last will.
+ */
+void pss_mqtt_shadow_forget(pss_mqtt_topic_t topic);
+
+/**
+ * @brief Queue the retained values the broker has not acknowledged and
+ * that are not queued or in flight anymore
+ */
+void pss_mqtt_shadow_resync(void);
+
+/**
+ * @brief Take the next envelope sequence number. Can be called from ISRs.
+ */
+uint32_t pss_mqtt_env_seq_next(void);
+
+/**
+ * @brief Wrap a message in its envelope, see pss_mqtt_envelope.c
+ *
+ * @param msg The message
+ * @param buf Destination
+ * @param size Size of buf
+ * @return Length of the wrapped message, 0 if it does not fit
+ */
+size_t pss_mqtt_env_wrap(const pss_mqtt_msg_t* msg, uint8_t* buf, size_t size);
+
+/**
+ * @brief Give a publish on the alarm lane the pending GPIO edge, if any.
+ * Called for every publish the shadow lets through, so an edge never sticks
+ * to a later alarm.
+ */
+void pss_mqtt_alarm_take(pss_mqtt_msg_t* msg);
+
+/**
+ * @brief An alarm is about to enter its lane, its write stage starts. The
+ * writer may take it before the enqueue returns.
+ */
+void pss_mqtt_alarm_stamp(pss_mqtt_msg_t* msg);
+
+/**
+ * @brief The lane accepted an alarm, records its queue stage
+ */
+void pss_mqtt_alarm_queued(const pss_mqtt_msg_t* msg);
+
+/**
+ * @brief An alarm was written to the socket, only the first write counts
+ */
+void pss_mqtt_alarm_written(pss_mqtt_msg_t* msg);
+
+/**
+ * @brief The PUBACK of an alarm arrived, publishes the updated statistics
+ */
+void pss_mqtt_alarm_acked(const pss_mqtt_msg_t* msg);
+
+/**
+ * @brief Load this month's data usage and start reconciling it with the
+ * modem counters
+ */
+void pss_mqtt_usage_init(void);
+
+/**
+ * @brief Charge a publish written to the socket to its topic
+ *
+ * @param topic The topic
+ * @param bytes Size of the PUBLISH packet
+ * @param acked true if a PUBACK comes back for it
+ */
+void pss_mqtt_usage_sent(pss_mqtt_topic_t topic, uint32_t bytes, bool acked);
+
+/**
+ * @brief Charge a Home Assistant discovery config written to the socket,
+ * they are QoS 1 and published outside the topic table
+ *
+ * @param bytes Size of the PUBLISH packet
+ */
+void pss_mqtt_usage_discovery_sent(uint32_t bytes);
+
+/**
+ * @brief Returns false if the data budget holds back a publish on this
+ * topic. Only telemetry is ever held back. Can be called from ISRs.
+ */
+bool pss_mqtt_usage_allow(pss_mqtt_topic_t topic);
+
+/**
+ * @brief Write a publish to the socket. Only called from the service thread.
+ *
+ * @param msg The message to send
+ * @param message_id Packet id, 0 for QoS 0
+ * @param dup true if this is a retransmission
+ * @return 0 on success, negative error otherwise
+ */
+int32_t pss_mqtt_send(const pss_mqtt_msg_t* msg, uint16_t message_id, bool dup);
+
+/**
+ * @brief Allocate a packet id that is not 0 and not in flight
+ */
+uint16_t pss_mqtt_msg_id_next(void);
+
+/**
+ * @brief Move a QoS 1 message into the in-flight window and send it
+ *
+ * @retval 0 The message is owned by the window, sent or waiting for retry
+ * @retval -ENOBUFS The window is full, keep the message queued
+ */
+int32_t pss_mqtt_inflight_send(const pss_mqtt_msg_t* msg);
+
+/**
+ * @brief Release the in-flight entry matching a PUBACK
+ */
+void pss_mqtt_inflight_ack(uint16_t message_id, int result);
+
+/**
+ * @brief Retransmit entries whose PUBACK is overdue, with the DUP flag
+ */
+void pss_mqtt_inflight_retransmit(void);
+
+/**
+ * @brief Mark every in-flight entry for resend on the new session
+ */
+void pss_mqtt_inflight_requeue(void);
+
+/**
+ * @brief Time until the next retransmission is due
+ *
+ * @return Milliseconds, SYS_FOREVER_MS when nothing is in flight
+ */
+int32_t pss_mqtt_inflight_timeout(void);
+
+/**
+ * @brief Add a sample to a latency histogram
+ */
+void pss_mqtt_hist_add(pss_mqtt_hist_t* hist, uint32_t ms);
+
+/**
+ * @brief Work done once per broker session, run by the writer before it
+ * drains the queue.
+ */
+void pss_mqtt_session_start(void);
+
+/**
+ * @brief Schedule pss_mqtt_session_start() and wake the writer
+ */
+void pss_mqtt_tx_session_start(void);
+
+/**
+ * @brief Wake the writer so it drains the queue
+ */
+void pss_mqtt_tx_kick(void);
+
+/**
+ * @brief The writer. Sends the queue and retransmits, called from the MQTT
+ * service thread through its on_service callback.
+ *
+ * @return Milliseconds until it needs to run again, SYS_FOREVER_MS to wait
+ * for a kick
+ */
+int32_t pss_mqtt_tx_service(void);
+
+/**
+ * @brief Build the subscription list and the routing trie from the
+ * PSS_MQTT_SUBSCRIBE() registrations
+ *
+ * @param base Device topic base that replaces "~", must stay valid
+ */
+int32_t pss_mqtt_sub_init(const char *base);
+
+/**
+ * @brief Fill a subscription list with every registered filter
+ *
+ * @return Number of filters
+ */
+size_t pss_mqtt_sub_list(struct mqtt_subscription_list *list, uint16_t message_id);
+
+/**
+ * @brief Route a chunk of an inbound message to the matching handlers.
+ * The match is made with the first chunk and kept for the rest.
+ *
+ * @return 0 while a handler takes the message, negative otherwise
+ */
+int pss_mqtt_sub_dispatch(const pss_mqtt_rx_t *rx);
+
+/**
+ * @brief Count a publish written by pss_mqtt_send() or a discovery config
+ * in the current burst
+ *
+ * @param bytes Size of the PUBLISH packet
+ */
+void pss_mqtt_tx_burst_sent(uint32_t bytes);
+
+/**
+ * @brief Count a PUBACK, closes the burst once nothing is left
+ */
+void pss_mqtt_tx_burst_acked(void);
+
+/**
+ * @brief Returns true when nothing is queued, in flight or left to do for
+ * the session
+ */
+bool pss_mqtt_tx_idle(void);
+
+/**
+ * @brief Release the radio once the last PUBACK of a burst is in, unless
+ * the last send already carried the hint
+ */
+void pss_mqtt_tx_rai_release(void);
+
+/**
+ * @brief Returns true while the session start still waits for the broker:
+ * the SUBACK, which the retained messages of the filters follow, or a
+ * PUBACK of the discovery configs
+ */
+bool pss_mqtt_session_pending(void);
+
+/**
+ * @brief A broker of the failover list
+ */
+typedef struct {
+    const char* host;
+    uint16_t port;
+    int sec_tag;        // 0 for the default tags, MQTT_HELPER_SEC_TAG_NONE for plain TCP
+} pss_mqtt_broker_t;
+
+/**
+ * @brief Returns the broker the next connect goes to
+ */
+const pss_mqtt_broker_t* pss_mqtt_broker_active(void);
+
+/**
+ * @brief A connect is attempted. Switches to the primary first when a
+ * fail-back probe is due.
+ */
+void pss_mqtt_broker_attempt(void);
+
+/**
+ * @brief The broker accepted the session
+ *
+ * @retval true The broker differs from the one of the previous session
+ */
+bool pss_mqtt_broker_connected(void);
+
+/**
+ * @brief A connect failed or the session dropped, may switch the broker
+ * and clear the backoff
+ */
+void pss_mqtt_broker_failed(void);
+
+/**
+ * @brief Record a PINGRESP round trip of the active broker
+ */
+void pss_mqtt_broker_rtt(uint32_t rtt_ms);
+
+/**
+ * @brief Time until the primary is probed again
+ *
+ * @return Milliseconds, 0 if due, SYS_FOREVER_MS on the primary
+ */
+int32_t pss_mqtt_broker_failback_in(void);
+
+/**
+ * @brief Mark every known retained value for resend, the broker may not hold them
+ */
+void pss_mqtt_shadow_dirty_all(void);
+
+/**
+ * @brief A session was closed on purpose, clear the backoff
+ */
+void pss_mqtt_backoff_reset(void);
+
+/**
+ * @brief A session was accepted by the broker
+ */
+void pss_mqtt_backoff_connected(void);
+
+/**
+ * @brief A connect attempt failed or the session ended, schedule the next
+ * attempt. A session that lasted long enough resets the backoff first.
+ */
+void pss_mqtt_backoff_failed(void);
+
+/**
+ * @brief Returns true when LTE is up and the backoff delay has passed
+ */
+bool pss_mqtt_backoff_due(void);
+
+#endif // PSS_MQTT_PRIVATE_H
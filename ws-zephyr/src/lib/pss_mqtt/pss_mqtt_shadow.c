@@ -0,0 +1,172 @@
+/**
+ * @brief Shadow of the retained device topics. Keeps the last value
+ * published on each one, so repeating it costs nothing, and whether the
+ * broker acknowledged it, so a new session only resends what it may lack.
+ * Unchanged values are still refreshed now and then, Home Assistant expires
+ * entities that stay quiet.
+ */
+
+#include "pss_mqtt_private.h"
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_DECLARE(pss_mqtt, CONFIG_PSS_MQTT_LOG_LEVEL);
+
+/**
+ * @brief The state of a retained topic
+ */
+typedef struct {
+  bool valid;      // value holds the last published value
+  bool dirty;      // The broker has not acknowledged value yet
+  uint8_t pending; // Messages of the topic queued or in flight
+  uint32_t sent_s; // Uptime when value was last published
+  uint8_t len;
+  uint8_t value[CONFIG_PSS_MQTT_TX_PAYLOAD_MAX];
+} shadow_t;
+
+static shadow_t shadow[PSS_MQTT_TOPIC_COUNT];
+static struct k_spinlock shadow_lock;
+
+static bool shadow_used(pss_mqtt_topic_t topic)
+{
+  return IS_ENABLED(CONFIG_PSS_MQTT_SHADOW) && pss_mqtt_topic_retain(topic);
+}
+
+static bool shadow_equal(const shadow_t *entry, const pss_mqtt_msg_t *msg)
+{
+  return entry->valid && (entry->len == msg->len) && (0 == memcmp(entry->value, msg->payload, msg->len));
+}
+
+bool pss_mqtt_shadow_update(const pss_mqtt_msg_t *msg)
+{
+  shadow_t *entry = &shadow[msg->topic];
+  uint32_t now_s = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+  k_spinlock_key_t key;
+
+  if (!shadow_used((pss_mqtt_topic_t)msg->topic))
+  {
+    return true;
+  }
+
+  key = k_spin_lock(&shadow_lock);
+  // Dirty with nothing pending means the last copy was dropped, send it again
+  if (shadow_equal(entry, msg) && ((now_s - entry->sent_s) < CONFIG_PSS_MQTT_SHADOW_REFRESH_S)
+      && (!entry->dirty || (entry->pending > 0)))
+  {
+    // Already held by the broker or on its way there
+    k_spin_unlock(&shadow_lock, key);
+    return false;
+  }
+
+  entry->valid = true;
+  entry->dirty = true;
+  entry->sent_s = now_s;
+  entry->len = msg->len;
+  memcpy(entry->value, msg->payload, msg->len);
+  k_spin_unlock(&shadow_lock, key);
+
+  return true;
+}
+
+void pss_mqtt_shadow_queued(pss_mqtt_topic_t topic, bool queued)
+{
+  k_spinlock_key_t key;
+
+  if (!shadow_used(topic))
+  {
+    return;
+  }
+
+  key = k_spin_lock(&shadow_lock);
+  if (queued)
+  {
+    shadow[topic].pending++;
+  }
+  else if (shadow[topic].pending > 0)
+  {
+    shadow[topic].pending--;
+  }
+  k_spin_unlock(&shadow_lock, key);
+}
+
+void pss_mqtt_shadow_done(const pss_mqtt_msg_t *msg, bool delivered)
+{
+  shadow_t *entry = &shadow[msg->topic];
+  k_spinlock_key_t key;
+
+  if (!shadow_used((pss_mqtt_topic_t)msg->topic))
+  {
+    return;
+  }
+
+  key = k_spin_lock(&shadow_lock);
+  if (entry->pending > 0)
+  {
+    entry->pending--;
+  }
+
+  // An older value may still be in flight, only the latest one counts
+  if (delivered && shadow_equal(entry, msg))
+  {
+    entry->dirty = false;
+  }
+  k_spin_unlock(&shadow_lock, key);
+}
+
+void pss_mqtt_shadow_forget(pss_mqtt_topic_t topic)
+{
+  k_spinlock_key_t key = k_spin_lock(&shadow_lock);
+
+  shadow[topic].valid = false;
+  k_spin_unlock(&shadow_lock, key);
+}
+
+void pss_mqtt_shadow_dirty_all(void)
+{
+  k_spinlock_key_t key = k_spin_lock(&shadow_lock);
+
+  for (size_t topic = 0; topic < PSS_MQTT_TOPIC_COUNT; topic++)
+  {
+    shadow[topic].dirty = shadow[topic].valid;
+  }
+  k_spin_unlock(&shadow_lock, key);
+}
+
+void pss_mqtt_shadow_resync(void)
+{
+  pss_mqtt_msg_t msg = {0};
+  k_spinlock_key_t key;
+  size_t resent = 0;
+  bool resend;
+
+  if (!IS_ENABLED(CONFIG_PSS_MQTT_SHADOW))
+  {
+    return;
+  }
+
+  for (size_t topic = 0; topic < PSS_MQTT_TOPIC_COUNT; topic++)
+  {
+    key = k_spin_lock(&shadow_lock);
+    // Values still queued or in flight are resent by their own message
+    resend = shadow[topic].valid && shadow[topic].dirty && (shadow[topic].pending == 0);
+    if (resend)
+    {
+      msg.topic = (uint8_t)topic;
+      msg.len = shadow[topic].len;
+      memcpy(msg.payload, shadow[topic].value, msg.len);
+    }
+    k_spin_unlock(&shadow_lock, key);
+
+    if (resend && (0 == pss_mqtt_tx_enqueue(&msg)))
+    {
+      resent++;
+    }
+  }
+
+  if (resent > 0)
+  {
+    LOG_INF("Resending %d retained values the broker may lack", (int)resent);
+  }
+}
@@ -0,0 +1,345 @@
+/**
+ * @brief Inbound routing. Modules register topic filters with
+ * PSS_MQTT_SUBSCRIBE() and the filters are compiled into a trie over topic
+ * levels once the device topic base is known, so a message is routed in one
+ * walk down its levels instead of matching every filter.
+ */
+
+#include "pss_mqtt.h"
+#include "pss_mqtt_private.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_DECLARE(pss_mqtt, CONFIG_PSS_MQTT_LOG_LEVEL);
+
+BUILD_ASSERT(CONFIG_PSS_MQTT_SUB_MAX <= 32, "Matches are kept in a 32 bit mask");
+
+#define NODE_ROOT 0
+#define NODE_NONE 0 // The root is never a child
+
+/**
+ * @brief One topic level. Literal children form a sibling list, the '+'
+ * child has its own link so it is tried next to the literal match.
+ */
+typedef struct {
+  const char *level;
+  uint16_t len;
+  uint32_t hash;
+  uint8_t child;   // First literal child
+  uint8_t sibling; // Next literal child of the parent
+  uint8_t plus;    // '+' child
+  uint32_t subs;   // Filters ending at this level
+  uint32_t multi;  // Filters ending in '#' right below this level
+} sub_node_t;
+
+static sub_node_t nodes[CONFIG_PSS_MQTT_SUB_TRIE_NODES];
+static size_t node_count = 1;
+static const struct pss_mqtt_sub *subs[CONFIG_PSS_MQTT_SUB_MAX];
+static size_t sub_count = 0;
+static char filter_buf[CONFIG_PSS_MQTT_SUB_MAX][CONFIG_PSS_MQTT_SUB_TOPIC_LEN];
+static struct mqtt_topic sub_topics[CONFIG_PSS_MQTT_SUB_MAX];
+static uint32_t rx_matches; // Handlers still taking the message being streamed
+
+/**
+ * @brief FNV-1a of a topic level, compared before the level itself
+ */
+static uint32_t level_hash(const char *level, size_t len)
+{
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= (uint8_t)level[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static int32_t node_new(const char *level, size_t len)
+{
+  sub_node_t *node;
+
+  if (node_count >= ARRAY_SIZE(nodes))
+  {
+    return -ENOMEM;
+  }
+
+  node = &nodes[node_count];
+  memset(node, 0, sizeof(*node));
+  node->level = level;
+  node->len = (uint16_t)len;
+  node->hash = level_hash(level, len);
+
+  return (int32_t)node_count++;
+}
+
+/**
+ * @brief Child of a node for one filter level, created if missing
+ */
+static int32_t node_child(size_t parent, const char *level, size_t len)
+{
+  uint32_t hash;
+  int32_t idx;
+
+  if ((len == 1) && (level[0] == '+'))
+  {
+    if (nodes[parent].plus == NODE_NONE)
+    {
+      idx = node_new(level, len);
+      if (idx < 0)
+      {
+        return idx;
+      }
+      nodes[parent].plus = (uint8_t)idx;
+    }
+    return nodes[parent].plus;
+  }
+
+  hash = level_hash(level, len);
+  for (uint8_t i = nodes[parent].child; i != NODE_NONE; i = nodes[i].sibling)
+  {
+    if ((nodes[i].hash == hash) && (nodes[i].len == len) && (0 == memcmp(nodes[i].level, level, len)))
+    {
+      return i;
+    }
+  }
+
+  idx = node_new(level, len);
+  if (idx < 0)
+  {
+    return idx;
+  }
+
+  nodes[idx].sibling = nodes[parent].child;
+  nodes[parent].child = (uint8_t)idx;
+
+  return idx;
+}
+
+/**
+ * @brief Add a filter, its levels point into the filter buffer
+ */
+static int32_t trie_insert(const char *filter, size_t len, size_t bit)
+{
+  size_t node = NODE_ROOT;
+  size_t start = 0;
+
+  while (true)
+  {
+    const char *slash = memchr(&filter[start], '/', len - start);
+    size_t end = (slash != NULL) ? (size_t)(slash - filter) : len;
+    const char *level = &filter[start];
+    size_t level_len = end - start;
+    int32_t child;
+
+    if ((level_len == 1) && (level[0] == '#'))
+    {
+      if (end != len)
+      {
+        // '#' must be the last level
+        return -EINVAL;
+      }
+      nodes[node].multi |= BIT(bit);
+      return 0;
+    }
+
+    if ((memchr(level, '#', level_len) != NULL) ||
+        ((memchr(level, '+', level_len) != NULL) && (level_len != 1)))
+    {
+      // Wildcards must take a whole level
+      return -EINVAL;
+    }
+
+    child = node_child(node, level, level_len);
+    if (child < 0)
+    {
+      return child;
+    }
+    node = (size_t)child;
+
+    if (end == len)
+    {
+      break;
+    }
+    start = end + 1;
+  }
+
+  nodes[node].subs |= BIT(bit);
+
+  return 0;
+}
+
+/**
+ * @brief Remove the nodes a failed insert created, they point into a filter
+ * buffer the next filter reuses. An insert walks one path, so it adds at
+ * most one node below each existing node, always at the head of its list.
+ *
+ * @param mark Node count before the insert
+ */
+static void trie_rollback(size_t mark)
+{
+  for (size_t i = 0; i < mark; i++)
+  {
+    if (nodes[i].child >= mark)
+    {
+      nodes[i].child = nodes[nodes[i].child].sibling;
+    }
+    if (nodes[i].plus >= mark)
+    {
+      nodes[i].plus = NODE_NONE;
+    }
+  }
+
+  node_count = mark;
+}
+
+/**
+ * @brief Filters matching the levels of a topic from start on, below a node
+ *
+ * @param wild false for the first level of a '$' topic, wildcards must not match it
+ */
+static uint32_t trie_match(size_t node, const char *topic, size_t len, size_t start, bool wild)
+{
+  const char *slash = memchr(&topic[start], '/', len - start);
+  size_t end = (slash != NULL) ? (size_t)(slash - topic) : len;
+  size_t level_len = end - start;
+  uint32_t hash = level_hash(&topic[start], level_len);
+  uint32_t matches = wild ? nodes[node].multi : 0;
+  uint8_t next[2] = {NODE_NONE, wild ? nodes[node].plus : NODE_NONE};
+
+  for (uint8_t i = nodes[node].child; i != NODE_NONE; i = nodes[i].sibling)
+  {
+    if ((nodes[i].hash == hash) && (nodes[i].len == level_len) &&
+        (0 == memcmp(nodes[i].level, &topic[start], level_len)))
+    {
+      next[0] = i;
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < ARRAY_SIZE(next); i++)
+  {
+    if (next[i] == NODE_NONE)
+    {
+      continue;
+    }
+
+    if (end == len)
+    {
+      // "a/#" also matches "a"
+      matches |= nodes[next[i]].subs | nodes[next[i]].multi;
+    }
+    else
+    {
+      matches |= trie_match(next[i], topic, len, end + 1, true);
+    }
+  }
+
+  return matches;
+}
+
+int32_t pss_mqtt_sub_init(const char *base)
+{
+  node_count = 1;
+  sub_count = 0;
+  memset(&nodes[NODE_ROOT], 0, sizeof(nodes[NODE_ROOT]));
+
+  STRUCT_SECTION_FOREACH(pss_mqtt_sub, sub)
+  {
+    char *buf;
+    int32_t err;
+    size_t mark = node_count;
+    int len;
+
+    if (sub_count >= ARRAY_SIZE(subs))
+    {
+      LOG_ERR("More than %d subscriptions, %s ignored", CONFIG_PSS_MQTT_SUB_MAX, sub->filter);
+      return -ENOMEM;
+    }
+
+    buf = filter_buf[sub_count];
+
+    if (0 == strncmp(sub->filter, "~/", 2))
+    {
+      len = snprintf(buf, CONFIG_PSS_MQTT_SUB_TOPIC_LEN, "%s/%s", base, &sub->filter[2]);
+    }
+    else
+    {
+      len = snprintf(buf, CONFIG_PSS_MQTT_SUB_TOPIC_LEN, "%s", sub->filter);
+    }
+
+    if ((len <= 0) || (len >= CONFIG_PSS_MQTT_SUB_TOPIC_LEN))
+    {
+      LOG_ERR("Subscription %s is too long", sub->filter);
+      continue;
+    }
+
+    err = trie_insert(buf, (size_t)len, sub_count);
+    if (err)
+    {
+      LOG_ERR("Subscription %s not added, err: %d", buf, err);
+      trie_rollback(mark);
+      continue;
+    }
+
+    sub_topics[sub_count].topic.utf8 = (uint8_t *)buf;
+    sub_topics[sub_count].topic.size = (uint32_t)len;
+    sub_topics[sub_count].qos = sub->qos;
+    subs[sub_count++] = sub;
+  }
+
+  LOG_INF("%d subscriptions in %d trie nodes", (int)sub_count, (int)node_count);
+
+  return 0;
+}
+
+size_t pss_mqtt_sub_list(struct mqtt_subscription_list *list, uint16_t message_id)
+{
+  list->list = sub_topics;
+  list->list_count = (uint16_t)sub_count;
+  list->message_id = message_id;
+
+  return sub_count;
+}
+
+int pss_mqtt_sub_dispatch(const pss_mqtt_rx_t *rx)
+{
+  uint32_t pending;
+
+  if (rx->offset == 0)
+  {
+    rx_matches = 0;
+    if (rx->topic.size > 0)
+    {
+      rx_matches = trie_match(NODE_ROOT, rx->topic.ptr, rx->topic.size, 0, rx->topic.ptr[0] != '$');
+    }
+
+    if (rx_matches == 0)
+    {
+      LOG_WRN("No subscription for %.*s", (int)rx->topic.size, rx->topic.ptr);
+      return -ENOENT;
+    }
+  }
+
+  pending = rx_matches;
+  while (pending)
+  {
+    size_t i = find_lsb_set(pending) - 1;
+    int err;
+
+    pending &= ~BIT(i);
+
+    err = subs[i]->handler(rx);
+    if (err)
+    {
+      LOG_WRN("Handler of %s dropped the message, err: %d", subs[i]->filter, err);
+      rx_matches &= ~BIT(i);
+    }
+  }
+
+  return rx_matches ? 0 : -ECANCELED;
+}
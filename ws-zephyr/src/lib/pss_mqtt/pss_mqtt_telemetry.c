@@ -0,0 +1,116 @@
+/**
+ * @brief CBOR telemetry. Fields are collected as they change and sent as
+ * one map, {0: schema id, key: value, ...}, on the telemetry topic. Only
+ * the fields set since the last flush are encoded.
+ */
+
+#include "pss_mqtt_private.h"
+#include "gen/pss_mqtt_telemetry_schema.h"
+
+#include <zcbor_encode.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_DECLARE(pss_mqtt, CONFIG_PSS_MQTT_LOG_LEVEL);
+
+BUILD_ASSERT(PSS_MQTT_TLM_ENCODED_MAX <= CONFIG_PSS_MQTT_TX_PAYLOAD_MAX,
+             "A telemetry message must fit a queued payload");
+
+#define TLM_SCHEMA_KEY 0
+
+static int32_t values[PSS_MQTT_TLM_COUNT];
+static uint32_t dirty; // Bit per field set since the last flush
+static struct k_spinlock lock;
+
+BUILD_ASSERT(PSS_MQTT_TLM_COUNT <= 32, "One dirty bit per field");
+
+void pss_mqtt_telemetry_set(pss_mqtt_tlm_field_t field, int32_t value)
+{
+  k_spinlock_key_t key;
+
+  if (field >= PSS_MQTT_TLM_COUNT)
+  {
+    return;
+  }
+
+  key = k_spin_lock(&lock);
+  values[field] = value;
+  dirty |= BIT(field);
+  k_spin_unlock(&lock, key);
+}
+
+/**
+ * @brief Encode the dirty fields, called with the lock held
+ *
+ * @return Encoded length, 0 if the buffer was too small
+ */
+static size_t tlm_encode(uint8_t *buf, size_t size, uint32_t fields)
+{
+  ZCBOR_STATE_E(state, 1, buf, size, 0);
+  bool ok;
+
+  ok = zcbor_map_start_encode(state, PSS_MQTT_TLM_COUNT + 1) && zcbor_uint32_put(state, TLM_SCHEMA_KEY)
+       && zcbor_uint32_put(state, PSS_MQTT_TLM_SCHEMA_ID);
+
+  for (size_t i = 0; ok && (i < PSS_MQTT_TLM_COUNT); i++)
+  {
+    if (!(fields & BIT(i)))
+    {
+      continue;
+    }
+
+    ok = zcbor_uint32_put(state, pss_mqtt_tlm_schema[i].key);
+    if (ok && pss_mqtt_tlm_schema[i].is_signed)
+    {
+      ok = zcbor_int32_put(state, values[i]);
+    }
+    else if (ok)
+    {
+      ok = zcbor_uint32_put(state, (uint32_t)values[i]);
+    }
+  }
+
+  ok = ok && zcbor_map_end_encode(state, PSS_MQTT_TLM_COUNT + 1);
+
+  return ok ? (size_t)(state->payload - buf) : 0;
+}
+
+int32_t pss_mqtt_telemetry_flush(void)
+{
+  uint8_t buf[PSS_MQTT_TLM_ENCODED_MAX];
+  k_spinlock_key_t key;
+  uint32_t fields;
+  size_t len;
+  int32_t err;
+
+  key = k_spin_lock(&lock);
+  fields = dirty;
+  len = (fields != 0) ? tlm_encode(buf, sizeof(buf), fields) : 0;
+  if (len > 0)
+  {
+    dirty = 0;
+  }
+  k_spin_unlock(&lock, key);
+
+  if (fields == 0)
+  {
+    return 0;
+  }
+
+  if (len == 0)
+  {
+    LOG_ERR("Could not encode telemetry fields 0x%08x", (unsigned int)fields);
+    return -ENOMEM;
+  }
+
+  err = pss_mqtt_publish(PSS_MQTT_TOPIC_TELEMETRY, PSS_MQTT_PAYLOAD(buf, len));
+  if (err)
+  {
+    // Send them with the next flush
+    key = k_spin_lock(&lock);
+    dirty |= fields;
+    k_spin_unlock(&lock, key);
+  }
+
+  return err;
+}
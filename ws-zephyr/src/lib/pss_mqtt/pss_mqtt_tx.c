@@ -0,0 +1,397 @@
+/**
+ * @brief Outbound MQTT queue. Publishers enqueue without blocking and the
+ * queue is drained in the MQTT helper's service thread, which never runs
+ * at the same time as the MQTT callbacks. State and telemetry wait a short batch window so values
+ * due together leave in one radio wake.
+ */
+
+#include "pss_mqtt_private.h"
+
+#include <net/mqtt_helper.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+
+LOG_MODULE_DECLARE(pss_mqtt, CONFIG_PSS_MQTT_LOG_LEVEL);
+
+BUILD_ASSERT(CONFIG_PSS_MQTT_TX_PAYLOAD_MAX <= UINT8_MAX, "Queued payload length must fit in a byte");
+BUILD_ASSERT(PSS_MQTT_TOPIC_COUNT <= UINT8_MAX, "Topic id must fit in a byte");
+BUILD_ASSERT(IS_ENABLED(CONFIG_MY_MQTT_HELPER_SERVICE), "The queue is drained by the service thread");
+
+K_MSGQ_DEFINE(tx_alarm_q, sizeof(pss_mqtt_msg_t), CONFIG_PSS_MQTT_TX_QUEUE_DEPTH, 4);
+K_MSGQ_DEFINE(tx_state_q, sizeof(pss_mqtt_msg_t), CONFIG_PSS_MQTT_TX_QUEUE_DEPTH, 4);
+K_MSGQ_DEFINE(tx_telemetry_q, sizeof(pss_mqtt_msg_t), CONFIG_PSS_MQTT_TX_QUEUE_DEPTH, 4);
+
+static struct k_msgq *const lanes[PSS_MQTT_LANE_COUNT] = {
+  [PSS_MQTT_LANE_ALARM] = &tx_alarm_q,
+  [PSS_MQTT_LANE_STATE] = &tx_state_q,
+  [PSS_MQTT_LANE_TELEMETRY] = &tx_telemetry_q,
+};
+
+static atomic_t lane_drops[PSS_MQTT_LANE_COUNT]; // Incremented from ISRs and threads
+static atomic_t session_start = ATOMIC_INIT(0);
+static atomic_t rai_hinted = ATOMIC_INIT(0); // The end of the burst was signalled
+static atomic_t batch_open_ms = ATOMIC_INIT(0); // Uptime of the first message of the batch, 0 if none
+
+// Burst accounting, only touched under the helper's socket lock
+static pss_mqtt_burst_t burst_cur;
+static uint32_t burst_start_ms;
+static pss_mqtt_burst_t burst_last;
+static struct k_spinlock burst_lock;
+
+int32_t pss_mqtt_publish(pss_mqtt_topic_t topic, pss_mqtt_payload_t payload)
+{
+  pss_mqtt_msg_t msg = {0};
+
+  if (topic >= PSS_MQTT_TOPIC_COUNT)
+  {
+    return -EINVAL;
+  }
+
+  if (payload.len > sizeof(msg.payload))
+  {
+    return -EMSGSIZE;
+  }
+
+  // Before the shadow, a value held back must not count as published
+  if (IS_ENABLED(CONFIG_PSS_MQTT_USAGE) && !pss_mqtt_usage_allow(topic))
+  {
+    LOG_DBG("Topic %d held back by the data budget", (int)topic);
+    return -EDQUOT;
+  }
+
+  msg.topic = (uint8_t)topic;
+  msg.len = (uint8_t)payload.len;
+  memcpy(msg.payload, payload.ptr, payload.len);
+
+  if (!pss_mqtt_shadow_update(&msg))
+  {
+    LOG_DBG("Topic %d unchanged, not published", (int)topic);
+    return 0;
+  }
+
+  // After the shadow, an edge stays pending when its publish is suppressed
+  if (IS_ENABLED(CONFIG_PSS_MQTT_ALARM_LATENCY))
+  {
+    pss_mqtt_alarm_take(&msg);
+  }
+
+  return pss_mqtt_tx_enqueue(&msg);
+}
+
+int32_t pss_mqtt_msg_expiry_left(const pss_mqtt_msg_t *msg)
+{
+  uint32_t age_s;
+
+  if ((CONFIG_PSS_MQTT_TELEMETRY_EXPIRY_S == 0)
+      || (pss_mqtt_topic_lane((pss_mqtt_topic_t)msg->topic) != PSS_MQTT_LANE_TELEMETRY))
+  {
+    return SYS_FOREVER_MS;
+  }
+
+  age_s = (k_uptime_get_32() - msg->queued_ms) / MSEC_PER_SEC;
+
+  return (age_s < CONFIG_PSS_MQTT_TELEMETRY_EXPIRY_S) ? (int32_t)(CONFIG_PSS_MQTT_TELEMETRY_EXPIRY_S - age_s) : 0;
+}
+
+int32_t pss_mqtt_tx_enqueue(const pss_mqtt_msg_t *msg)
+{
+  pss_mqtt_topic_t topic = (pss_mqtt_topic_t)msg->topic;
+  pss_mqtt_lane_t lane = pss_mqtt_topic_lane(topic);
+  pss_mqtt_msg_t stamped = *msg;
+
+  stamped.queued_ms = k_uptime_get_32();
+  // A number that is never sent would show as a loss to the receiver
+  if (pss_mqtt_topic_enveloped(topic))
+  {
+    stamped.seq = pss_mqtt_env_seq_next();
+  }
+  if (IS_ENABLED(CONFIG_PSS_MQTT_ALARM_LATENCY))
+  {
+    pss_mqtt_alarm_stamp(&stamped);
+  }
+
+  // Never 0, which means no batch is open
+  (void)atomic_cas(&batch_open_ms, 0, (atomic_val_t)(k_uptime_get_32() | 1));
+  // Counted first, the writer may take the message before k_msgq_put() returns
+  pss_mqtt_shadow_queued(topic, true);
+  if (0 != k_msgq_put(lanes[lane], &stamped, K_NO_WAIT))
+  {
+    // Stays dirty in the shadow, resent on the next session
+    pss_mqtt_shadow_queued(topic, false);
+    LOG_WRN("TX lane %d full, dropped topic %d (%u drops)",
+            (int)lane,
+            (int)topic,
+            (unsigned int)(atomic_inc(&lane_drops[lane]) + 1));
+    return -ENOBUFS;
+  }
+
+  if (IS_ENABLED(CONFIG_PSS_MQTT_ALARM_LATENCY))
+  {
+    pss_mqtt_alarm_queued(&stamped);
+  }
+
+  mqtt_helper_wake();
+
+  return 0;
+}
+
+void pss_mqtt_tx_session_start(void)
+{
+  (void)atomic_set(&session_start, 1);
+  mqtt_helper_wake();
+}
+
+void pss_mqtt_tx_kick(void)
+{
+  mqtt_helper_wake();
+}
+
+static uint32_t tx_queued(void)
+{
+  uint32_t count = 0;
+
+  for (size_t lane = 0; lane < PSS_MQTT_LANE_COUNT; lane++)
+  {
+    count += k_msgq_num_used_get(lanes[lane]);
+  }
+
+  return count;
+}
+
+/**
+ * @brief Tell the modem when a message ends the burst, so it can release
+ * the RRC connection instead of waiting for the network inactivity timer
+ */
+static void tx_rai_hint(uint8_t qos)
+{
+  if (!IS_ENABLED(CONFIG_MY_MQTT_HELPER_RAI))
+  {
+    return;
+  }
+
+  if ((tx_queued() > 1) || (pss_mqtt_inflight_count() > 0) || pss_mqtt_session_pending())
+  {
+    // More to send or responses to wait for, released by pss_mqtt_tx_rai_release()
+    (void)atomic_set(&rai_hinted, 0);
+    return;
+  }
+
+  if (0 == mqtt_helper_rai_set((qos == MQTT_QOS_0_AT_MOST_ONCE) ? MQTT_HELPER_RAI_LAST
+                                                                : MQTT_HELPER_RAI_ONE_RESP))
+  {
+    (void)atomic_set(&rai_hinted, 1);
+  }
+}
+
+void pss_mqtt_tx_rai_release(void)
+{
+  if (IS_ENABLED(CONFIG_MY_MQTT_HELPER_RAI) && pss_mqtt_tx_idle() && !pss_mqtt_session_pending()
+      && atomic_cas(&rai_hinted, 0, 1))
+  {
+    (void)mqtt_helper_rai_set(MQTT_HELPER_RAI_NO_DATA);
+  }
+}
+
+bool pss_mqtt_tx_idle(void)
+{
+  if (atomic_get(&session_start))
+  {
+    return false;
+  }
+
+  for (size_t lane = 0; lane < PSS_MQTT_LANE_COUNT; lane++)
+  {
+    if (k_msgq_num_used_get(lanes[lane]) > 0)
+    {
+      return false;
+    }
+  }
+
+  return pss_mqtt_inflight_count() == 0;
+}
+
+/**
+ * @brief Time left before the batch may be written
+ *
+ * @return Milliseconds, 0 to write now
+ */
+static int32_t tx_batch_wait(void)
+{
+  uint32_t open_ms = (uint32_t)atomic_get(&batch_open_ms);
+  uint32_t elapsed;
+
+  if ((open_ms == 0) || (k_msgq_num_used_get(lanes[PSS_MQTT_LANE_ALARM]) > 0))
+  {
+    return 0;
+  }
+
+  elapsed = k_uptime_get_32() - open_ms;
+  if (elapsed >= CONFIG_PSS_MQTT_BATCH_WINDOW_MS)
+  {
+    return 0;
+  }
+
+  return (int32_t)(CONFIG_PSS_MQTT_BATCH_WINDOW_MS - elapsed);
+}
+
+void pss_mqtt_tx_burst_sent(uint32_t bytes)
+{
+  if (burst_cur.publishes == 0)
+  {
+    burst_start_ms = k_uptime_get_32();
+  }
+
+  burst_cur.publishes++;
+  burst_cur.records++;
+  burst_cur.bytes += bytes;
+}
+
+/**
+ * @brief Close the burst once everything is sent and acknowledged
+ */
+static void tx_burst_end(void)
+{
+  k_spinlock_key_t key;
+
+  // The discovery configs are part of the burst until their PUBACKs are in
+  if ((burst_cur.publishes == 0) || !pss_mqtt_tx_idle() || pss_mqtt_session_pending())
+  {
+    return;
+  }
+
+  burst_cur.duration_ms = k_uptime_get_32() - burst_start_ms;
+
+  key = k_spin_lock(&burst_lock);
+  burst_cur.bursts = burst_last.bursts + 1;
+  burst_last = burst_cur;
+  k_spin_unlock(&burst_lock, key);
+
+  LOG_INF("Burst: %u publishes, %u records, %u bytes in %u ms",
+          (unsigned int)burst_cur.publishes,
+          (unsigned int)burst_cur.records,
+          (unsigned int)burst_cur.bytes,
+          (unsigned int)burst_cur.duration_ms);
+
+  memset(&burst_cur, 0, sizeof(burst_cur));
+}
+
+void pss_mqtt_tx_burst_acked(void)
+{
+  burst_cur.records++;
+  burst_cur.bytes += PSS_MQTT_PUBACK_BYTES;
+  tx_burst_end();
+}
+
+void pss_mqtt_burst_get(pss_mqtt_burst_t *burst)
+{
+  k_spinlock_key_t key = k_spin_lock(&burst_lock);
+
+  *burst = burst_last;
+  k_spin_unlock(&burst_lock, key);
+}
+
+/**
+ * @brief Send the head of the highest priority non-empty lane.
+ * QoS 1 messages move into the in-flight window, which owns them until
+ * the PUBACK. A QoS 0 message stays queued if the connection drops while
+ * sending it.
+ *
+ * @retval true A message was consumed, call again
+ * @retval false The queue is empty, the window is full or the connection is gone
+ */
+static bool tx_drain_one(void)
+{
+  pss_mqtt_msg_t msg;
+  int32_t err;
+  uint8_t qos;
+
+  for (size_t lane = 0; lane < PSS_MQTT_LANE_COUNT; lane++)
+  {
+    if (0 != k_msgq_peek(lanes[lane], &msg))
+    {
+      continue;
+    }
+
+    if (pss_mqtt_msg_expiry_left(&msg) == 0)
+    {
+      LOG_WRN("Topic %d expired in the queue, dropped", (int)msg.topic);
+      (void)k_msgq_get(lanes[lane], &msg, K_NO_WAIT);
+      pss_mqtt_shadow_done(&msg, false);
+      return true;
+    }
+
+    qos = pss_mqtt_topic_qos((pss_mqtt_topic_t)msg.topic);
+    tx_rai_hint(qos);
+
+    if (qos == MQTT_QOS_1_AT_LEAST_ONCE)
+    {
+      if (pss_mqtt_inflight_send(&msg) == -ENOBUFS)
+      {
+        // Resumed by the PUBACK that frees a slot
+        return false;
+      }
+    }
+    else
+    {
+      err = pss_mqtt_send(&msg, 0, false);
+      if (err && !pss_mqtt_connected())
+      {
+        // Keep it for the next session
+        return false;
+      }
+
+      if (err)
+      {
+        LOG_ERR("Dropping message on topic %d, err: %d", (int)msg.topic, err);
+      }
+
+      // Written is as delivered as QoS 0 gets
+      pss_mqtt_shadow_done(&msg, err == 0);
+    }
+
+    (void)k_msgq_get(lanes[lane], &msg, K_NO_WAIT);
+    return true;
+  }
+
+  return false;
+}
+
+int32_t pss_mqtt_tx_service(void)
+{
+  int32_t timeout;
+  int32_t wait;
+
+  if (!pss_mqtt_connected())
+  {
+    // The next session start wakes the writer
+    return SYS_FOREVER_MS;
+  }
+
+  if (atomic_cas(&session_start, 1, 0))
+  {
+    pss_mqtt_inflight_requeue();
+    pss_mqtt_session_start();
+  }
+
+  pss_mqtt_inflight_retransmit();
+
+  wait = tx_batch_wait();
+  if (wait > 0)
+  {
+    timeout = pss_mqtt_inflight_timeout();
+    return ((timeout == SYS_FOREVER_MS) || (wait < timeout)) ? wait : timeout;
+  }
+
+  // Messages queued from here on open the next batch
+  (void)atomic_set(&batch_open_ms, 0);
+  while (pss_mqtt_connected() && tx_drain_one())
+  {
+  }
+
+  // A burst of QoS 0 messages has no PUBACK to close it
+  tx_burst_end();
+
+  return pss_mqtt_inflight_timeout();
+}
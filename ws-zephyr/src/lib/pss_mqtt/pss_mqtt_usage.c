@@ -0,0 +1,295 @@
+/**
+ * @brief Data usage. Every publish is charged to its topic with the MQTT
+ * packet, its PUBACK and an estimate of the TLS and TCP/IP overhead of
+ * each. The totals are reconciled with the modem's XCONNSTAT counters,
+ * kept per calendar month across reboots and checked against
+ * CONFIG_PSS_MQTT_USAGE_BUDGET_KB. Telemetry is thinned out as the budget
+ * runs low; alarms and state are never held back.
+ */
+
+#include "pss_mqtt_private.h"
+#include "pss_nrf_lte.h"
+
+#include <string.h>
+#include <time.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+
+LOG_MODULE_DECLARE(pss_mqtt, CONFIG_PSS_MQTT_LOG_LEVEL);
+
+// Budget used, in percent, from which telemetry keeps 1 of 2, 4 and 8 publishes
+#define THROTTLE_HALF_PCT 50
+#define THROTTLE_QUARTER_PCT 75
+#define THROTTLE_EIGHTH_PCT 90
+
+/**
+ * @brief The persisted counters of a month
+ */
+typedef struct {
+  uint32_t month;
+  uint32_t est_bytes;
+  uint32_t modem_kb;
+  uint32_t topic_bytes[PSS_MQTT_TOPIC_COUNT];
+  uint32_t discovery_bytes;
+} usage_t;
+
+static usage_t usage;
+static struct k_spinlock usage_lock;
+static uint8_t throttle = 0;
+static uint32_t throttle_skip[PSS_MQTT_TOPIC_COUNT];
+static int32_t modem_last_kb = -1; // XCONNSTAT total at the last reconcile, -1 before the first
+
+static void usage_work_fn(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(usage_work, usage_work_fn);
+
+static int usage_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+  usage_t saved;
+
+  if ((name == NULL) || (strcmp(name, "month") != 0))
+  {
+    return -ENOENT;
+  }
+
+  // A different topic set is another layout, start over
+  if ((len != sizeof(saved)) || (read_cb(cb_arg, &saved, len) != (ssize_t)len))
+  {
+    return 0;
+  }
+
+  usage = saved;
+
+  return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(pss_mqtt_usage, "pss_mqtt/usage", NULL, usage_settings_set, NULL, NULL);
+
+/**
+ * @brief Returns the month of the network time as year * 12 + month, 0 if
+ * the time is unknown
+ */
+static uint32_t usage_month_now(void)
+{
+  int64_t now_ms = pss_nrf_lte_get_time();
+  time_t now_s = (time_t)(now_ms / MSEC_PER_SEC);
+  struct tm tm;
+
+  if ((now_ms == 0) || (gmtime_r(&now_s, &tm) == NULL))
+  {
+    return 0;
+  }
+
+  return ((uint32_t)(tm.tm_year + 1900) * 12) + (uint32_t)tm.tm_mon;
+}
+
+/**
+ * @brief Bytes used this month, the larger of the estimate and the modem count
+ */
+static uint32_t usage_used_bytes(const usage_t *u)
+{
+  uint64_t modem = (uint64_t)u->modem_kb * 1024;
+
+  return (uint32_t)MIN(MAX(modem, (uint64_t)u->est_bytes), UINT32_MAX);
+}
+
+/**
+ * @brief Telemetry keeps 1 of 2^throttle publishes, UINT8_MAX stops it
+ */
+static uint8_t usage_throttle_level(const usage_t *u)
+{
+  uint64_t budget = (uint64_t)CONFIG_PSS_MQTT_USAGE_BUDGET_KB * 1024;
+  uint64_t pct;
+
+  if (budget == 0)
+  {
+    return 0;
+  }
+
+  pct = ((uint64_t)usage_used_bytes(u) * 100) / budget;
+  if (pct >= 100)
+  {
+    return UINT8_MAX;
+  }
+  if (pct >= THROTTLE_EIGHTH_PCT)
+  {
+    return 3;
+  }
+  if (pct >= THROTTLE_QUARTER_PCT)
+  {
+    return 2;
+  }
+  if (pct >= THROTTLE_HALF_PCT)
+  {
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Estimated cost of a publish, its PUBACK and their overhead
+ */
+static uint32_t usage_cost(uint32_t bytes, bool acked)
+{
+  uint32_t cost = bytes + CONFIG_PSS_MQTT_USAGE_OVERHEAD_B;
+
+  if (acked)
+  {
+    cost += PSS_MQTT_PUBACK_BYTES + CONFIG_PSS_MQTT_USAGE_OVERHEAD_B;
+  }
+
+  return cost;
+}
+
+void pss_mqtt_usage_sent(pss_mqtt_topic_t topic, uint32_t bytes, bool acked)
+{
+  uint32_t cost = usage_cost(bytes, acked);
+  k_spinlock_key_t key = k_spin_lock(&usage_lock);
+
+  usage.est_bytes += cost;
+  usage.topic_bytes[topic] += cost;
+  throttle = usage_throttle_level(&usage);
+  k_spin_unlock(&usage_lock, key);
+}
+
+void pss_mqtt_usage_discovery_sent(uint32_t bytes)
+{
+  uint32_t cost = usage_cost(bytes, true);
+  k_spinlock_key_t key = k_spin_lock(&usage_lock);
+
+  usage.est_bytes += cost;
+  usage.discovery_bytes += cost;
+  throttle = usage_throttle_level(&usage);
+  k_spin_unlock(&usage_lock, key);
+}
+
+bool pss_mqtt_usage_allow(pss_mqtt_topic_t topic)
+{
+  k_spinlock_key_t key;
+  bool allow;
+
+  if (pss_mqtt_topic_lane(topic) != PSS_MQTT_LANE_TELEMETRY)
+  {
+    return true;
+  }
+
+  key = k_spin_lock(&usage_lock);
+  if (throttle == UINT8_MAX)
+  {
+    allow = false;
+  }
+  else
+  {
+    allow = ((throttle_skip[topic]++ & (BIT(throttle) - 1)) == 0);
+  }
+  k_spin_unlock(&usage_lock, key);
+
+  return allow;
+}
+
+/**
+ * @brief Reconcile with the modem counters, roll the month over and save
+ */
+static void usage_work_fn(struct k_work *work)
+{
+  uint32_t month = usage_month_now();
+  int32_t tx_kb;
+  int32_t rx_kb;
+  int32_t modem_kb = -1;
+  usage_t snapshot;
+  uint8_t level;
+  k_spinlock_key_t key;
+  int err;
+
+  ARG_UNUSED(work);
+
+  if (0 == pss_nrf_lte_get_data_kb(&tx_kb, &rx_kb))
+  {
+    modem_kb = tx_kb + rx_kb;
+  }
+
+  key = k_spin_lock(&usage_lock);
+  if ((month != 0) && (usage.month == 0))
+  {
+    // The first network time, what was counted before belongs to this month
+    usage.month = month;
+  }
+  else if ((month != 0) && (month != usage.month))
+  {
+    memset(&usage, 0, sizeof(usage));
+    usage.month = month;
+  }
+
+  if (modem_kb >= 0)
+  {
+    // The modem counts from its last start, a lower value means it restarted
+    usage.modem_kb += ((modem_last_kb >= 0) && (modem_kb >= modem_last_kb)) ? (uint32_t)(modem_kb - modem_last_kb)
+                                                                            : (uint32_t)modem_kb;
+    modem_last_kb = modem_kb;
+  }
+
+  throttle = usage_throttle_level(&usage);
+  level = throttle;
+  snapshot = usage;
+  k_spin_unlock(&usage_lock, key);
+
+  LOG_INF("Data usage %u/%u KB, estimated %u KB, modem %u KB, telemetry throttle %d",
+          (unsigned int)(usage_used_bytes(&snapshot) / 1024),
+          (unsigned int)CONFIG_PSS_MQTT_USAGE_BUDGET_KB,
+          (unsigned int)(snapshot.est_bytes / 1024),
+          (unsigned int)snapshot.modem_kb,
+          (level == UINT8_MAX) ? -1 : (int)level);
+  for (size_t topic = 0; topic < PSS_MQTT_TOPIC_COUNT; topic++)
+  {
+    if (snapshot.topic_bytes[topic] > 0)
+    {
+      LOG_DBG("  topic %d: %u bytes", (int)topic, (unsigned int)snapshot.topic_bytes[topic]);
+    }
+  }
+  if (snapshot.discovery_bytes > 0)
+  {
+    LOG_DBG("  discovery: %u bytes", (unsigned int)snapshot.discovery_bytes);
+  }
+
+  err = settings_save_one("pss_mqtt/usage/month", &snapshot, sizeof(snapshot));
+  if (err)
+  {
+    LOG_WRN("Could not save the data usage, err: %d", err);
+  }
+
+  (void)k_work_schedule(&usage_work, K_SECONDS(CONFIG_PSS_MQTT_USAGE_SAVE_S));
+}
+
+void pss_mqtt_usage_init(void)
+{
+  k_spinlock_key_t key;
+
+  // Without credentials to provision the pss_mqtt subtree is not loaded yet
+  if (settings_subsys_init() || settings_load_subtree("pss_mqtt/usage"))
+  {
+    LOG_WRN("Data usage of this month unavailable, counting from 0");
+  }
+
+  key = k_spin_lock(&usage_lock);
+  throttle = usage_throttle_level(&usage);
+  k_spin_unlock(&usage_lock, key);
+
+  // The first run picks up the modem counters this boot starts from
+  (void)k_work_schedule(&usage_work, K_NO_WAIT);
+}
+
+void pss_mqtt_usage_get(pss_mqtt_usage_t *info)
+{
+  k_spinlock_key_t key = k_spin_lock(&usage_lock);
+
+  info->month = usage.month;
+  info->budget_kb = CONFIG_PSS_MQTT_USAGE_BUDGET_KB;
+  info->used_kb = usage_used_bytes(&usage) / 1024;
+  info->est_bytes = usage.est_bytes;
+  info->modem_kb = usage.modem_kb;
+  info->throttle = throttle;
+  memcpy(info->topic_bytes, usage.topic_bytes, sizeof(info->topic_bytes));
+  info->discovery_bytes = usage.discovery_bytes;
+  k_spin_unlock(&usage_lock, key);
+}
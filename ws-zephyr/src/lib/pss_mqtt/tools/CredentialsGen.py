@@ -2,6 +2,8 @@
 from jinja2 import Template
 from datetime import datetime
 import argparse
+import base64
+import hashlib
 import os
 import glob
 import sys
@@ -44,6 +46,148 @@ class NoCertsException(Exception):
     "Raised when the input value is less than 18"
     pass
 
+# DER encoded object identifiers of the public key algorithms
+OID_RSA = bytes.fromhex('06092a864886f70d010101')    # rsaEncryption
+OID_EC = bytes.fromhex('06072a8648ce3d0201')         # id-ecPublicKey
+OID_P256 = bytes.fromhex('06082a8648ce3d030107')     # prime256v1
+
+def key_algorithm(lines:list) -> str:
+    """Finds the public key algorithm of a PEM certificate or private key.
+
+    The first key algorithm OID of a certificate is the one of its subject
+    key, signature algorithms use different OIDs. SEC1 EC keys, the default
+    of openssl ecparam -genkey, carry only the curve OID.
+
+    Args:
+        lines (list): Lines of the PEM file.
+
+    Returns:
+        str: 'rsa', 'ec-p256', 'ec' for other curves or 'unknown'.
+    """
+    try :
+        blocks = key_blocks(pem_blocks(lines))
+    except ValueError :
+        return 'unknown'
+    if not blocks :
+        return 'unknown'
+
+    label,der = blocks[0]
+    if label == 'RSA PRIVATE KEY' :
+        return 'rsa'
+    if label == 'EC PRIVATE KEY' :
+        return 'ec-p256' if OID_P256 in der else 'ec'
+
+    rsa = der.find(OID_RSA)
+    ec = der.find(OID_EC)
+    if ec >= 0 and (rsa < 0 or ec < rsa) :
+        return 'ec-p256' if OID_P256 in der else 'ec'
+    if rsa >= 0 :
+        return 'rsa'
+    return 'unknown'
+
+def key_blocks(blocks:list) -> list:
+    """Drops the EC PARAMETERS block openssl ecparam -genkey writes before the key.
+
+    The curve is repeated inside the key and the modem only takes the key.
+
+    Args:
+        blocks (list): (label, der) tuples from pem_blocks.
+
+    Returns:
+        list: The blocks without EC PARAMETERS.
+    """
+    return [ (label,der) for label,der in blocks if label != 'EC PARAMETERS' ]
+
+def pem_blocks(lines:list) -> list:
+    """Splits a PEM file into its label and the DER bytes of each block.
+
+    Args:
+        lines (list): Lines of the PEM file.
+
+    Returns:
+        list: (label, der) tuples in file order.
+    """
+    blocks = []
+    label = None
+    body = []
+    for l in lines :
+        l = l.strip()
+        if l.startswith('-----BEGIN ') :
+            label = l[len('-----BEGIN '):-len('-----')]
+            body = []
+        elif l.startswith('-----END ') :
+            blocks.append((label, base64.b64decode(''.join(body))))
+            label = None
+        elif label is not None :
+            body.append(l)
+    return blocks
+
+def pem_size(label:str, blocks:list) -> int:
+    """Size of the PEM the firmware rebuilds from DER, including the terminator.
+
+    Must follow pem_from_der() in pss_mqtt.c: 64 character lines, each ending
+    with a newline.
+    """
+    size = 1
+    for der in blocks :
+        b64 = len(base64.b64encode(der))
+        size += len("-----BEGIN %s-----\n"%label) + b64 + (b64 + 63)//64 + len("-----END %s-----\n"%label)
+    return size
+
+def c_bytes(data:bytes, width:int=12) -> list:
+    """Formats bytes as rows of a C array initializer."""
+    return [ ', '.join('0x%02x'%b for b in data[i:i+width]) + ',' for i in range(0,len(data),width) ]
+
+# Modem credential type of each generated credential, in provisioning order
+CRED_TYPES = [
+    ('root', 'root_ca_der', 'MODEM_KEY_MGMT_CRED_TYPE_CA_CHAIN'),
+    ('crt', 'client_cert_der', 'MODEM_KEY_MGMT_CRED_TYPE_PUBLIC_CERT'),
+    ('key', 'client_key_der', 'MODEM_KEY_MGMT_CRED_TYPE_PRIVATE_CERT'),
+]
+
+def build_creds(info:dict) -> list:
+    """Converts the PEM credentials to DER and digests each one.
+
+    The CA file may hold a chain, its blocks are concatenated and split again
+    by the firmware. The client id is provisioned as is.
+
+    Args:
+        info (dict): Certificates read by load_config.
+
+    Returns:
+        list: Credentials with their C variable, modem type, DER rows and digest.
+    """
+    creds = []
+    for crt_type,var,modem_type in CRED_TYPES :
+        blocks = key_blocks(pem_blocks(info['certs'][crt_type]['lines']))
+        if len(blocks) == 0 :
+            raise Exception("%s: no PEM blocks"%info['certs'][crt_type]['name'])
+        der = b''.join(d for _,d in blocks)
+        creds.append({
+            'var' : var,
+            'type' : modem_type,
+            'label' : blocks[0][0],
+            'blocks' : [ d for _,d in blocks ],
+            'rows' : c_bytes(der),
+            'len' : 'sizeof(%s)'%var,
+            'digest' : hashlib.sha256(der).hexdigest(),
+        })
+
+    creds.append({
+        'var' : 'new_client_id',
+        'type' : 'MODEM_KEY_MGMT_CRED_TYPE_IDENTITY',
+        'label' : None,
+        'blocks' : [],
+        'rows' : [],
+        'len' : 'sizeof(new_client_id) - 1',
+        'digest' : hashlib.sha256(info['CID'].encode()).hexdigest(),
+    })
+
+    for c in creds :
+        c['digest_rows'] = c_bytes(bytes.fromhex(c['digest']), 16)
+
+    return creds
+
 def load_config(args) -> dict:
     """Reads the CSV map file and converts each column to a dictionary.
 
@@ -87,6 +231,16 @@ def load_config(args) -> dict:
             lines = f.readlines()
             info['certs'][crt_type]['lines'] = [ l.replace('\n','') for l in lines]
             info['certs'][crt_type]['name'] = os.path.basename(c)
+            info['certs'][crt_type]['alg'] = key_algorithm(info['certs'][crt_type]['lines'])
+            info['certs'][crt_type]['count'] = sum(1 for l in lines if 'BEGIN CERTIFICATE' in l)
+
+    for crt_type,crt in info['certs'].items() :
+        if crt['alg'] in ('ec','unknown') :
+            raise Exception("%s: only RSA and ECDSA P-256 credentials are supported"%crt['name'])
+
+    info['creds'] = build_creds(info)
+    info['pem_max'] = max(pem_size(c['label'],c['blocks']) for c in info['creds'] if c['label'])
+    info['digest'] = hashlib.sha256(b''.join(bytes.fromhex(c['digest']) for c in info['creds'])).hexdigest()
 
     return info
 
@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+from jinja2 import Template
+import argparse
+import csv
+import json
+import os
+import glob
+import sys
+
+def parse_args(argv:list=None):
+    """Parses command line arguments and returns them as a namespace.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+
+    Returns:
+        Namespace: Namespace containing specified arguments.
+    """
+    parser = argparse.ArgumentParser(description='Generates Home Assistant MQTT discovery payloads.')
+
+    parser.add_argument('-i','--csv', action='store',default="../cfg/ha_entities.csv", help='CSV containing the entity table.')
+    parser.add_argument('-o','--output-folder', action='store',default="../gen", help='folder to store the generated files.')
+    parser.add_argument('-t','--templates', action='store',default="./templates/discovery", help="folder containing jinja templates.")
+    parser.add_argument('-p','--discovery-prefix', action='store',default="homeassistant", help="Home Assistant discovery prefix.")
+    parser.add_argument('--heartbeat-max', action='store',type=int,default=604800, help="CONFIG_PSS_CONFIG_HEARTBEAT_MAX_S, for an expire_after of 'heartbeat'.")
+    parser.add_argument('--no-rel',action="store_false",help="Argument paths are relative to this script unless this is set.")
+    parser.add_argument('-c','--check',action="store_true",help="Checks if generation output matches the current files. Exits with error if they do not match.")
+
+    args = parser.parse_args(argv)
+
+    if args.no_rel :
+        cur = os.path.dirname(__file__)
+
+        args.csv = os.path.join(cur,args.csv)
+        assert os.path.exists(args.csv)
+
+        args.output_folder = os.path.join(cur,args.output_folder)
+        if not os.path.exists(args.output_folder) :
+            os.mkdir(args.output_folder)
+
+        args.templates = os.path.join(cur,args.templates)
+        assert os.path.exists(args.templates)
+
+    return args
+
+def fnv1a_32(data:bytes) -> int:
+    """32 bit FNV-1a hash, used to detect changes to the discovery set.
+
+    Args:
+        data (bytes): Bytes to hash.
+
+    Returns:
+        int: The hash value.
+    """
+    h = 0x811c9dc5
+    for b in data :
+        h ^= b
+        h = (h * 0x01000193) & 0xffffffff
+    return h
+
+def c_escape(s:str) -> str:
+    """Escapes a string so it can be placed in a C string literal."""
+    return s.replace('\\','\\\\').replace('"','\\"')
+
+# Placeholders for the per-device parts of the payloads, in the order they
+# appear in each payload: base topic, then device id (twice)
+BASE = '@BASE@'
+DEV_ID = '@ID@'
+
+# Value template of the entities when the firmware wraps payloads in an envelope
+ENVELOPE_TEMPLATE = '{{ value_json.v }}'
+
+# Slack on top of the longest heartbeat for an expire_after of 'heartbeat',
+# covers a session that opens late
+HEARTBEAT_SLACK_S = 3600
+
+def c_format(s:str) -> str:
+    """Turns the placeholders into printf conversions, the firmware fills in
+    the device topic base and id at runtime.
+    """
+    return s.replace('%','%%').replace(BASE,'%s').replace(DEV_ID,'%s')
+
+def load_config(args) -> dict:
+    """Reads the entity table and builds the discovery topic and payload of each entity.
+
+    Topics and payloads are printf formats. The topic takes the device id, the
+    payload takes the device topic base followed by the device id twice.
+
+    Args:
+        args (Namespace): Command-line/default arguments.
+
+    Returns:
+        dict: Entities with their discovery topic/payload and the hash of the set.
+    """
+    device = {
+        "ids" : [DEV_ID],
+        "name" : "Sump Water Sensor",
+        "mf" : "mikebush.org",
+        "mdl" : "WaterSensorShield",
+    }
+
+    entities = []
+
+    with open(args.csv, 'r') as f :
+        for row in csv.DictReader(f) :
+            row = { k.strip() : (v.strip() if v else '') for k,v in row.items() }
+
+            # Abbreviated keys keep the retained payloads small
+            payload = {
+                "~" : BASE,
+                "name" : row['name'],
+                "uniq_id" : f"{DEV_ID}_{row['object_id']}",
+                "stat_t" : f"~/{row['state_topic']}",
+                "avty_t" : "~/availability",
+            }
+            if row['device_class'] :
+                payload['dev_cla'] = row['device_class']
+            if row['state_class'] :
+                payload['stat_cla'] = row['state_class']
+            if row['unit'] :
+                payload['unit_of_meas'] = row['unit']
+            if row['payload_on'] :
+                payload['pl_on'] = row['payload_on']
+            if row['payload_off'] :
+                payload['pl_off'] = row['payload_off']
+            if row['icon'] :
+                payload['ic'] = row['icon']
+            if row.get('expire_after') == 'heartbeat' :
+                # Published once per heartbeat, which the backend may stretch up to the maximum
+                payload['exp_aft'] = args.heartbeat_max + HEARTBEAT_SLACK_S
+            elif row.get('expire_after') :
+                # Marks the entity unavailable when the device goes quiet without a last will
+                payload['exp_aft'] = int(row['expire_after'])
+            payload['dev'] = device
+
+            # With CONFIG_PSS_MQTT_ENVELOPE the state is the "v" member of the envelope
+            payload_env = dict(payload)
+            payload_env['val_tpl'] = ENVELOPE_TEMPLATE
+
+            topic = c_format(f"{args.discovery_prefix}/{row['component']}/{DEV_ID}/{row['object_id']}/config")
+            payload = c_format(json.dumps(payload, separators=(',',':')))
+            payload_env = c_format(json.dumps(payload_env, separators=(',',':')))
+
+            entities.append({
+                "object_id" : row['object_id'],
+                "topic" : c_escape(topic),
+                "payload" : c_escape(payload),
+                "payload_env" : c_escape(payload_env),
+                "raw_topic" : topic,
+                "raw_payload" : payload,
+                "raw_payload_env" : payload_env,
+            })
+
+    digest = fnv1a_32(b''.join((e['raw_topic'] + e['raw_payload']).encode() for e in entities))
+    digest_env = fnv1a_32(b''.join((e['raw_topic'] + e['raw_payload_env']).encode() for e in entities))
+
+    return {
+        "entities" : entities,
+        "hash" : f"0x{digest:08x}u",
+        "hash_env" : f"0x{digest_env:08x}u",
+        "topic_max" : max(len(e['raw_topic']) for e in entities),
+        "payload_max" : max(len(e['raw_payload_env']) for e in entities),
+    }
+
+def generate_files(config:dict, args) :
+    """Generates or checks files from Jinja2 templates using config read by load_config function.
+
+    Args:
+        config (dict): Config returned from load_config function
+        args (_type_): Namespace of command-line/default arguments.
+    """
+
+    templates = glob.glob(args.templates+"/*.jinja")
+
+    for t in templates :
+        fname = os.path.basename(t).replace(".jinja",'')
+        output = os.path.join(args.output_folder,fname)
+
+        with open(t,'r') as f :
+            j_temp = Template(f.read(),trim_blocks=True)
+
+        content = j_temp.render(config=config)
+
+        if content[-1] != '\n' :
+            content = content + '\n'
+
+        if args.check :
+            with open(output,'r') as d :
+                dest = d.read()
+            if content != dest :
+                print("Generated content for %s does not match! Did you modify the generated code or forget to re-generate??"%fname,
+                    file=sys.stderr)
+                sys.exit(1)
+        else :
+            with open(output,'w') as out :
+                out.write(content)
+
+
+def main(args:list=None) :
+    """Main function to run script.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+    """
+
+    args = parse_args(args)
+
+    config = load_config(args)
+
+    generate_files(config,args)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+import argparse
+
+def parse_args(argv:list=None):
+    """Parses command line arguments and returns them as a namespace.
+
+    The defaults are rough LTE-M figures for the nRF9160 taken from the
+    Online Power Profiler, adjust them to measurements of the real board.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+
+    Returns:
+        Namespace: Namespace containing specified arguments.
+    """
+    parser = argparse.ArgumentParser(description='Estimates current and data per day of the always connected and on-demand MQTT modes.')
+
+    # Traffic
+    parser.add_argument('--heartbeats', action='store', type=float, default=2, help='Heartbeats per day.')
+    parser.add_argument('--events', action='store', type=float, default=8, help='Sensor and pump publishes per day outside the heartbeat.')
+    parser.add_argument('--keepalive', action='store', type=float, default=3600, help='CONFIG_MQTT_KEEPALIVE in seconds, always connected only.')
+    parser.add_argument('--nat-drops', action='store', type=float, default=0, help='Sessions per day lost to NAT timeouts, always connected only.')
+    parser.add_argument('--resumed', action='store', type=float, default=0.9, help='Share of on-demand connects that resume the TLS session.')
+
+    # Energy
+    parser.add_argument('--idle-ua', action='store', type=float, default=250, help='Floor while reachable in idle DRX, always connected.')
+    parser.add_argument('--psm-ua', action='store', type=float, default=3, help='Floor in PSM, on demand.')
+    parser.add_argument('--wake-mc', action='store', type=float, default=60, help='Charge of one radio wake incl. the RRC inactivity tail, in mC.')
+    parser.add_argument('--full-hs-mc', action='store', type=float, default=80, help='Extra charge of a full TLS handshake, in mC.')
+    parser.add_argument('--resumed-hs-mc', action='store', type=float, default=20, help='Extra charge of a resumed TLS handshake, in mC.')
+
+    # Bytes on the air, IP and TCP headers and TLS records included
+    parser.add_argument('--ping-b', action='store', type=int, default=220, help='PINGREQ and PINGRESP with TCP ACKs.')
+    parser.add_argument('--publish-b', action='store', type=int, default=260, help='A QoS 1 publish and its PUBACK.')
+    parser.add_argument('--full-hs-b', action='store', type=int, default=5500, help='TCP open and a full TLS handshake with the RSA chain.')
+    parser.add_argument('--resumed-hs-b', action='store', type=int, default=700, help='TCP open and a resumed TLS handshake.')
+    parser.add_argument('--session-b', action='store', type=int, default=400, help='CONNECT, CONNACK, DISCONNECT and TCP close.')
+    parser.add_argument('--publishes-per-session', action='store', type=float, default=2, help='Publishes sent in one wake.')
+
+    return parser.parse_args(argv)
+
+SECONDS_PER_DAY = 86400
+
+def always_connected(args) -> tuple:
+    """The session stays open, every message and keepalive wakes the radio."""
+    wakes = args.heartbeats + args.events + SECONDS_PER_DAY / args.keepalive
+    publishes = (args.heartbeats + args.events) * args.publishes_per_session
+
+    charge_mc = args.idle_ua * SECONDS_PER_DAY / 1000.0
+    charge_mc += wakes * args.wake_mc
+    charge_mc += (1 + args.nat_drops) * args.full_hs_mc
+
+    data = publishes * args.publish_b
+    data += SECONDS_PER_DAY / args.keepalive * args.ping_b
+    data += (1 + args.nat_drops) * (args.full_hs_b + args.session_b)
+
+    return charge_mc, data
+
+def on_demand(args) -> tuple:
+    """Every heartbeat and event opens, uses and closes a session."""
+    sessions = args.heartbeats + args.events
+    publishes = sessions * args.publishes_per_session
+    hs_mc = args.resumed * args.resumed_hs_mc + (1 - args.resumed) * args.full_hs_mc
+    hs_b = args.resumed * args.resumed_hs_b + (1 - args.resumed) * args.full_hs_b
+
+    charge_mc = args.psm_ua * SECONDS_PER_DAY / 1000.0
+    charge_mc += sessions * (args.wake_mc + hs_mc)
+
+    data = publishes * args.publish_b
+    data += sessions * (hs_b + args.session_b)
+
+    return charge_mc, data
+
+def main(args:list=None) :
+    """Main function to run script.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+    """
+
+    args = parse_args(args)
+
+    print(f"{'mode':<18}{'avg current':>14}{'data/day':>12}")
+    for name,model in (('always connected',always_connected),('on demand',on_demand)) :
+        charge_mc,data = model(args)
+        avg_ua = charge_mc * 1000.0 / SECONDS_PER_DAY
+        print(f"{name:<18}{avg_ua:>11.1f} uA{data/1024:>9.1f} KB")
+
+if __name__ == '__main__':
+    main()
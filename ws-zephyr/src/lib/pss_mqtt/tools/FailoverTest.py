@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+import argparse
+import random
+import socket
+import struct
+import subprocess
+import time
+
+from InboundLoad import packet, read_packet, utf8
+
+def parse_args(argv:list=None):
+    """Parses command line arguments and returns them as a namespace.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+
+    Returns:
+        Namespace: Namespace containing specified arguments.
+    """
+    parser = argparse.ArgumentParser(description='Runs the broker failover policy of pss_mqtt_broker.c against two real '
+                                                 'brokers and publishes an alarm every few seconds. With --spawn it starts '
+                                                 'two mosquitto instances, kills the primary mid-run and restarts it, then '
+                                                 'reports the time to fail over, the time to fail back and the longest '
+                                                 'alarm gap.')
+
+    parser.add_argument('--primary', action='store', default='localhost:18831', help='host:port of the primary broker.')
+    parser.add_argument('--fallback', action='store', default='localhost:18832', help='host:port of the fallback broker.')
+    parser.add_argument('--spawn', action='store_true', help='Start mosquitto on both ports and kill the primary during the run.')
+    parser.add_argument('--kill-at', action='store', type=float, default=20, help='Seconds into the run the primary is killed.')
+    parser.add_argument('--restore-at', action='store', type=float, default=60, help='Seconds into the run the primary is restarted.')
+    parser.add_argument('-d','--duration', action='store', type=float, default=120, help='Seconds to run.')
+    parser.add_argument('--alarm-s', action='store', type=float, default=1, help='Seconds between alarms.')
+    parser.add_argument('--ack-timeout', action='store', type=float, default=3, help='Seconds without a PUBACK before the session counts as dead.')
+    parser.add_argument('--connect-timeout', action='store', type=float, default=5, help='TCP connect and CONNACK timeout in seconds.')
+    parser.add_argument('--attempts', action='store', type=int, default=2, help='CONFIG_PSS_MQTT_FAILOVER_ATTEMPTS')
+    parser.add_argument('--failback-s', action='store', type=float, default=30, help='CONFIG_PSS_MQTT_FAILBACK_S, short for the test.')
+    parser.add_argument('--base-ms', action='store', type=int, default=2000, help='CONFIG_PSS_MQTT_BACKOFF_BASE_MS')
+    parser.add_argument('--cap-ms', action='store', type=int, default=1800000, help='CONFIG_PSS_MQTT_BACKOFF_CAP_MS')
+    parser.add_argument('-s','--seed', action='store', type=int, default=1, help='Random seed of the backoff jitter.')
+
+    return parser.parse_args(argv)
+
+class Policy:
+    """Failover and backoff of one device, follows pss_mqtt_broker.c and pss_mqtt_backoff.c."""
+
+    def __init__(self, args) :
+        self.args = args
+        self.rng = random.Random(args.seed)
+        self.active = 0
+        self.fallback = 0
+        self.probing = False
+        self.switched = 0.0
+        self.streak = 0
+        self.backoff_attempts = 0
+        self.next_retry = 0.0
+
+    def switch(self, index:int, why:str, now:float) :
+        log(now, f'broker {self.active} {why}, switching to {index}')
+        self.active = index
+        self.streak = 0
+        self.switched = now
+        self.backoff_attempts = 0
+        self.next_retry = 0.0
+
+    def failback_due(self, now:float) -> bool:
+        return self.active != 0 and (now - self.switched) >= self.args.failback_s
+
+    def attempt(self, now:float) :
+        if self.failback_due(now) :
+            self.fallback = self.active
+            self.probing = True
+            self.switch(0, 'is a fallback, probing the primary', now)
+
+    def connected(self) :
+        self.probing = False
+        self.streak = 0
+
+    def failed(self, now:float) :
+        window = self.args.base_ms
+        self.backoff_attempts += 1
+        for _ in range(1, self.backoff_attempts) :
+            window = min(window << 1, self.args.cap_ms)
+        self.next_retry = now + self.rng.randint(0, window) / 1000.0
+
+        self.streak += 1
+        if self.probing :
+            self.probing = False
+            self.switch(self.fallback, 'failed the probe', now)
+        elif self.streak >= self.args.attempts :
+            self.switch((self.active + 1) % 2, 'is failing', now)
+
+    def closed(self) :
+        self.backoff_attempts = 0
+        self.next_retry = 0.0
+
+START = time.monotonic()
+
+def log(now:float, msg:str) :
+    print(f'{now - START:8.2f}  {msg}', flush=True)
+
+def mqtt_connect(addr:str, timeout:float) -> socket.socket:
+    host,port = addr.rsplit(':',1)
+    sock = socket.create_connection((host, int(port)), timeout=timeout)
+    sock.sendall(packet(0x10, utf8('MQTT') + bytes([4, 0x02]) + struct.pack('!H', 60) + utf8('failover-test')))
+    header,body = read_packet(sock)
+    if header != 0x20 or body[1] != 0 :
+        sock.close()
+        raise ConnectionError(f'CONNACK refused: {body.hex()}')
+    return sock
+
+def mqtt_alarm(sock:socket.socket, seq:int, timeout:float) :
+    """QoS 1 publish, returns once the PUBACK is in."""
+    sock.settimeout(timeout)
+    sock.sendall(packet(0x32, utf8('failover-test/sensor') + struct.pack('!H', seq) + str(seq).encode()))
+    while True :
+        header,body = read_packet(sock)
+        if (header & 0xF0) == 0x40 and struct.unpack('!H', body[:2])[0] == seq :
+            return
+
+def spawn(addr:str) -> subprocess.Popen:
+    port = addr.rsplit(':',1)[1]
+    return subprocess.Popen(['mosquitto', '-p', port], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+def main(args:list=None) :
+    """Main function to run script.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+    """
+
+    args = parse_args(args)
+    brokers = [args.primary, args.fallback]
+    policy = Policy(args)
+    procs = [spawn(b) for b in brokers] if args.spawn else []
+    killed_at = restored_at = None
+    failover_s = failback_s = None
+    last_ack = None
+    max_gap = 0.0
+    acked = 0
+    seq = 0
+    sock = None
+    next_alarm = 0.0
+
+    time.sleep(0.5 if procs else 0)
+    try :
+        while time.monotonic() - START < args.duration :
+            now = time.monotonic()
+            t = now - START
+
+            if procs and killed_at is None and t >= args.kill_at :
+                procs[0].kill()
+                procs[0].wait()
+                killed_at = now
+                log(now, 'primary killed')
+            if procs and killed_at is not None and restored_at is None and t >= args.restore_at :
+                procs[0] = spawn(brokers[0])
+                restored_at = now
+                log(now, 'primary restarted')
+
+            if sock is None :
+                if now < policy.next_retry :
+                    time.sleep(0.05)
+                    continue
+                policy.attempt(now)
+                try :
+                    sock = mqtt_connect(brokers[policy.active], args.connect_timeout)
+                except (OSError, ConnectionError, IndexError) as e :
+                    log(time.monotonic(), f'connect to broker {policy.active} failed: {e}')
+                    policy.failed(time.monotonic())
+                    continue
+                policy.connected()
+                log(time.monotonic(), f'connected to broker {policy.active}')
+                if policy.active == 0 and restored_at is not None and failback_s is None :
+                    failback_s = time.monotonic() - restored_at
+
+            if policy.failback_due(now) :
+                # Idle between alarms, close on purpose like pss_mqtt_failback_check()
+                sock.sendall(packet(0xE0, b''))
+                sock.close()
+                sock = None
+                policy.closed()
+                continue
+
+            if now < next_alarm :
+                time.sleep(min(0.05, next_alarm - now))
+                continue
+
+            seq = (seq % 65535) + 1
+            try :
+                mqtt_alarm(sock, seq, args.ack_timeout)
+            except (OSError, IndexError) as e :
+                # read_packet() fails with IndexError on a closed socket
+                reason = 'closed by the broker' if isinstance(e, IndexError) else (str(e) or 'no PUBACK')
+                log(time.monotonic(), f'session on broker {policy.active} dropped: {reason}')
+                sock.close()
+                sock = None
+                policy.failed(time.monotonic())
+                continue
+
+            acked += 1
+            ack_time = time.monotonic()
+            if last_ack is not None :
+                max_gap = max(max_gap, ack_time - last_ack)
+            last_ack = ack_time
+            if policy.active == 1 and killed_at is not None and failover_s is None :
+                failover_s = ack_time - killed_at
+            next_alarm = now + args.alarm_s
+    finally :
+        for p in procs :
+            p.kill()
+
+    print(f'alarms acknowledged: {acked}')
+    print(f'longest gap between PUBACKs: {max_gap:.2f} s')
+    if failover_s is not None :
+        print(f'primary killed to first PUBACK on the fallback: {failover_s:.2f} s')
+    if failback_s is not None :
+        print(f'primary restarted to connected on it again: {failback_s:.2f} s')
+
+if __name__ == '__main__':
+    main()
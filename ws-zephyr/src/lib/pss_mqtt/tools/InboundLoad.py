@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+import argparse
+import os
+import socket
+import struct
+import time
+
+def parse_args(argv:list=None):
+    """Parses command line arguments and returns them as a namespace.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+
+    Returns:
+        Namespace: Namespace containing specified arguments.
+    """
+    parser = argparse.ArgumentParser(description='Publishes large payloads to a device topic on a local broker. '
+                                                 'The device logs the time it took to stream each one.')
+
+    parser.add_argument('-b','--broker', action='store', default='localhost:1883', help='host:port of a plain TCP broker.')
+    parser.add_argument('-t','--topic', action='store', required=True, help='Topic the device subscribes to.')
+    parser.add_argument('-s','--size', action='store', type=int, default=16384, help='Payload size in bytes.')
+    parser.add_argument('-n','--count', action='store', type=int, default=10, help='Number of publishes.')
+    parser.add_argument('-q','--qos', action='store', type=int, choices=[0,1], default=1, help='QoS of the publishes.')
+    parser.add_argument('-i','--interval', action='store', type=float, default=2.0, help='Seconds between publishes.')
+
+    return parser.parse_args(argv)
+
+def remaining_length(n:int) -> bytes:
+    """MQTT variable length encoding."""
+    out = bytearray()
+    while True :
+        byte = n % 128
+        n //= 128
+        out.append(byte | (0x80 if n else 0))
+        if not n :
+            return bytes(out)
+
+def utf8(s:str) -> bytes:
+    data = s.encode()
+    return struct.pack('!H', len(data)) + data
+
+def packet(header:int, body:bytes) -> bytes:
+    return bytes([header]) + remaining_length(len(body)) + body
+
+def read_packet(sock:socket.socket) -> tuple:
+    header = sock.recv(1)[0]
+    length = 0
+    shift = 0
+    while True :
+        byte = sock.recv(1)[0]
+        length |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80 :
+            break
+    body = b''
+    while len(body) < length :
+        body += sock.recv(length - len(body))
+    return header, body
+
+def main(args:list=None) :
+    """Main function to run script.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+    """
+
+    args = parse_args(args)
+    host,port = args.broker.rsplit(':',1)
+
+    sock = socket.create_connection((host, int(port)))
+    # MQTT 3.1.1 CONNECT, clean session, 60 s keepalive
+    sock.sendall(packet(0x10, utf8('MQTT') + bytes([4, 0x02]) + struct.pack('!H', 60) + utf8(f'inbound-load-{os.getpid()}')))
+    header,body = read_packet(sock)
+    if header != 0x20 or body[1] != 0 :
+        raise SystemExit(f'CONNACK refused: {body.hex()}')
+
+    total_ms = 0.0
+    for i in range(args.count) :
+        payload = os.urandom(args.size)
+        variable = utf8(args.topic)
+        if args.qos :
+            variable += struct.pack('!H', i + 1)
+        start = time.monotonic()
+        sock.sendall(packet(0x30 | (args.qos << 1), variable + payload))
+        if args.qos :
+            # PUBACK from the broker, not from the device
+            read_packet(sock)
+        ms = (time.monotonic() - start) * 1000.0
+        total_ms += ms
+        print(f"{i+1:4d} {args.size} bytes to the broker in {ms:.1f} ms")
+        time.sleep(args.interval)
+
+    sock.sendall(packet(0xE0, b''))
+    sock.close()
+
+    print(f"Sent {args.count} x {args.size} bytes, avg {total_ms/args.count:.1f} ms each.")
+    print("Compare with the device log: 'Received <n> bytes in <ms> ms'.")
+
+if __name__ == '__main__':
+    main()
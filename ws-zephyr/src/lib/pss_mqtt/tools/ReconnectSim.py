@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+import argparse
+import asyncio
+import random
+import sys
+
+def parse_args(argv:list=None):
+    """Parses command line arguments and returns them as a namespace.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+
+    Returns:
+        Namespace: Namespace containing specified arguments.
+    """
+    parser = argparse.ArgumentParser(description='Simulates a fleet reconnecting to the MQTT broker after an outage.')
+
+    parser.add_argument('-n','--devices', action='store', type=int, default=500, help='Number of devices.')
+    parser.add_argument('-o','--outage', action='store', type=float, default=600, help='Seconds the broker is down (simulation only).')
+    parser.add_argument('-d','--duration', action='store', type=float, default=3600, help='Seconds to run.')
+    parser.add_argument('--base-ms', action='store', type=int, default=2000, help='CONFIG_PSS_MQTT_BACKOFF_BASE_MS')
+    parser.add_argument('--cap-ms', action='store', type=int, default=1800000, help='CONFIG_PSS_MQTT_BACKOFF_CAP_MS')
+    parser.add_argument('--policy', action='store', choices=['fixed','backoff','both'], default='both', help='fixed is the old retry on every 1 s tick.')
+    parser.add_argument('-b','--broker', action='store', default=None,
+                        help='host:port of a local broker. Devices open real TCP connections instead of simulating the outage; stop and start the broker by hand.')
+    parser.add_argument('-s','--seed', action='store', type=int, default=1, help='Random seed.')
+
+    return parser.parse_args(argv)
+
+class Device:
+    """Reconnect policy of one device, follows pss_mqtt_backoff.c."""
+
+    def __init__(self, args, policy:str, rng:random.Random) :
+        self.args = args
+        self.policy = policy
+        self.rng = rng
+        self.attempts = 0
+        self.next_retry = 0.0
+        self.connected = False
+
+    def window_ms(self) -> int:
+        window = self.args.base_ms
+        for _ in range(1, self.attempts) :
+            if window >= self.args.cap_ms :
+                break
+            window <<= 1
+        return min(window, self.args.cap_ms)
+
+    def failed(self, now:float) :
+        self.connected = False
+        if self.policy == 'fixed' :
+            # pss_mqtt_main ticks once a second
+            self.next_retry = now + 1.0
+            return
+        self.attempts += 1
+        self.next_retry = now + self.rng.randint(0, self.window_ms()) / 1000.0
+
+    def succeeded(self) :
+        self.connected = True
+        self.attempts = 0
+
+def report(name:str, attempts:dict, connected_at:list, args) :
+    """Prints the load the broker sees, per second."""
+    total = sum(attempts.values())
+    peak_t, peak = max(attempts.items(), key=lambda kv : kv[1]) if attempts else (0,0)
+    done = [ t for t in connected_at if t is not None ]
+    print(f"{name}:")
+    print(f"  connect attempts      {total}")
+    print(f"  peak attempts/s       {peak} at t={peak_t}s")
+    if len(done) == args.devices :
+        print(f"  all connected at      t={max(done):.1f}s")
+    else :
+        print(f"  connected             {len(done)} of {args.devices}")
+
+    # Coarse timeline, one row per minute
+    for minute in range(0, int(args.duration) // 60 + 1) :
+        count = sum(attempts.get(s,0) for s in range(minute*60, minute*60+60))
+        if count :
+            print(f"  {minute:4d} min {count:7d} " + '#' * min(60, (count + 99) // 100))
+
+def simulate(args, policy:str) :
+    """Every device drops at t=0 and the broker refuses connections until the outage ends."""
+    rng = random.Random(args.seed)
+    fleet = [ Device(args, policy, rng) for _ in range(args.devices) ]
+    for d in fleet :
+        d.failed(0.0)
+
+    attempts = {}
+    connected_at = [ None ] * args.devices
+    t = 0.0
+    step = 0.01
+
+    while t < args.duration :
+        for i,d in enumerate(fleet) :
+            if d.connected or t < d.next_retry :
+                continue
+            attempts[int(t)] = attempts.get(int(t),0) + 1
+            if t >= args.outage :
+                d.succeeded()
+                connected_at[i] = t
+            else :
+                d.failed(t)
+        t += step
+        if all(d.connected for d in fleet) :
+            break
+
+    report(policy, attempts, connected_at, args)
+
+async def live(args, policy:str) :
+    """Devices open TCP connections to a real broker and keep them while it is up."""
+    host,port = args.broker.rsplit(':',1)
+    rng = random.Random(args.seed)
+    loop = asyncio.get_running_loop()
+    start = loop.time()
+    attempts = {}
+    connected_at = [ None ] * args.devices
+
+    async def run(i:int) :
+        d = Device(args, policy, rng)
+        while loop.time() - start < args.duration :
+            now = loop.time() - start
+            if now < d.next_retry :
+                await asyncio.sleep(d.next_retry - now)
+                continue
+            attempts[int(now)] = attempts.get(int(now),0) + 1
+            try :
+                reader,writer = await asyncio.open_connection(host, int(port))
+            except OSError :
+                d.failed(loop.time() - start)
+                continue
+            d.succeeded()
+            connected_at[i] = loop.time() - start
+            # Held until the broker goes away
+            await reader.read()
+            writer.close()
+            d.failed(loop.time() - start)
+
+    await asyncio.wait_for(asyncio.gather(*(run(i) for i in range(args.devices)), return_exceptions=True),
+                           timeout=args.duration + 5)
+    report(policy, attempts, connected_at, args)
+
+def main(args:list=None) :
+    """Main function to run script.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+    """
+
+    args = parse_args(args)
+
+    policies = ['fixed','backoff'] if args.policy == 'both' else [args.policy]
+
+    for p in policies :
+        if args.broker :
+            try :
+                asyncio.run(live(args, p))
+            except asyncio.TimeoutError :
+                pass
+        else :
+            simulate(args, p)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+import argparse
+import json
+import socket
+import struct
+import sys
+import time
+
+from InboundLoad import packet, read_packet, utf8
+from TelemetryBridge import cbor_decode, ENV_KEY_SEQ, ENV_KEY_TIME, ENV_KEY_UPTIME
+
+def parse_args(argv:list=None):
+    """Parses command line arguments and returns them as a namespace.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+
+    Returns:
+        Namespace: Namespace containing specified arguments.
+    """
+    parser = argparse.ArgumentParser(description='Subscribes to the devices and reports loss, duplicates, reordering '
+                                                 'and capture to arrival latency from the envelope of every publish. '
+                                                 'Needs CONFIG_PSS_MQTT_ENVELOPE.')
+
+    parser.add_argument('-b','--broker', action='store', default='localhost:1883', help='host:port of a plain TCP broker.')
+    parser.add_argument('-p','--prefix', action='store', default='homeassistant/sump', help='CONFIG_PSS_MQTT_TOPIC_PREFIX of the devices.')
+    parser.add_argument('-r','--report', action='store', type=float, default=60, help='Seconds between reports.')
+    parser.add_argument('-d','--duration', action='store', type=float, default=0, help='Seconds to run, 0 for ever.')
+
+    return parser.parse_args(argv)
+
+def percentile(values:list, p:float) -> float:
+    """Nearest rank percentile, None without samples."""
+    if not values :
+        return None
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(p / 100.0 * len(ordered)))]
+
+class Device :
+    """Sequence state of one device.
+
+    A boot shows as the uptime going back. The firmware skips the rest of
+    its reserved block on a reboot, that gap is not counted as loss.
+    """
+
+    def __init__(self) :
+        self.received = 0
+        self.duplicates = 0
+        self.reordered = 0
+        self.lost = 0
+        self.reboots = 0
+        self.latency_ms = []
+        self.seen = {}
+        self._reset()
+
+    def _reset(self) :
+        self.first = None
+        self.last = None
+        self.uptime = 0
+        self.missing = set()
+
+    def add(self, topic:str, seq:int, time_ms:int, uptime_ms:int, arrival_ms:int) :
+        # The bridge republishes telemetry fields with the seq of their map
+        if self.seen.get(seq, topic) != topic :
+            return
+        if seq in self.seen :
+            self.duplicates += 1
+            return
+
+        # A reordered message is older in both, a new boot only in uptime
+        if (self.first is not None) and (seq > self.last) and (uptime_ms < self.uptime) :
+            self.lost += len(self.missing)
+            self.reboots += 1
+            self.seen = {}
+            self._reset()
+
+        self.received += 1
+        self.seen[seq] = topic
+        self.uptime = max(self.uptime, uptime_ms)
+        if time_ms :
+            self.latency_ms.append(arrival_ms - time_ms)
+
+        if self.first is None :
+            self.first = self.last = seq
+        elif seq > self.last :
+            self.missing.update(range(self.last + 1, seq))
+            self.last = seq
+        else :
+            self.reordered += 1
+            self.missing.discard(seq)
+
+    def row(self, name:str) -> str:
+        lost = self.lost + len(self.missing)
+        p = [percentile(self.latency_ms, q) for q in (50, 90, 99)]
+        lat = ' '.join(f'{v:8d}' if v is not None else f"{'-':>8s}" for v in p)
+        return f'{name:32s}{self.received:8d}{lost:8d}{self.duplicates:8d}{self.reordered:8d}{self.reboots:8d} {lat}'
+
+def envelope(leaf:str, payload:bytes) -> tuple:
+    """Returns (seq, time_ms, uptime_ms) of a publish, None without an envelope."""
+    if leaf == 'tlm' :
+        items = cbor_decode(payload)
+        if ENV_KEY_SEQ not in items :
+            return None
+        return items[ENV_KEY_SEQ], items.get(ENV_KEY_TIME, 0), items.get(ENV_KEY_UPTIME, 0)
+
+    try :
+        env = json.loads(payload)
+    except ValueError :
+        return None
+    if not isinstance(env, dict) or 's' not in env :
+        return None
+    return env['s'], env.get('t', 0), env.get('u', 0)
+
+def report(devices:dict) :
+    print(f"{'device':32s}{'rx':>8s}{'lost':>8s}{'dup':>8s}{'reorder':>8s}{'reboot':>8s} {'p50 ms':>8s} {'p90 ms':>8s} {'p99 ms':>8s}")
+    for name,dev in sorted(devices.items()) :
+        print(dev.row(name))
+    sys.stdout.flush()
+
+def main(args:list=None) :
+    """Main function to run script.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+    """
+
+    args = parse_args(args)
+    host,port = args.broker.rsplit(':',1)
+    keepalive = 60
+
+    sock = socket.create_connection((host, int(port)))
+    sock.sendall(packet(0x10, utf8('MQTT') + bytes([4, 0x02]) + struct.pack('!H', keepalive) + utf8(f'seq-monitor-{int(time.time())}')))
+    header,body = read_packet(sock)
+    if header != 0x20 or body[1] != 0 :
+        raise SystemExit(f'CONNACK refused: {body.hex()}')
+
+    # QoS 1 like the device, a QoS 0 subscription would add its own loss
+    sock.sendall(packet(0x82, struct.pack('!H', 1) + utf8(f'{args.prefix}/#') + bytes([1])))
+    sock.settimeout(1.0)
+
+    devices = {}
+    start = next_report = time.monotonic()
+    last_tx = start
+    while (args.duration == 0) or (time.monotonic() - start < args.duration) :
+        now = time.monotonic()
+        if now >= next_report + args.report :
+            next_report = now
+            report(devices)
+        if now - last_tx >= keepalive / 2 :
+            sock.sendall(packet(0xC0, b''))
+            last_tx = now
+
+        try :
+            header,body = read_packet(sock)
+        except socket.timeout :
+            continue
+        if (header & 0xF0) != 0x30 :
+            continue
+
+        arrival_ms = int(time.time() * 1000)
+        qos = (header >> 1) & 0x03
+        tlen = struct.unpack('!H', body[:2])[0]
+        topic = body[2:2+tlen].decode()
+        pos = 2 + tlen
+        if qos :
+            sock.sendall(packet(0x40, body[pos:pos+2]))
+            last_tx = time.monotonic()
+            pos += 2
+
+        # Retained copies were captured before we subscribed
+        if header & 0x01 :
+            continue
+
+        parts = topic[len(args.prefix) + 1:].split('/', 1)
+        if len(parts) != 2 :
+            continue
+        try :
+            env = envelope(parts[1], body[pos:])
+        except (ValueError, IndexError, KeyError) :
+            continue
+        if env is None :
+            continue
+
+        devices.setdefault(parts[0], Device()).add(parts[1], *env, arrival_ms)
+
+    report(devices)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+import argparse
+import os
+import socket
+import struct
+import sys
+
+from InboundLoad import packet, read_packet, remaining_length, utf8
+from TelemetryGen import load_schema, schema_id
+
+def parse_args(argv:list=None):
+    """Parses command line arguments and returns them as a namespace.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+
+    Returns:
+        Namespace: Namespace containing specified arguments.
+    """
+    parser = argparse.ArgumentParser(description='Decodes the CBOR telemetry of the devices and republishes every field '
+                                                 'on its Home Assistant state topic. "size" compares the bytes per day '
+                                                 'of the ASCII and CBOR formats.')
+
+    parser.add_argument('-i','--csv', action='store',default=os.path.join(os.path.dirname(__file__),"../cfg/telemetry.csv"),
+                        help='CSV containing the telemetry schema.')
+    sub = parser.add_subparsers(dest='cmd', required=True)
+
+    bridge = sub.add_parser('bridge', help='Run the bridge.')
+    bridge.add_argument('-b','--broker', action='store', default='localhost:1883', help='host:port of a plain TCP broker.')
+    bridge.add_argument('-p','--prefix', action='store', default='homeassistant/sump', help='CONFIG_PSS_MQTT_TOPIC_PREFIX of the devices.')
+
+    size = sub.add_parser('size', help='Estimate the bytes per day of each format.')
+    size.add_argument('--heartbeats', action='store', type=float, default=2, help='Heartbeats per day.')
+    size.add_argument('--pump-cycles', action='store', type=float, default=8, help='Pump cycles per day.')
+    size.add_argument('--base', action='store', default='homeassistant/sump/nrf-352656100000000', help='Device topic base.')
+    size.add_argument('--record-b', action='store', type=int, default=69, help='IPv4, TCP and TLS 1.2 AES-GCM record overhead per packet.')
+
+    return parser.parse_args(argv)
+
+# CBOR major types used by the firmware encoder
+CBOR_UINT = 0
+CBOR_NINT = 1
+CBOR_MAP = 5
+CBOR_BREAK = 0xFF
+
+# Envelope keys appended by CONFIG_PSS_MQTT_ENVELOPE, the schema ends at 23
+ENV_KEY_SEQ = 24
+ENV_KEY_TIME = 25
+ENV_KEY_UPTIME = 26
+
+def cbor_head(major:int, value:int) -> bytes:
+    """Encodes a CBOR head with the shortest argument."""
+    if value < 24 :
+        return bytes([(major << 5) | value])
+    for info,fmt in ((24,'!B'),(25,'!H'),(26,'!I')) :
+        if value < (1 << (8 * struct.calcsize(fmt))) :
+            return bytes([(major << 5) | info]) + struct.pack(fmt, value)
+    raise ValueError(value)
+
+def cbor_int(value:int) -> bytes:
+    return cbor_head(CBOR_UINT, value) if value >= 0 else cbor_head(CBOR_NINT, -1 - value)
+
+def cbor_encode(items:dict) -> bytes:
+    """Encodes a map of ints like zcbor does without ZCBOR_CANONICAL, with an indefinite length."""
+    out = bytes([(CBOR_MAP << 5) | 31])
+    for k,v in items.items() :
+        out += cbor_int(k) + cbor_int(v)
+    return out + bytes([CBOR_BREAK])
+
+def cbor_decode(data:bytes) -> dict:
+    """Decodes a map of ints, the only shape the firmware sends.
+
+    Raises:
+        ValueError: Anything else.
+    """
+    pos = 0
+
+    def head() -> tuple:
+        nonlocal pos
+        major = data[pos] >> 5
+        info = data[pos] & 0x1F
+        pos += 1
+        if info < 24 :
+            return major, info
+        if info == 31 :
+            return major, None
+        size = {24:1, 25:2, 26:4, 27:8}[info]
+        value = int.from_bytes(data[pos:pos+size], 'big')
+        pos += size
+        return major, value
+
+    def integer() -> int:
+        major,value = head()
+        if major == CBOR_UINT :
+            return value
+        if major == CBOR_NINT :
+            return -1 - value
+        raise ValueError(f'unexpected major type {major}')
+
+    major,count = head()
+    if major != CBOR_MAP :
+        raise ValueError('not a map')
+
+    items = {}
+    while (count is None and data[pos] != CBOR_BREAK) or (count is not None and len(items) < count) :
+        k = integer()
+        items[k] = integer()
+    return items
+
+def field_value(field:dict, value:int) -> str:
+    """Formats a field like the ASCII publish of the firmware."""
+    if field['scale'] is not None :
+        return field['format'] % (value * field['scale'])
+    return field['format'] % value
+
+def fan_out(fields:list, sid:int, base:str, payload:bytes) -> list:
+    """Turns one telemetry message into (topic, value) pairs.
+
+    Fields with a state topic go to the topic Home Assistant already
+    reads, the others to <base>/tlm/<field>. When the message carries an
+    envelope every value is wrapped in it like the ASCII publishes, so
+    the discovery templates and SeqMonitor.py read them the same way.
+    """
+    items = cbor_decode(payload)
+    if items.pop(0, None) != sid :
+        raise ValueError('schema mismatch, regenerate with the firmware schema')
+
+    seq = items.pop(ENV_KEY_SEQ, None)
+    env_time = items.pop(ENV_KEY_TIME, 0)
+    env_uptime = items.pop(ENV_KEY_UPTIME, 0)
+    def wrap(value:str) -> str:
+        if seq is None :
+            return value
+        return f'{{"s":{seq},"t":{env_time},"u":{env_uptime},"v":"{value}"}}'
+
+    by_key = { f['key'] : f for f in fields }
+    out = []
+    for k,v in items.items() :
+        f = by_key.get(k)
+        if f is None :
+            continue
+        topic = f"{base}/{f['state_topic']}" if f['state_topic'] else f"{base}/tlm/{f['field']}"
+        out.append((topic, wrap(field_value(f, v))))
+    return out
+
+def run_bridge(args, fields:list, sid:int) :
+    host,port = args.broker.rsplit(':',1)
+    keepalive = 60
+
+    sock = socket.create_connection((host, int(port)))
+    sock.sendall(packet(0x10, utf8('MQTT') + bytes([4, 0x02]) + struct.pack('!H', keepalive) + utf8(f'tlm-bridge-{os.getpid()}')))
+    header,body = read_packet(sock)
+    if header != 0x20 or body[1] != 0 :
+        raise SystemExit(f'CONNACK refused: {body.hex()}')
+
+    # QoS 1, the device publishes with QoS 1 as well
+    sock.sendall(packet(0x82, struct.pack('!H', 1) + utf8(f'{args.prefix}/+/tlm') + bytes([1])))
+    sock.settimeout(keepalive / 2)
+
+    while True :
+        try :
+            header,body = read_packet(sock)
+        except socket.timeout :
+            sock.sendall(packet(0xC0, b''))
+            continue
+
+        if (header & 0xF0) != 0x30 :
+            continue
+
+        qos = (header >> 1) & 0x03
+        tlen = struct.unpack('!H', body[:2])[0]
+        topic = body[2:2+tlen].decode()
+        pos = 2 + tlen
+        if qos :
+            sock.sendall(packet(0x40, body[pos:pos+2]))
+            pos += 2
+
+        base = topic.rsplit('/',1)[0]
+        try :
+            pairs = fan_out(fields, sid, base, body[pos:])
+        except (ValueError, IndexError, KeyError) as e :
+            print(f'{topic}: dropped, {e}', file=sys.stderr)
+            continue
+
+        for t,v in pairs :
+            # Retained like the ASCII publishes of the firmware
+            sock.sendall(packet(0x31, utf8(t) + v.encode()))
+        print(f'{topic}: {len(body) - pos} bytes -> {len(pairs)} topics')
+
+def publish_b(args, leaf:str, payload:int) -> int:
+    """Bytes on the air of a QoS 1 publish and its PUBACK."""
+    body = 2 + len(args.base) + 1 + len(leaf) + 2 + payload
+    mqtt = 1 + len(remaining_length(body)) + body
+    return (args.record_b + mqtt) + (args.record_b + 4)
+
+def run_size(args, fields:list, sid:int) :
+    """The pump state and water events are ASCII in both formats and left out."""
+    ascii_hb = publish_b(args, 'availability', len('online')) + publish_b(args, 'batt', len('3.87'))
+    ascii_pump = publish_b(args, 'pump/cycles', len('1234')) + publish_b(args, 'pump/runtime', len('45'))
+
+    keys = { f['field'] : f['key'] for f in fields }
+    hb = { 0:sid, keys['batt_mv']:3870, keys['uptime_s']:2592000, keys['lte_tx_kb']:2000,
+           keys['lte_rx_kb']:500, keys['rrc_connected_s']:3600, keys['psm_tau_s']:3240 }
+    pump = { 0:sid, keys['pump_cycles']:1234, keys['pump_runtime_s']:45 }
+    cbor_hb = publish_b(args, 'tlm', len(cbor_encode(hb)))
+    cbor_pump = publish_b(args, 'tlm', len(cbor_encode(pump)))
+
+    ascii_day = args.heartbeats * ascii_hb + args.pump_cycles * ascii_pump
+    cbor_day = args.heartbeats * cbor_hb + args.pump_cycles * cbor_pump
+
+    print(f"{'':10s}{'heartbeat':>12s}{'pump cycle':>12s}{'per day':>12s}")
+    print(f"{'ASCII':10s}{ascii_hb:12d}{ascii_pump:12d}{ascii_day:12.0f}")
+    print(f"{'CBOR':10s}{cbor_hb:12d}{cbor_pump:12d}{cbor_day:12.0f}")
+    print(f"CBOR heartbeat payload {len(cbor_encode(hb))} bytes, it also carries the LTE stats.")
+    print(f"Saved {ascii_day - cbor_day:.0f} bytes per day ({100.0 * (ascii_day - cbor_day) / ascii_day:.0f}%).")
+
+def main(args:list=None) :
+    """Main function to run script.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+    """
+
+    args = parse_args(args)
+    fields = load_schema(args.csv)
+    sid = schema_id(fields)
+
+    if args.cmd == 'bridge' :
+        run_bridge(args, fields, sid)
+    else :
+        run_size(args, fields, sid)
+
+if __name__ == '__main__':
+    main()
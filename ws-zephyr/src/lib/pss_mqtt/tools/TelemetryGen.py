@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+from jinja2 import Template
+import argparse
+import csv
+import os
+import glob
+import sys
+
+def parse_args(argv:list=None):
+    """Parses command line arguments and returns them as a namespace.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+
+    Returns:
+        Namespace: Namespace containing specified arguments.
+    """
+    parser = argparse.ArgumentParser(description='Generates the CBOR telemetry schema of the firmware encoder.')
+
+    parser.add_argument('-i','--csv', action='store',default="../cfg/telemetry.csv", help='CSV containing the telemetry schema.')
+    parser.add_argument('-o','--output-folder', action='store',default="../gen", help='folder to store the generated files.')
+    parser.add_argument('-t','--templates', action='store',default="./templates/telemetry", help="folder containing jinja templates.")
+    parser.add_argument('--no-rel',action="store_false",help="Argument paths are relative to this script unless this is set.")
+    parser.add_argument('-c','--check',action="store_true",help="Checks if generation output matches the current files. Exits with error if they do not match.")
+
+    args = parser.parse_args(argv)
+
+    if args.no_rel :
+        cur = os.path.dirname(__file__)
+
+        args.csv = os.path.join(cur,args.csv)
+        assert os.path.exists(args.csv)
+
+        args.output_folder = os.path.join(cur,args.output_folder)
+        if not os.path.exists(args.output_folder) :
+            os.mkdir(args.output_folder)
+
+        args.templates = os.path.join(cur,args.templates)
+        assert os.path.exists(args.templates)
+
+    return args
+
+# Key 0 of every message carries the schema id, the fields start at 1
+SCHEMA_KEY = 0
+TYPES = ('uint', 'int')
+
+def fnv1a_32(data:bytes) -> int:
+    """32 bit FNV-1a hash."""
+    h = 0x811c9dc5
+    for b in data :
+        h ^= b
+        h = (h * 0x01000193) & 0xffffffff
+    return h
+
+def load_schema(path:str) -> list:
+    """Reads the schema table. Shared with TelemetryBridge.py so the device
+    and the host always agree on it.
+
+    Args:
+        path (str): CSV containing the telemetry schema.
+
+    Returns:
+        list: One dict per field, ordered by key.
+    """
+    fields = []
+
+    with open(path, 'r') as f :
+        for row in csv.DictReader(f) :
+            row = { k.strip() : (v.strip() if v else '') for k,v in row.items() }
+            field = {
+                "key" : int(row['key']),
+                "field" : row['field'],
+                "type" : row['type'],
+                "state_topic" : row['state_topic'],
+                "scale" : float(row['scale']) if row['scale'] else None,
+                "format" : row['format'] or '%d',
+            }
+            # Keys 1..23 encode in a single CBOR byte
+            assert SCHEMA_KEY < field['key'] <= 23, f"{field['field']}: key must be 1..23"
+            assert field['type'] in TYPES, f"{field['field']}: type must be one of {TYPES}"
+            fields.append(field)
+
+    keys = [f['key'] for f in fields]
+    assert len(keys) == len(set(keys)), "duplicate key"
+
+    return sorted(fields, key=lambda f: f['key'])
+
+def schema_id(fields:list) -> int:
+    """16 bit id of the schema, the bridge drops messages of another schema."""
+    h = fnv1a_32(';'.join(f"{f['key']},{f['field']},{f['type']}" for f in fields).encode())
+    return (h >> 16) ^ (h & 0xffff)
+
+def load_config(args) -> dict:
+    """Builds the template context from the schema table.
+
+    Args:
+        args (Namespace): Command-line/default arguments.
+
+    Returns:
+        dict: Fields and the schema id.
+    """
+    fields = load_schema(args.csv)
+
+    return {
+        "fields" : fields,
+        "schema_id" : f"0x{schema_id(fields):04x}u",
+        # Map head and break byte, the schema id (key + 3 bytes), each field as key + up to 5 bytes
+        "encoded_max" : 2 + 4 + 6 * len(fields),
+    }
+
+def generate_files(config:dict, args) :
+    """Generates or checks files from Jinja2 templates using config read by load_config function.
+
+    Args:
+        config (dict): Config returned from load_config function
+        args (_type_): Namespace of command-line/default arguments.
+    """
+
+    templates = glob.glob(args.templates+"/*.jinja")
+
+    for t in templates :
+        fname = os.path.basename(t).replace(".jinja",'')
+        output = os.path.join(args.output_folder,fname)
+
+        with open(t,'r') as f :
+            j_temp = Template(f.read(),trim_blocks=True)
+
+        content = j_temp.render(config=config)
+
+        if content[-1] != '\n' :
+            content = content + '\n'
+
+        if args.check :
+            with open(output,'r') as d :
+                dest = d.read()
+            if content != dest :
+                print("Generated content for %s does not match! Did you modify the generated code or forget to re-generate??"%fname,
+                    file=sys.stderr)
+                sys.exit(1)
+        else :
+            with open(output,'w') as out :
+                out.write(content)
+
+
+def main(args:list=None) :
+    """Main function to run script.
+
+    Args:
+        argv (list, optional): List of command to be parse as argument. Defaults to None.
+    """
+
+    args = parse_args(args)
+
+    config = load_config(args)
+
+    generate_files(config,args)
+
+if __name__ == '__main__':
+    main()
@@ -24,6 +24,9 @@ static bool initialized = false;
 static int64_t last_modem_reset = 0;
 static pss_nrf_lte_state_t state;
 static pss_nrf_lte_evt_handler_t handler;
+static int32_t psm_tau = -1; // Periodic TAU granted by the network, -1 without PSM
+static int64_t rrc_connected_at = -1; // Uptime of the last RRC connected event, -1 when idle
+static pss_nrf_lte_rrc_stats_t rrc_stats;
 
 #if IS_ENABLED(CONFIG_PSS_NRF_LTE_CONNECTION_STATISTICS)
 static int64_t stat_start_time = 0;
@@ -56,6 +59,16 @@ pss_nrf_lte_state_t pss_nrf_lte_get_state(void)
     return state;
 }
 
+void pss_nrf_lte_get_rrc_stats(pss_nrf_lte_rrc_stats_t* stats)
+{
+    *stats = rrc_stats;
+}
+
+int32_t pss_nrf_lte_get_psm_tau(void)
+{
+    return psm_tau;
+}
+
 /**
  * @brief Read the current time and daylight saving time.
  */
@@ -172,6 +185,7 @@ static void lte_handler_cb(const struct lte_lc_evt* const evt)
             LOG_DBG("PSM parameter update: TAU: %d, Active time: %d",
                     evt->psm_cfg.tau,
                     evt->psm_cfg.active_time);
+            psm_tau = evt->psm_cfg.tau;
             break;
         case LTE_LC_EVT_EDRX_UPDATE: {
             char log_buf[60];
@@ -187,10 +201,29 @@ static void lte_handler_cb(const struct lte_lc_evt* const evt)
             }
             break;
         }
-        case LTE_LC_EVT_RRC_UPDATE:
-            LOG_DBG("RRC mode: %s",
-                    evt->rrc_mode == LTE_LC_RRC_MODE_CONNECTED ? "Connected" : "Idle");
+        case LTE_LC_EVT_RRC_UPDATE: {
+            int64_t now = k_uptime_get();
+
+            if (evt->rrc_mode == LTE_LC_RRC_MODE_CONNECTED) {
+                rrc_connected_at = now;
+                rrc_stats.connects++;
+                LOG_DBG("RRC mode: Connected at %d ms", (int32_t)now);
+            } else if (rrc_connected_at >= 0) {
+                uint32_t connected = (uint32_t)(now - rrc_connected_at);
+
+                rrc_connected_at = -1;
+                rrc_stats.last_connected_ms = connected;
+                rrc_stats.connected_ms += connected;
+                LOG_DBG("RRC mode: Idle at %d ms, connected for %d ms (total %d ms over %d)",
+                        (int32_t)now,
+                        connected,
+                        rrc_stats.connected_ms,
+                        rrc_stats.connects);
+            } else {
+                LOG_DBG("RRC mode: Idle");
+            }
             break;
+        }
         case LTE_LC_EVT_CELL_UPDATE:
             LOG_DBG("LTE cell changed: Cell ID: %d, Tracking area: %d",
                     evt->cell.id,
@@ -350,6 +383,32 @@ void pss_nrf_lte_print_connection_stats(void)
 #endif
 }
 
+int32_t pss_nrf_lte_get_data_kb(int32_t* data_tx, int32_t* data_rx)
+{
+#if IS_ENABLED(CONFIG_PSS_NRF_LTE_CONNECTION_STATISTICS)
+    int32_t sms_tx, sms_rx, packet_max, packet_avg;
+    char en_stat_buf[128];
+    int err;
+
+    err = nrf_modem_at_cmd(en_stat_buf, sizeof(en_stat_buf), "AT%%XCONNSTAT?");
+    if (0 == err) {
+        err = extract_XCONNSTAT(en_stat_buf,
+                                &sms_tx,
+                                &sms_rx,
+                                data_tx,
+                                data_rx,
+                                &packet_max,
+                                &packet_avg);
+    }
+
+    return (0 == err) ? 0 : -EIO;
+#else
+    ARG_UNUSED(data_tx);
+    ARG_UNUSED(data_rx);
+    return -ENOTSUP;
+#endif
+}
+
 /**
  * @brief Get a epoch timestamp of "now", in milliseconds.
  *
@@ -9,6 +9,15 @@ typedef enum {
     LTE_STATE_DISCONNECTED,
 } pss_nrf_lte_state_t;
 
+/**
+ * @brief Time spent in RRC connected mode, the radio is on for all of it
+ */
+typedef struct {
+    uint32_t connects;          // RRC connected events
+    uint32_t connected_ms;      // Total time in RRC connected mode
+    uint32_t last_connected_ms; // Length of the last RRC connected period
+} pss_nrf_lte_rrc_stats_t;
+
 typedef void (*pss_nrf_lte_evt_handler_t)(const pss_nrf_lte_state_t evt);
 
 /**
@@ -48,6 +57,17 @@ int32_t pss_nrf_lte_deinit(void);
 */
 void pss_nrf_lte_print_connection_stats(void);
 
+/**
+ * @brief Read the data counters of the connection statistics
+ *
+ * @param data_tx Kilobytes sent since tracking started
+ * @param data_rx Kilobytes received since tracking started
+ * @retval 0 if successful.
+ * @retval -ENOTSUP if connection statistics are disabled.
+ * @retval -EIO if the modem could not be read.
+*/
+int32_t pss_nrf_lte_get_data_kb(int32_t* data_tx, int32_t* data_rx);
+
 /**
  * @brief Set get the LTE time
  *
@@ -63,4 +83,18 @@ int64_t pss_nrf_lte_get_time(void);
  * @retval LTE_STATE_ERROR A problem reaching the network or registering
  */
 pss_nrf_lte_state_t pss_nrf_lte_get_state(void);
+
+/**
+ * @brief Copy the RRC connected mode statistics
+ *
+ * @param stats Destination
+ */
+void pss_nrf_lte_get_rrc_stats(pss_nrf_lte_rrc_stats_t* stats);
+
+/**
+ * @brief Return the periodic TAU granted with PSM
+ *
+ * @return The TAU in seconds, -1 if PSM is not in use
+ */
+int32_t pss_nrf_lte_get_psm_tau(void);
 #endif // PSS_NRF_LTE_H
@@ -3,13 +3,14 @@
 #include "trigger.h"
 #include "pss_nrf_lte.h"
 #include "pss_mqtt.h"
+#include "pss_config.h"
 
 #include <zephyr/logging/log.h>
 #include <zephyr/kernel.h>
 #include <zephyr/devicetree.h>
 #include <zephyr/drivers/gpio.h>
 
-#define TEN_SEC_IN_12HOURS (4320)
+#define HEARTBEAT_TICK_S (10) // main_main_hearbeat() runs every 10 s
 
 LOG_MODULE_REGISTER(main, LOG_LEVEL_INF);
 
@@ -39,28 +40,60 @@ void main_main_blink(void)
   gpio_pin_toggle_dt(&led4);
 }
 
+/**
+ * @brief The heartbeat as one CBOR message, availability is kept by the
+ * session start and the last will
+ */
+static void main_hearbeat_tlm_pub(const battery_info_t *batt)
+{
+  pss_nrf_lte_rrc_stats_t rrc;
+  int32_t tx_kb;
+  int32_t rx_kb;
+
+  pss_mqtt_telemetry_set(PSS_MQTT_TLM_BATT_MV, (int32_t)batt->lvl_mV);
+  pss_mqtt_telemetry_set(PSS_MQTT_TLM_UPTIME_S, (int32_t)(k_uptime_get() / 1000));
+
+  if (0 == pss_nrf_lte_get_data_kb(&tx_kb, &rx_kb))
+  {
+    pss_mqtt_telemetry_set(PSS_MQTT_TLM_LTE_TX_KB, tx_kb);
+    pss_mqtt_telemetry_set(PSS_MQTT_TLM_LTE_RX_KB, rx_kb);
+  }
+
+  pss_nrf_lte_get_rrc_stats(&rrc);
+  pss_mqtt_telemetry_set(PSS_MQTT_TLM_RRC_CONNECTED_S, (int32_t)(rrc.connected_ms / 1000));
+  pss_mqtt_telemetry_set(PSS_MQTT_TLM_PSM_TAU_S, pss_nrf_lte_get_psm_tau());
+
+  (void)pss_mqtt_telemetry_flush();
+}
+
 void main_hearbeat_pub(void)
 {
   battery_info_t batt;
   char batt_v[10];
+  int len;
 
   battery_get_last_read(&batt);
-  snprintf(batt_v, sizeof(batt_v), "%.2f", ((float)batt.lvl_mV / 1000.0f));
+  if (IS_ENABLED(CONFIG_PSS_MQTT_TELEMETRY_CBOR))
+  {
+    main_hearbeat_tlm_pub(&batt);
+    return;
+  }
+
+  len = snprintf(batt_v, sizeof(batt_v), "%.2f", ((float)batt.lvl_mV / 1000.0f));
 
   pss_mqtt_publish(
-          "homeassistant/sump/availability",
-          "online",
-          MQTT_QOS_1_AT_LEAST_ONCE);
+          PSS_MQTT_TOPIC_AVAILABILITY,
+          PSS_MQTT_PAYLOAD_LIT("online"));
   pss_mqtt_publish(
-      "homeassistant/sump/batt",
-      batt_v,
-      MQTT_QOS_1_AT_LEAST_ONCE);
+      PSS_MQTT_TOPIC_BATT,
+      PSS_MQTT_PAYLOAD(batt_v, len));
 }
 
 void main_main_hearbeat(void)
 {
   static int32_t loop_cnt = 0;
   battery_info_t batt;
+  pss_config_t cfg;
   char batt_v[10];
 
   battery_get_last_read(&batt);
@@ -69,7 +102,8 @@ void main_main_hearbeat(void)
 
   if (loop_cnt == 0)
   {
-    if (pss_mqtt_connected())
+    // On demand the heartbeat itself opens the session
+    if (pss_mqtt_connected() || IS_ENABLED(CONFIG_PSS_MQTT_ON_DEMAND))
     {
       main_hearbeat_pub();
       loop_cnt++;
@@ -78,7 +112,8 @@ void main_main_hearbeat(void)
   else
   {
     loop_cnt++;
-    if (loop_cnt > TEN_SEC_IN_12HOURS)
+    pss_config_get(&cfg);
+    if (loop_cnt > (int32_t)(cfg.heartbeat_s / HEARTBEAT_TICK_S))
     {
       loop_cnt = 0;
     }
@@ -88,6 +123,12 @@ void main_main_hearbeat(void)
 int main(void)
 {
   init_led();
+  pss_config_init();
+  if (IS_ENABLED(CONFIG_PSS_MQTT_ENVELOPE))
+  {
+    // Before the triggers and the battery can publish
+    pss_mqtt_env_init();
+  }
   battery_init();
   battery_main();
 
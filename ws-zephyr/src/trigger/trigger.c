@@ -5,6 +5,7 @@
 #include <zephyr/kernel.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/logging/log.h>
+#include <stdio.h>
 
 LOG_MODULE_REGISTER(trigger, CONFIG_TRIGGER_LOG_LEVEL);
 
@@ -14,45 +15,84 @@ static const struct gpio_dt_spec button1 = GPIO_DT_SPEC_GET(DT_NODELABEL(button0
 static const struct gpio_dt_spec button2 = GPIO_DT_SPEC_GET(DT_NODELABEL(button1), gpios);
 
 static struct gpio_callback gpio_cb_data;
+
+// Pump analytics
+static int64_t pump_start_time = 0;
+static uint32_t pump_cycles = 0;
+
+/**
+ * @brief Publish the pump cycle count and the length of the last run
+ */
+static void pump_analytics_pub(void)
+{
+	char cycles[12];
+	char runtime[12];
+	int cycles_len;
+	int runtime_len;
+	int64_t run_ms = k_uptime_get() - pump_start_time;
+
+	pump_cycles++;
+	if (IS_ENABLED(CONFIG_PSS_MQTT_TELEMETRY_CBOR)) {
+		pss_mqtt_telemetry_set(PSS_MQTT_TLM_PUMP_CYCLES, (int32_t)pump_cycles);
+		pss_mqtt_telemetry_set(PSS_MQTT_TLM_PUMP_RUNTIME_S, (int32_t)(run_ms / 1000));
+		(void)pss_mqtt_telemetry_flush();
+		return;
+	}
+
+	cycles_len = snprintf(cycles, sizeof(cycles), "%u", (unsigned int)pump_cycles);
+	runtime_len = snprintf(runtime, sizeof(runtime), "%d", (int)(run_ms / 1000));
+
+	pss_mqtt_publish(
+		PSS_MQTT_TOPIC_PUMP_CYCLES,
+		PSS_MQTT_PAYLOAD(cycles, cycles_len)
+	);
+	pss_mqtt_publish(
+		PSS_MQTT_TOPIC_PUMP_RUNTIME,
+		PSS_MQTT_PAYLOAD(runtime, runtime_len)
+	);
+}
+
 void gpio_int_cb(const struct device *dev, struct gpio_callback *cb,
 		    uint32_t pins)
 {
+	uint32_t edge_cyc = k_cycle_get_32();
 	int32_t val;
 
 	if(BIT(pump_trigger.pin) & pins) {
 		val = gpio_pin_get_dt(&pump_trigger);
 		if(1 == val) {
 			LOG_INF("Pump Running....");
+			pump_start_time = k_uptime_get();
 			pss_mqtt_publish(
-				"homeassistant/sump/pump",
-				"ON",
-				MQTT_QOS_1_AT_LEAST_ONCE
+				PSS_MQTT_TOPIC_PUMP,
+				PSS_MQTT_PAYLOAD_LIT("ON")
 			);
 		}
 		else {
 			LOG_INF("Pump Stopped....");
 			pss_mqtt_publish(
-				"homeassistant/sump/pump",
-				"ON",
-				MQTT_QOS_1_AT_LEAST_ONCE
+				PSS_MQTT_TOPIC_PUMP,
+				PSS_MQTT_PAYLOAD_LIT("OFF")
 			);
+			pump_analytics_pub();
 		}
 	} else if (BIT(water_detect.pin) & pins) {
+		if (IS_ENABLED(CONFIG_PSS_MQTT_ALARM_LATENCY)) {
+			pss_mqtt_alarm_edge(edge_cyc);
+		}
 		val = gpio_pin_get_dt(&water_detect);
 		if(1 == val) {
 			LOG_INF("Water Detected....");
 			pss_mqtt_publish(
-				"homeassistant/sump/sensor",
-				"ON",
-				MQTT_QOS_1_AT_LEAST_ONCE
+				PSS_MQTT_TOPIC_SENSOR,
+				PSS_MQTT_PAYLOAD_LIT("ON")
 			);
 		}
 		else {
 			LOG_INF("No Water :D....");
 			pss_mqtt_publish(
-				"homeassistant/sump/sensor",
-				"OFF",
-				MQTT_QOS_1_AT_LEAST_ONCE
+				PSS_MQTT_TOPIC_SENSOR,
+				PSS_MQTT_PAYLOAD_LIT("OFF")
 			);
 		}
 	} else if (BIT(button1.pin) & pins) {
@@ -188,5 +228,5 @@ void trigger_main(void)
 {
 	// char topic[] = "topic/test";
 	// char msg[] = "{\"message\":\"HI\"}";
-	// pss_mqtt_publish(&topic,&msg,MQTT_QOS_1_AT_LEAST_ONCE);
+	// pss_mqtt_publish(PSS_MQTT_TOPIC_SENSOR, PSS_MQTT_PAYLOAD(msg, sizeof(msg) - 1));
 }